@@ -0,0 +1,69 @@
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "batch.h"
+#include "dispatch.h"
+#include "parser.h"
+
+void tagFile(dispatcher& disp, std::string_view name, const std::vector<std::string_view>& words,
+	     batch_stats& stats){
+  dispatcher::fileid f = disp.fileId(name);
+  stats.files++;
+  for(size_t i = 0; i < words.size(); ++i){
+    std::string_view w = words[i];
+    if(w == "-"){
+      if(f == dispatcher::NONE) continue;
+      // a copy, the row shrinks while unlinking
+      std::vector<dispatcher::tagid> tags = disp.tagsOf(f);
+      for(size_t j = 0; j < tags.size(); ++j) disp.unlinkIds(f, tags[j]);
+      stats.removed += tags.size();
+    }else if(w[0] == '-'){
+      dispatcher::tagid t = disp.tagId(w.substr(1));
+      if(f == dispatcher::NONE || t == dispatcher::NONE) continue;
+      disp.unlinkIds(f, t);
+      stats.removed++;
+    }else{
+      if(f == dispatcher::NONE){
+	f = disp.defineFile(name);
+	if(f == dispatcher::NONE){
+	  // named like a tag, nothing can be done with it
+	  stats.rejected++;
+	  return;
+	}
+      }
+      dispatcher::tagid t = disp.defineTag(w);
+      if(t == dispatcher::NONE){
+	stats.rejected++;
+	continue;
+      }
+      disp.linkIds(f, t);
+      stats.added++;
+    }
+  }
+  if(f != dispatcher::NONE && disp.tagsOf(f).empty()) disp.removeFile(f);
+}
+
+batch_stats applyBatch(dispatcher& disp, std::string_view text){
+  batch_stats stats;
+  parser::parse(text, [&](parser::name name, const parser::tags& words){
+      tagFile(disp, name, words, stats);
+    });
+  return stats;
+}
+
+std::vector<std::string_view> splitWords(std::string_view list){
+  std::vector<std::string_view> result;
+  while(true){
+    size_t comma = list.find(',');
+    std::string_view w = list.substr(0, comma);
+    size_t first = w.find_first_not_of(" \t\n\r");
+    if(first != std::string_view::npos){
+      size_t last = w.find_last_not_of(" \t\n\r");
+      result.push_back(w.substr(first, last - first + 1));
+    }
+    if(comma == std::string_view::npos) break;
+    list.remove_prefix(comma + 1);
+  }
+  return result;
+}
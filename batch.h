@@ -0,0 +1,42 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <stddef.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dispatch.h"
+
+// tagging of many files at once, as trivialtags does for one file. Every change is
+// the name of a file and a list of words with the meaning of trivialtags arguments:
+//   tag    -- the file gets the tag (defined if needed)
+//   -tag   -- the file loses the tag
+//   -      -- the file loses all its tags
+// A batch is written in the syntax of .tags, one section per change:
+//   name of file { tag1, -tag2 }
+// Changes go straight to the dispatcher without keeping the co-occurrence index
+// (see dispatcher::optimize), so applying a batch costs the size of the batch.
+struct batch_stats
+{
+  size_t files;
+  size_t added;
+  size_t removed;
+  // words naming a file instead of a tag, and files named like tags
+  size_t rejected;
+
+  batch_stats(void) : files(0), added(0), removed(0), rejected(0) { }
+};
+
+// a file left without tags is removed
+void tagFile(dispatcher& disp, std::string_view name, const std::vector<std::string_view>& words,
+	     batch_stats& stats);
+// the same for every section of the text
+batch_stats applyBatch(dispatcher& disp, std::string_view text);
+
+// "a, -b , c" as it is given to trivialtags: trimmed words, empty ones are skipped.
+// The views point into list
+std::vector<std::string_view> splitWords(std::string_view list);
+
+#endif /* __BATCH_H */
@@ -0,0 +1,681 @@
+// micro-benchmarks for the dispatcher; built by "make bench", not installed.
+// usage: trivialfs-bench [files [tags [tags per file]]]
+//        trivialfs-bench load [files]      -- startup time on a synthetic .tags
+//        trivialfs-bench tagging [files [changes [script runs]]]
+//                                          -- batch tagging against the trivialtags script
+//        trivialfs-bench suite [files [tags [tags per file [zipf exponent]]]]
+//                                          -- latencies, one JSON object per line
+//        trivialfs-bench corpus dir [files [tags [tags per file [zipf exponent]]]]
+//                                          -- writes dir/.tags for mounting by hand
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "batch.h"
+#include "bitmask.h"
+#include "cache.h"
+#include "dispatch.h"
+#include "fusebench.h"
+#include "parallel.h"
+#include "query.h"
+#include "stats.h"
+#include "tagindex.h"
+#include "util.h"
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// deterministic pseudo-random numbers, so that runs are comparable
+static unsigned long long rng_state = 88172645463325252ULL;
+static size_t rnd(size_t n){
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state % n;
+}
+
+static std::string tagName(size_t i){
+  char buf[32];
+  snprintf(buf, sizeof(buf), "tag%zu", i);
+  return buf;
+}
+static std::string fileName(size_t i){
+  char buf[32];
+  snprintf(buf, sizeof(buf), "file%zu.pdf", i);
+  return buf;
+}
+
+// the representation used before bitmask: one proxy bit at a time
+struct boolMatrices
+{
+  std::vector< std::vector<bool> > tags_of_file;
+  std::vector< std::vector<bool> > files_with_tag;
+
+  std::pair< std::vector<bool>, std::vector<bool> > directory(const std::vector<dispatcher::tagid>& tags) const {
+    size_t files_count = tags_of_file.size();
+    size_t tags_count = files_with_tag.size();
+    std::vector<bool> files(files_count, true);
+    for(size_t i = 0; i < tags.size(); ++i){
+      const std::vector<bool>& column = files_with_tag[tags[i]];
+      for(size_t j = 0; j < files_count; ++j) files[j] = files[j] & column[j];
+    }
+    std::vector<bool> subtags(tags_count, false);
+    for(size_t f = 0; f < files_count; ++f){
+      if(!files[f]) continue;
+      const std::vector<bool>& row = tags_of_file[f];
+      for(size_t j = 0; j < tags_count; ++j) subtags[j] = subtags[j] | row[j];
+    }
+    for(size_t i = 0; i < tags.size(); ++i) subtags[tags[i]] = false;
+    return std::make_pair(subtags, files);
+  }
+};
+
+// subdirectories computed from dense per-file bitmask rows, as before the adjacency lists
+struct denseRows
+{
+  std::vector<bitmask> tags_of_file;
+
+  bitmask subtags(const std::vector<dispatcher::tagid>& tags, const posting_list& files) const {
+    bitmask result(tags_of_file.empty() ? 0 : tags_of_file[0].size(), false);
+    for(posting_list::const_iterator it = files.begin(); it != files.end(); ++it){
+      result |= tags_of_file[*it];
+    }
+    for(size_t i = 0; i < tags.size(); ++i) result.reset(tags[i]);
+    return result;
+  }
+};
+
+// the path of given depth which keeps as many files as possible, going greedily down
+static std::vector<dispatcher::tagid> popularPath(const dispatcher& disp, size_t depth){
+  std::vector<dispatcher::tagid> path;
+  for(size_t d = 0; d < depth; ++d){
+    posting_list current = disp.tagsIntersectionIds(path);
+    bitmask children = disp.childTags(path, current);
+    size_t best = children.size(), best_count = 0;
+    for(size_t t = children.next(0); t < children.size(); t = children.next(t + 1)){
+      std::vector<dispatcher::tagid> candidate(path);
+      candidate.push_back(t);
+      size_t count = disp.tagsIntersectionIds(candidate).cardinality();
+      if(count > best_count){
+	best = t;
+	best_count = count;
+      }
+    }
+    if(best == children.size()) break;
+    path.push_back(best);
+  }
+  return path;
+}
+
+template<class F>
+static double timeIt(F f, int repeat){
+  double start = now();
+  for(int i = 0; i < repeat; ++i) f();
+  return (now() - start) / repeat;
+}
+
+// writes a synthetic .tags with the given number of files and returns its path
+static std::string writeCorpus(size_t files, size_t tags, size_t per_file){
+  char path[] = "/tmp/trivialfs-bench-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *f = fdopen(fd, "w");
+  for(size_t i = 0; i < files; ++i){
+    fprintf(f, "%s {", fileName(i).c_str());
+    for(size_t k = 0; k < per_file; ++k){
+      fprintf(f, "%s %s", k == 0 ? "" : ",", tagName(rnd(rnd(tags) + 1)).c_str());
+    }
+    fprintf(f, " }\n");
+  }
+  fclose(f);
+  return path;
+}
+
+// tag popularity by Zipf's law: the tag of rank i (from 0) is picked with probability
+// proportional to 1 / (i + 1)^s; s = 0 makes all tags equally popular
+class zipf_sampler
+{
+  std::vector<double> cdf;
+
+public:
+  zipf_sampler(size_t n, double s) : cdf(n) {
+    double sum = 0;
+    for(size_t i = 0; i < n; ++i){
+      sum += pow(i + 1, -s);
+      cdf[i] = sum;
+    }
+    for(size_t i = 0; i < n; ++i) cdf[i] /= sum;
+  }
+
+  size_t operator()(void) const {
+    double u = rnd(1 << 30) / (double) (1 << 30);
+    size_t i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    return std::min(i, cdf.size() - 1);
+  }
+};
+
+// writes a .tags where every file has per_file distinct tags picked by Zipf's law
+static bool writeZipfCorpus(const std::string& path, size_t files, size_t tags, size_t per_file, double s){
+  FILE *f = fopen(path.c_str(), "w");
+  if(f == NULL) return false;
+  zipf_sampler pick(tags, s);
+  per_file = std::min(per_file, tags);
+  std::vector<size_t> chosen;
+  for(size_t i = 0; i < files; ++i){
+    chosen.clear();
+    // popular tags are drawn again and again when s is large, so the attempts are limited
+    for(size_t attempt = 0; chosen.size() < per_file && attempt < 100 * per_file; ++attempt){
+      size_t t = pick();
+      if(std::find(chosen.begin(), chosen.end(), t) == chosen.end()) chosen.push_back(t);
+    }
+    fprintf(f, "%s {", fileName(i).c_str());
+    for(size_t k = 0; k < chosen.size(); ++k){
+      fprintf(f, "%s %s", k == 0 ? "" : ",", tagName(chosen[k]).c_str());
+    }
+    fprintf(f, " }\n");
+  }
+  return fclose(f) == 0;
+}
+
+// runs f for about the given time in samples of `batch` calls, batch being chosen so
+// that a sample takes a couple of microseconds at least, and prints the throughput
+// and latencies of one call (by samples) as a JSON object
+template<class F>
+static void measure(const std::string& name, F f, double seconds = 0.3){
+  double start = now();
+  size_t calls = 0;
+  do{
+    f();
+    calls++;
+  }while(now() - start < 1e-3);
+  size_t batch = std::max((size_t) 1, (size_t) (2e-6 * calls / (now() - start)));
+
+  std::vector<double> samples;
+  start = now();
+  while((now() - start < seconds || samples.size() < 5) && samples.size() < 100000){
+    double begin = now();
+    for(size_t i = 0; i < batch; ++i) f();
+    samples.push_back((now() - begin) / batch);
+  }
+  double elapsed = now() - start;
+  std::sort(samples.begin(), samples.end());
+  size_t n = samples.size();
+  printf("{\"bench\": \"%s\", \"ops_per_s\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, "
+	 "\"samples\": %zu, \"batch\": %zu}\n", name.c_str(), n * batch / elapsed,
+	 samples[n / 2] * 1e9, samples[std::min(n - 1, n * 99 / 100)] * 1e9, n, batch);
+  fflush(stdout);
+}
+
+static int writeCorpusDir(const std::string& dir, size_t files, size_t tags, size_t per_file, double s){
+  std::string path = dir + "/.tags";
+  if(!writeZipfCorpus(path, files, tags, per_file, s)){
+    fprintf(stderr, "Can't write %s\n", path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+// the suite: loading, path handling and listing in the dispatcher, and the same paths
+// through the request handlers (see fusebench.h), on directories of growing depth
+// along the most populous tags
+static int benchSuite(size_t files, size_t tags, size_t per_file, double s){
+  char dir[] = "/tmp/trivialfs-bench-XXXXXX";
+  if(mkdtemp(dir) == NULL) return 1;
+  std::string storage = dir;
+  std::string tags_path = storage + "/.tags";
+  if(writeCorpusDir(storage, files, tags, per_file, s) != 0) return 1;
+  printf("{\"bench\": \"corpus\", \"files\": %zu, \"tags\": %zu, \"tags_per_file\": %zu, "
+	 "\"zipf\": %g, \"kernels\": \"%s\"}\n", files, tags, per_file, s, words_kernel_name());
+
+  measure("loadTags", [&]{ dispatcher d; loadTags(d, tags_path); }, 1);
+  // the first load writes the index, which is read by the next ones
+  fuse_harness::mount(storage);
+  measure("loadStorage/index", [&]{ dispatcher d; loadStorage(d, storage); }, 1);
+
+  // what the instrumentation of every request costs
+  measure("op_timer", [&]{ op_timer timer(op_stats::FILL); });
+
+  dispatcher disp;
+  loadTags(disp, tags_path);
+  directory_cache cache(64 << 20);
+  cache.invalidate(disp.generation());
+  for(size_t depth = 0; depth <= 3; ++depth){
+    std::vector<dispatcher::tagid> ids = popularPath(disp, depth);
+    if(ids.size() < depth) break;
+    std::vector<std::string> path;
+    std::string dir_path;
+    for(size_t i = 0; i < ids.size(); ++i){
+      path.push_back(std::string(disp.tagname(ids[i])));
+      dir_path += "/" + path.back();
+    }
+    posting_list in_dir = disp.tagsIntersectionIds(ids);
+    if(in_dir.empty()) break;
+    std::string name(disp.filename(*in_dir.begin()));
+    std::string file_path = dir_path + "/" + name;
+    if(dir_path.empty()) dir_path = "/";
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "/depth%zu", depth);
+
+    size_t sink = 0;
+    measure(std::string("splitPath") + suffix, [&]{ sink += splitPath(file_path).size(); });
+    measure(std::string("hasTags") + suffix, [&]{ sink += disp.hasTags(name, path); });
+    measure(std::string("resolvePath") + suffix, [&]{ sink += resolvePath(disp, file_path); });
+    measure(std::string("directoryStructure") + suffix, [&]{
+	sink += directoryStructure(disp, path).second.cardinality();
+      });
+    measure(std::string("directoryStructure/cached") + suffix, [&]{
+	sink += directoryStructure(disp, cache, path)->files.cardinality();
+      });
+
+    // a cold path: a lookup of every element, and forgetting them as the kernel
+    // does when it drops the entries
+    measure(std::string("fuse/lookup") + suffix, [&]{
+	sink += fuse_harness::lookupPath(file_path) != 0;
+	fuse_harness::forgetPath(file_path);
+      });
+    unsigned long file_ino = fuse_harness::lookupPath(file_path);
+    unsigned long dir_ino = fuse_harness::lookupPath(dir_path);
+    struct stat st;
+    measure(std::string("fuse/getattr") + suffix, [&]{ sink += fuse_harness::getattr(file_ino, &st); });
+    measure(std::string("fuse/getattr-dir") + suffix, [&]{ sink += fuse_harness::getattr(dir_ino, &st); });
+    // the buffer of one page, the smallest the kernel asks for
+    measure(std::string("fuse/readdir") + suffix, [&]{ sink += fuse_harness::readdir(dir_ino, 4096); });
+    if(sink == 0) printf("{\"bench\": \"error\", \"depth\": %zu}\n", depth);
+  }
+  // what the handlers recorded meanwhile, as /.trivialfs/stats.json shows it
+  printf("{\"bench\": \"stats\", \"ops\": %s", op_stats::global().json().c_str());
+  std::string cleanup = "rm -rf " + storage;
+  return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
+
+// resident set size of the process
+static size_t residentBytes(void){
+  FILE *f = fopen("/proc/self/statm", "r");
+  if(f == NULL) return 0;
+  unsigned long pages = 0, resident = 0;
+  if(fscanf(f, "%lu %lu", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int benchLoad(size_t files){
+  size_t tags_in_corpus = 20000;
+  std::string path = writeCorpus(files, tags_in_corpus, 8);
+  unsigned threads[] = { 1, defaultThreads() };
+  for(size_t i = 0; i < 2; ++i){
+    if(i == 1 && threads[1] == 1) break;
+    double start = now();
+    dispatcher disp;
+    loadTags(disp, path, threads[i]);
+    printf("loadTags, %zu files, %u thread(s): %.3f s\n", files, threads[i], now() - start);
+  }
+
+  // the binary index of the same collection
+  dispatcher disp;
+  loadTags(disp, path);
+  struct stat source;
+  stat(path.c_str(), &source);
+  std::string index_path = path + ".index";
+  double start = now();
+  tag_index::save(disp, index_path, source);
+  double t_save = now() - start;
+  start = now();
+  bool loaded = tag_index::load(disp, index_path, source);
+  printf("binary index: save %.3f s, load %.3f s%s\n", t_save, now() - start, loaded ? "" : " (failed)");
+
+  // resident memory of one more copy, loaded from the index as a mount does; what
+  // the allocator keeps from before is given back first, so that it isn't reused
+  malloc_trim(0);
+  size_t before = residentBytes();
+  {
+    dispatcher held;
+    tag_index::load(held, index_path, source);
+    size_t used = residentBytes() - before;
+    printf("resident memory: %.1f MB, %.0f bytes per file, %.0f per link; names %.1f MB, links %.1f MB\n",
+	   used / 1048576.0, (double) used / files, (double) used / (files * 8),
+	   held.namesMemoryUsage() / 1048576.0, held.linksMemoryUsage() / 1048576.0);
+  }
+  unlink(index_path.c_str());
+
+  // reload after tagging one file: only the difference is applied
+  FILE *f = fopen(path.c_str(), "a");
+  fprintf(f, "%s { %s }\n", fileName(0).c_str(), tagName(tags_in_corpus - 1).c_str());
+  fclose(f);
+  dispatcher::delta changes;
+  start = now();
+  loadTags(disp, path, defaultThreads(), &changes);
+  printf("reload with one changed file: %.3f s, %zu file(s) changed\n", now() - start, changes.files.size());
+
+  // the same files spread over storages mounted together: loaded in parallel, then
+  // one of them reloaded alone
+  const size_t storages = 4;
+  std::vector<std::string> dirs;
+  std::vector<FILE *> parts;
+  for(size_t r = 0; r < storages; ++r){
+    char dir[] = "/tmp/trivialfs-bench-XXXXXX";
+    if(mkdtemp(dir) == NULL) return 1;
+    dirs.push_back(dir);
+    parts.push_back(fopen((dirs[r] + "/.tags").c_str(), "w"));
+  }
+  FILE *whole = fopen(path.c_str(), "r");
+  char line[4096];
+  for(size_t i = 0; fgets(line, sizeof(line), whole) != NULL; ++i) fputs(line, parts[i % storages]);
+  fclose(whole);
+  for(size_t r = 0; r < storages; ++r) fclose(parts[r]);
+  for(size_t pass = 0; pass < 2; ++pass){
+    dispatcher merged;
+    start = now();
+    unsigned from_index = loadRoots(merged, dirs);
+    printf("%zu storages, %s: %.3f s\n", storages, from_index == storages ? "binary indexes" : ".tags", now() - start);
+    if(pass == 0) continue;
+    f = fopen((dirs[1] + "/.tags").c_str(), "a");
+    fprintf(f, "%s { %s }\n", fileName(1).c_str(), tagName(tags_in_corpus - 1).c_str());
+    fclose(f);
+    start = now();
+    loadStorage(merged, dirs[1], defaultThreads(), &changes, 1);
+    printf("reload of one storage with one changed file: %.3f s, %zu file(s) changed\n",
+	   now() - start, changes.files.size());
+  }
+  for(size_t r = 0; r < storages; ++r){
+    std::string cleanup = "rm -rf " + dirs[r];
+    if(system(cleanup.c_str()) != 0) return 1;
+  }
+  unlink(path.c_str());
+  return 0;
+}
+
+// a new tag for a random file, as a line of a batch
+static std::string randomChange(size_t files, size_t tags){
+  return fileName(rnd(files)) + " { " + tagName(rnd(tags)) + " }\n";
+}
+
+// the whole run of trivialtags-native --batch (load, apply, write) against running the
+// script once per change, which is what scripted tagging does; the script is slow, so
+// it is run only a few times and the rate is extrapolated
+static int benchTagging(size_t files, size_t changes, size_t script_runs){
+  size_t tags_in_corpus = 20000;
+  char dir[] = "/tmp/trivialfs-bench-XXXXXX";
+  if(mkdtemp(dir) == NULL) return 1;
+  std::string storage = dir;
+  std::string corpus = writeCorpus(files, tags_in_corpus, 8);
+  std::string tags_path = storage + "/.tags";
+  std::string copy = "cp " + corpus + " " + tags_path;
+  if(system(copy.c_str()) != 0) return 1;
+  unlink(corpus.c_str());
+
+  std::string text;
+  for(size_t i = 0; i < changes; ++i) text += randomChange(files, tags_in_corpus);
+  double start = now();
+  dispatcher disp;
+  loadTags(disp, tags_path);
+  double t_load = now() - start;
+  batch_stats stats = applyBatch(disp, text);
+  double t_apply = now() - start - t_load;
+  saveTags(disp, tags_path);
+  double t_batch = now() - start;
+  printf("batch of %zu changes on %zu files: load %.3f s, apply %.3f s, total %.3f s, %.0f changes/s\n",
+	 stats.files, files, t_load, t_apply, t_batch, changes / t_batch);
+
+  // the script works in the current directory and is looked up in the one we were started from
+  char cwd[4096];
+  if(script_runs == 0 || getcwd(cwd, sizeof(cwd)) == NULL || access("trivialtags", R_OK) != 0){
+    printf("trivialtags script: not found\n");
+  }else{
+    std::string script = std::string(cwd) + "/trivialtags";
+    start = now();
+    size_t done = 0;
+    for(; done < script_runs; ++done){
+      std::string cmd = "cd " + storage + " && python3 " + script + " " + fileName(rnd(files)) + " " +
+	tagName(rnd(tags_in_corpus)) + " >/dev/null 2>&1";
+      if(system(cmd.c_str()) != 0) break;
+    }
+    double per_change = (now() - start) / std::max(done, (size_t) 1);
+    if(done == 0){
+      printf("trivialtags script: failed to run\n");
+    }else{
+      printf("trivialtags script: %.3f s per change, %.1f changes/s; the batch is %.0fx faster\n",
+	     per_change, 1 / per_change, per_change * changes / t_batch);
+    }
+  }
+  std::string cleanup = "rm -rf " + storage;
+  return system(cleanup.c_str()) == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv){
+  if(argc > 1 && std::string(argv[1]) == "suite"){
+    return benchSuite(argc > 2 ? atol(argv[2]) : 200000, argc > 3 ? atol(argv[3]) : 20000,
+		      argc > 4 ? atol(argv[4]) : 8, argc > 5 ? atof(argv[5]) : 1.0);
+  }
+  if(argc > 2 && std::string(argv[1]) == "corpus"){
+    return writeCorpusDir(argv[2], argc > 3 ? atol(argv[3]) : 200000, argc > 4 ? atol(argv[4]) : 20000,
+			  argc > 5 ? atol(argv[5]) : 8, argc > 6 ? atof(argv[6]) : 1.0);
+  }
+  if(argc > 1 && std::string(argv[1]) == "load"){
+    return benchLoad(argc > 2 ? atol(argv[2]) : 1000000);
+  }
+  if(argc > 1 && std::string(argv[1]) == "tagging"){
+    return benchTagging(argc > 2 ? atol(argv[2]) : 100000, argc > 3 ? atol(argv[3]) : 100000,
+			argc > 4 ? atol(argv[4]) : 5);
+  }
+
+  size_t files = argc > 1 ? atol(argv[1]) : 50000;
+  size_t tags = argc > 2 ? atol(argv[2]) : 2000;
+  size_t per_file = argc > 3 ? atol(argv[3]) : 8;
+
+  printf("%zu files, %zu tags, %zu tags per file, kernels: %s\n",
+	 files, tags, per_file, words_kernel_name());
+
+  dispatcher disp;
+  boolMatrices old;
+  denseRows dense;
+  dense.tags_of_file.assign(files, bitmask(tags, false));
+  old.tags_of_file.assign(files, std::vector<bool>(tags, false));
+  old.files_with_tag.assign(tags, std::vector<bool>(files, false));
+  dispatcher::builder b;
+  b.reserve(files, tags, files * per_file);
+  for(size_t t = 0; t < tags; ++t) b.addTag(tagName(t));
+  for(size_t f = 0; f < files; ++f){
+    b.addFile(fileName(f));
+    for(size_t k = 0; k < per_file; ++k){
+      // skewed towards small ids, so that some tags are popular
+      size_t t = rnd(rnd(tags) + 1);
+      b.addLink(f, t);
+      old.tags_of_file[f][t] = true;
+      old.files_with_tag[t][f] = true;
+      dense.tags_of_file[f].set(t);
+    }
+  }
+  b.build(disp);
+  printf("memory of links: %.1f MiB (two dense matrices would take %.1f MiB)\n",
+	 disp.linksMemoryUsage() / 1048576.0, 2.0 * files * tags / 8 / 1048576.0);
+
+  // directories of depth 0, 1 and 2 over popular tags, and then the same with a rare tag
+  for(size_t depth = 0; depth <= 5; ++depth){
+    std::vector<std::string> path;
+    std::vector<dispatcher::tagid> path_ids;
+    for(size_t i = 0; i < depth % 3; ++i){
+      path.push_back(tagName(i));
+      path_ids.push_back(i);
+    }
+    if(depth >= 3){
+      path.push_back(tagName(tags - 1));
+      path_ids.push_back(tags - 1);
+    }
+    int repeat = 5;
+    double t_old = timeIt([&]{ old.directory(path_ids); }, repeat);
+    double t_new = timeIt([&]{ directoryStructure(disp, path); }, repeat);
+    printf("depth %zu%s: vector<bool> %.3f ms, dispatcher %.3f ms, speedup %.1fx\n",
+	   path.size(), depth >= 3 ? " (with a rare tag)" : "", t_old * 1e3, t_new * 1e3, t_old / t_new);
+  }
+
+  // boolean queries against the plain intersection of the same tags
+  {
+    std::vector<std::string> plain = { tagName(0), tagName(1) };
+    int repeat = 20;
+    double t_plain = timeIt([&]{ directoryStructure(disp, plain); }, repeat);
+    printf("query /%s/%s: %.3f ms (%zu files)\n", plain[0].c_str(), plain[1].c_str(), t_plain * 1e3,
+	   directoryStructure(disp, plain).second.cardinality());
+    for(size_t q = 0; q < 2; ++q){
+      std::string element = q == 0 ? "-" + tagName(1) : "(" + tagName(1) + "|" + tagName(2) + ")";
+      std::vector<std::string> path = { tagName(0), element };
+      tag_query query;
+      query.parse(disp, path);
+      double t_query = timeIt([&]{ posting_list f = query.files(disp); query.subtags(disp, f); }, repeat);
+      printf("query /%s/%s: %.3f ms (%zu files)\n", tagName(0).c_str(), element.c_str(),
+	     t_query * 1e3, query.files(disp).cardinality());
+    }
+  }
+
+  // subdirectories alone: dense rows against adjacency lists and the co-occurrence index
+  size_t depths[] = { 0, 1, 3 };
+  for(size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d){
+    std::vector<dispatcher::tagid> path_ids = popularPath(disp, depths[d]);
+    posting_list in_dir = disp.tagsIntersectionIds(path_ids);
+    int repeat = 200;
+    double t_dense = timeIt([&]{ dense.subtags(path_ids, in_dir); }, repeat);
+    double t_new = timeIt([&]{ disp.childTags(path_ids, in_dir); }, repeat);
+    printf("subdirectories at depth %zu (%zu files): dense rows %.2f us, childTags %.2f us, speedup %.1fx\n",
+	   path_ids.size(), in_dir.cardinality(), t_dense * 1e6, t_new * 1e6, t_dense / t_new);
+  }
+
+  // the same directory through the cache, spelled in a different order every time
+  directory_cache cache(64 << 20);
+  cache.invalidate(disp.generation());
+  std::vector<dispatcher::tagid> deep = popularPath(disp, 3);
+  std::vector<std::string> deep_names;
+  for(size_t i = 0; i < deep.size(); ++i) deep_names.push_back(std::string(disp.tagname(deep[i])));
+  double t_miss = timeIt([&]{ cache.invalidate(disp.generation()); directoryStructure(disp, cache, deep_names); }, 200);
+  double t_hit = timeIt([&]{
+      std::rotate(deep_names.begin(), deep_names.begin() + 1, deep_names.end());
+      directoryStructure(disp, cache, deep_names);
+    }, 200);
+  // going one level down from a cached parent
+  std::vector<std::string> parent_names(deep_names.begin(), deep_names.end() - 1);
+  double t_derived = timeIt([&]{
+      cache.invalidate(disp.generation());
+      directoryStructure(disp, cache, parent_names);
+      directoryStructure(disp, cache, deep_names);
+    }, 200) - t_miss;
+  printf("cached directory of depth %zu: miss %.2f us, hit %.2f us, derived from parent %.2f us\n%s",
+	 deep.size(), t_miss * 1e6, t_hit * 1e6, t_derived * 1e6, cache.report().c_str());
+
+  // a change of tags under a hot directory: its view is updated by the file, while
+  // the plain cache drops the listing and computes it again
+  {
+    std::vector<dispatcher::tagid> hot_ids(deep.begin(), deep.end() - 1);
+    std::vector<std::string> hot_dir;
+    for(size_t i = 0; i < hot_ids.size(); ++i) hot_dir.push_back(std::string(disp.tagname(hot_ids[i])));
+    std::vector<dispatcher::tagid> toggled(1, deep.back());
+    posting_list in_hot = disp.tagsIntersectionIds(hot_ids);
+    std::string file(disp.filename(*in_hot.begin()));
+    double t_change[2];
+    size_t files = 0;
+    for(size_t with_views = 0; with_views < 2; ++with_views){
+      dispatcher edited = disp;
+      directory_cache hot_cache(64 << 20, with_views ? 16 : 0, 16 << 20);
+      hot_cache.invalidate(edited.generation());
+      for(unsigned long i = 0; i < directory_cache::DECAY_LOOKUPS + 1; ++i) directoryStructure(edited, hot_cache, hot_dir);
+      directoryStructure(edited, hot_cache, hot_dir);
+      bool tagged = std::binary_search(edited.tagsOf(edited.fileId(file)).begin(),
+				       edited.tagsOf(edited.fileId(file)).end(), deep.back());
+      // only what follows the change itself
+      t_change[with_views] = 0;
+      timeIt([&]{
+	  unsigned long previous = edited.generation();
+	  dispatcher::delta changes;
+	  std::vector<dispatcher::tagid> none;
+	  edited.retagFile(file, tagged ? none : toggled, tagged ? toggled : none, &changes);
+	  tagged = !tagged;
+	  edited.setGeneration(dispatcher::nextGeneration());
+	  double start = now();
+	  hot_cache.retain(previous, changes, edited.generation());
+	  files += directoryStructure(edited, hot_cache, hot_dir)->files.cardinality();
+	  t_change[with_views] += now() - start;
+	}, 200);
+      t_change[with_views] /= 200;
+    }
+    printf("change under a hot directory of depth %zu (%zu files): computed again %.2f us, view updated %.2f us\n",
+	   hot_ids.size(), in_hot.cardinality(), t_change[0] * 1e6, t_change[1] * 1e6);
+    if(files == 0) printf("(empty)\n");
+  }
+
+  // getattr of a file and of a directory at growing depths: splitting the path into
+  // strings and looking names up one by one, as before, against resolvePath
+  for(size_t depth = 0; depth <= 3; ++depth){
+    std::vector<dispatcher::tagid> dir = popularPath(disp, depth);
+    posting_list in_dir = disp.tagsIntersectionIds(dir);
+    if(in_dir.empty()) break;
+    std::string dir_path;
+    for(size_t i = 0; i < dir.size(); ++i) dir_path += "/" + std::string(disp.tagname(dir[i]));
+    std::string file_path = dir_path + "/" + std::string(disp.filename(*in_dir.begin()));
+    int repeat = 200000;
+    size_t found = 0;
+    double t_split = timeIt([&]{
+	std::vector<std::string> tags = splitPath(file_path);
+	std::string name = extractFilename(tags);
+	found += disp.isFileDefined(name) && disp.hasTags(name, tags);
+      }, repeat);
+    double t_resolve = timeIt([&]{ found += resolvePath(disp, file_path) == FILE_ENTRY; }, repeat);
+    double t_dir = timeIt([&]{ found += resolvePath(disp, dir_path.empty() ? "/" : dir_path) == DIRECTORY_ENTRY; }, repeat);
+    printf("getattr at depth %zu: split and look up %.0f ns, resolvePath %.0f ns (directory %.0f ns)%s\n",
+	   depth, t_split * 1e9, t_resolve * 1e9, t_dir * 1e9, found == 3 * (size_t) repeat ? "" : " (not found)");
+  }
+
+  // reading the files of the root in pieces of a readdir buffer: every piece resumes
+  // from the id of the last entry (lowerBound), against skipping the entries before it
+  const posting_list& root = directoryStructure(disp, cache, std::vector<std::string>())->files;
+  const size_t piece = 256;
+  size_t listed = 0;
+  double t_resume = timeIt([&]{
+      uint32_t next = 0;
+      for(bool more = true; more; ){
+	size_t n = 0;
+	posting_list::const_iterator it = root.lowerBound(next);
+	for(; it != root.end() && n < piece; ++it, ++n) next = *it + 1;
+	listed += n;
+	more = it != root.end();
+      }
+    }, 3);
+  double t_skip = timeIt([&]{
+      for(size_t start = 0; start < root.cardinality(); start += piece){
+	posting_list::const_iterator it = root.begin();
+	for(size_t k = 0; k < start; ++k) ++it;
+	for(size_t n = 0; it != root.end() && n < piece; ++it, ++n) listed++;
+      }
+    }, 3);
+  // .stats of the root: files of every subdirectory, counted in one pass over the files
+  directory_cache::value root_listing = directoryStructure(disp, cache, std::vector<std::string>());
+  size_t counted = 0;
+  double t_stats = timeIt([&]{ counted += subtagCounts(disp, *root_listing).size(); }, 10);
+  printf(".stats of the root (%zu subdirectories): %.3f ms\n", root_listing->subtags.count(), t_stats * 1e3);
+  printf("root of %zu files in pieces of %zu: resuming by id %.3f ms, skipping to the position %.3f ms%s\n",
+	 root.cardinality(), piece, t_resume * 1e3, t_skip * 1e3,
+	 listed == 6 * root.cardinality() ? "" : " (lost entries)");
+  // .complete/<prefix> of the root: names found in the sorted order, against filtering
+  // the listing of the whole directory
+  std::string prefix(disp.filename(*root.begin()).substr(0, 5));
+  size_t completed = 0, filtered = 0;
+  double t_complete = timeIt([&]{ completed = completeDirectory(disp, cache, std::vector<std::string>(), prefix).files.cardinality(); }, 10);
+  double t_filter = timeIt([&]{
+      filtered = 0;
+      for(posting_list::const_iterator it = root.begin(); it != root.end(); ++it){
+	filtered += disp.filename(*it).compare(0, prefix.size(), prefix) == 0;
+      }
+    }, 10);
+  printf("completion of \"%s\" in the root (%zu files): %.3f ms, filtering the listing %.3f ms%s\n",
+	 prefix.c_str(), completed, t_complete * 1e3, t_filter * 1e3, completed == filtered ? "" : " (mismatch)");
+  return 0;
+}
@@ -0,0 +1,272 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+#include <immintrin.h>
+
+#include "bitmask.h"
+
+// SCALAR KERNELS
+// these are used on cpus without AVX2 and for the tails which don't fill a whole vector
+
+static void scalar_and(uint64_t *a, const uint64_t *b, size_t n){
+  for(size_t i = 0; i < n; ++i) a[i] &= b[i];
+}
+static void scalar_or(uint64_t *a, const uint64_t *b, size_t n){
+  for(size_t i = 0; i < n; ++i) a[i] |= b[i];
+}
+static void scalar_andnot(uint64_t *a, const uint64_t *b, size_t n){
+  for(size_t i = 0; i < n; ++i) a[i] &= ~b[i];
+}
+static size_t scalar_popcount(const uint64_t *a, size_t n){
+  size_t result = 0;
+  for(size_t i = 0; i < n; ++i) result += __builtin_popcountll(a[i]);
+  return result;
+}
+
+// AVX2 KERNELS
+// 4 words per operation; there is no vector popcount in AVX2, so it uses hardware popcnt
+
+__attribute__((target("avx2")))
+static void avx2_and(uint64_t *a, const uint64_t *b, size_t n){
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+    _mm256_storeu_si256((__m256i *) (a + i), _mm256_and_si256(x, y));
+  }
+  scalar_and(a + i, b + i, n - i);
+}
+__attribute__((target("avx2")))
+static void avx2_or(uint64_t *a, const uint64_t *b, size_t n){
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+    _mm256_storeu_si256((__m256i *) (a + i), _mm256_or_si256(x, y));
+  }
+  scalar_or(a + i, b + i, n - i);
+}
+__attribute__((target("avx2")))
+static void avx2_andnot(uint64_t *a, const uint64_t *b, size_t n){
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+    // note: _mm256_andnot_si256(y, x) is (~y) & x
+    _mm256_storeu_si256((__m256i *) (a + i), _mm256_andnot_si256(y, x));
+  }
+  scalar_andnot(a + i, b + i, n - i);
+}
+__attribute__((target("popcnt")))
+static size_t popcnt_popcount(const uint64_t *a, size_t n){
+  size_t result = 0;
+  for(size_t i = 0; i < n; ++i) result += _mm_popcnt_u64(a[i]);
+  return result;
+}
+
+// AVX-512 KERNELS
+// 8 words (exactly one cache line) per operation. Plain vector operators are used instead of
+// _mm512_and_epi64 and friends, which make gcc 12 emit bogus -Wmaybe-uninitialized warnings
+
+__attribute__((target("avx512f")))
+static void avx512_and(uint64_t *a, const uint64_t *b, size_t n){
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8){
+    __m512i x = _mm512_loadu_si512(a + i);
+    __m512i y = _mm512_loadu_si512(b + i);
+    _mm512_storeu_si512(a + i, x & y);
+  }
+  scalar_and(a + i, b + i, n - i);
+}
+__attribute__((target("avx512f")))
+static void avx512_or(uint64_t *a, const uint64_t *b, size_t n){
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8){
+    __m512i x = _mm512_loadu_si512(a + i);
+    __m512i y = _mm512_loadu_si512(b + i);
+    _mm512_storeu_si512(a + i, x | y);
+  }
+  scalar_or(a + i, b + i, n - i);
+}
+__attribute__((target("avx512f")))
+static void avx512_andnot(uint64_t *a, const uint64_t *b, size_t n){
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8){
+    __m512i x = _mm512_loadu_si512(a + i);
+    __m512i y = _mm512_loadu_si512(b + i);
+    _mm512_storeu_si512(a + i, x & ~y);
+  }
+  scalar_andnot(a + i, b + i, n - i);
+}
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static size_t avx512_popcount(const uint64_t *a, size_t n){
+  size_t i = 0;
+  __m512i acc = _mm512_setzero_si512();
+  for(; i + 8 <= n; i += 8){
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512(a + i)));
+  }
+  uint64_t lanes[8];
+  _mm512_storeu_si512(lanes, acc);
+  size_t result = 0;
+  for(int j = 0; j < 8; ++j) result += lanes[j];
+  for(; i < n; ++i) result += _mm_popcnt_u64(a[i]);
+  return result;
+}
+
+// RUNTIME SELECTION
+
+struct kernels
+{
+  const char *name;
+  void (*and_fn)(uint64_t *, const uint64_t *, size_t);
+  void (*or_fn)(uint64_t *, const uint64_t *, size_t);
+  void (*andnot_fn)(uint64_t *, const uint64_t *, size_t);
+  size_t (*popcount_fn)(const uint64_t *, size_t);
+};
+
+static kernels selectKernels(void){
+  __builtin_cpu_init();
+  kernels k = { "scalar", scalar_and, scalar_or, scalar_andnot, scalar_popcount };
+  if(__builtin_cpu_supports("popcnt")) k.popcount_fn = popcnt_popcount;
+  if(__builtin_cpu_supports("avx2")){
+    k.name = "avx2";
+    k.and_fn = avx2_and;
+    k.or_fn = avx2_or;
+    k.andnot_fn = avx2_andnot;
+  }
+  if(__builtin_cpu_supports("avx512f")){
+    k.name = "avx512";
+    k.and_fn = avx512_and;
+    k.or_fn = avx512_or;
+    k.andnot_fn = avx512_andnot;
+    if(__builtin_cpu_supports("avx512vpopcntdq")) k.popcount_fn = avx512_popcount;
+  }
+  return k;
+}
+// function-local static, so the selection is done once and is thread safe
+static const kernels& activeKernels(void){
+  static const kernels k = selectKernels();
+  return k;
+}
+
+void words_and(uint64_t *a, const uint64_t *b, size_t n){
+  activeKernels().and_fn(a, b, n);
+}
+void words_or(uint64_t *a, const uint64_t *b, size_t n){
+  activeKernels().or_fn(a, b, n);
+}
+void words_andnot(uint64_t *a, const uint64_t *b, size_t n){
+  activeKernels().andnot_fn(a, b, n);
+}
+size_t words_popcount(const uint64_t *a, size_t n){
+  return activeKernels().popcount_fn(a, n);
+}
+const char *words_kernel_name(void){
+  return activeKernels().name;
+}
+
+// BITMASK
+
+bitmask::bitmask(size_t bits, bool value) : data(NULL), nbits(0), nwords(0), capacity(0){
+  resize(bits, value);
+}
+bitmask::bitmask(size_t bits, const uint64_t *words) : data(NULL), nbits(0), nwords(0), capacity(0){
+  reserveWords(wordsFor(bits));
+  nbits = bits;
+  nwords = wordsFor(bits);
+  if(nwords > 0) std::memcpy(data, words, nwords * sizeof(uint64_t));
+  clearTail();
+}
+bitmask::bitmask(const bitmask& other) : data(NULL), nbits(0), nwords(0), capacity(0){
+  reserveWords(other.nwords);
+  if(other.nwords > 0) std::memcpy(data, other.data, other.nwords * sizeof(uint64_t));
+  nbits = other.nbits;
+  nwords = other.nwords;
+}
+bitmask& bitmask::operator=(const bitmask& other){
+  bitmask copy(other);
+  swap(copy);
+  return *this;
+}
+bitmask::~bitmask(void){
+  std::free(data);
+}
+
+void bitmask::swap(bitmask& other){
+  std::swap(data, other.data);
+  std::swap(nbits, other.nbits);
+  std::swap(nwords, other.nwords);
+  std::swap(capacity, other.capacity);
+}
+
+void bitmask::reserveWords(size_t words){
+  if(words <= capacity) return;
+  // grow geometrically: push_back is used to extend masks one bit at a time
+  size_t new_capacity = std::max(words, capacity * 2);
+  new_capacity = (new_capacity + 7) / 8 * 8;
+  uint64_t *new_data = (uint64_t *) std::aligned_alloc(64, new_capacity * sizeof(uint64_t));
+  if(new_data == NULL) throw std::bad_alloc();
+  if(nwords > 0) std::memcpy(new_data, data, nwords * sizeof(uint64_t));
+  std::memset(new_data + nwords, 0, (new_capacity - nwords) * sizeof(uint64_t));
+  std::free(data);
+  data = new_data;
+  capacity = new_capacity;
+}
+
+void bitmask::clearTail(void){
+  if(nbits % 64 != 0) data[nwords - 1] &= ((uint64_t) 1 << (nbits % 64)) - 1;
+}
+
+void bitmask::push_back(bool value){
+  if(nbits % 64 == 0){
+    reserveWords(nwords + 1);
+    data[nwords++] = 0;
+  }
+  ++nbits;
+  if(value) set(nbits - 1);
+}
+
+void bitmask::resize(size_t bits, bool value){
+  size_t words = wordsFor(bits);
+  reserveWords(words);
+  if(bits > nbits){
+    if(value){
+      for(size_t i = nbits; i < std::min(bits, nwords * 64); ++i) set(i);
+      if(words > nwords) std::memset(data + nwords, 0xff, (words - nwords) * sizeof(uint64_t));
+    }else if(words > nwords){
+      std::memset(data + nwords, 0, (words - nwords) * sizeof(uint64_t));
+    }
+  }else{
+    // words past the new end must be zero again for the next growth
+    if(words < nwords) std::memset(data + words, 0, (nwords - words) * sizeof(uint64_t));
+  }
+  nbits = bits;
+  nwords = words;
+  clearTail();
+}
+
+void bitmask::fill(bool value){
+  if(nwords == 0) return;
+  std::memset(data, value ? 0xff : 0, nwords * sizeof(uint64_t));
+  clearTail();
+}
+
+bool bitmask::any(void) const {
+  for(size_t i = 0; i < nwords; ++i){
+    if(data[i] != 0) return true;
+  }
+  return false;
+}
+
+size_t bitmask::next(size_t i) const {
+  if(i >= nbits) return nbits;
+  size_t w = i / 64;
+  uint64_t word = data[w] & (~(uint64_t) 0 << (i % 64));
+  while(word == 0){
+    if(++w >= nwords) return nbits;
+    word = data[w];
+  }
+  return w * 64 + __builtin_ctzll(word);
+}
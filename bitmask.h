@@ -0,0 +1,92 @@
+#ifndef __BITMASK_H
+#define __BITMASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// kernels over raw arrays of 64-bit words. They are implemented several times
+// (AVX-512, AVX2, plain C++) and the best version supported by the running cpu
+// is selected on the first call.
+void words_and(uint64_t *a, const uint64_t *b, size_t n);
+void words_or(uint64_t *a, const uint64_t *b, size_t n);
+void words_andnot(uint64_t *a, const uint64_t *b, size_t n);
+size_t words_popcount(const uint64_t *a, size_t n);
+// name of the selected implementation ("avx512", "avx2" or "scalar")
+const char *words_kernel_name(void);
+
+// dense set of bits, a replacement for vector<bool> which stores bits in
+// 64-byte aligned words, so that whole masks can be combined by the kernels above.
+// bits beyond size() are always kept zero.
+class bitmask
+{
+private:
+  uint64_t *data;
+  size_t nbits;
+  // both in words; capacity is always a multiple of a cache line (8 words)
+  size_t nwords;
+  size_t capacity;
+
+  void reserveWords(size_t words);
+  void clearTail(void);
+
+public:
+
+  static size_t wordsFor(size_t bits) { return (bits + 63) / 64; }
+
+  bitmask(void) : data(NULL), nbits(0), nwords(0), capacity(0) { }
+  explicit bitmask(size_t bits, bool value = false);
+  // copies wordsFor(bits) words; bits beyond size() in the last word are dropped
+  bitmask(size_t bits, const uint64_t *words);
+  bitmask(const bitmask& other);
+  bitmask& operator=(const bitmask& other);
+  ~bitmask(void);
+
+  void swap(bitmask& other);
+
+  size_t size(void) const { return nbits; }
+  const uint64_t *words(void) const { return data; }
+  size_t wordCount(void) const { return nwords; }
+
+  bool test(size_t i) const {
+    return (data[i / 64] >> (i % 64)) & 1;
+  }
+  bool operator[](size_t i) const { return test(i); }
+  void set(size_t i) {
+    data[i / 64] |= (uint64_t) 1 << (i % 64);
+  }
+  void reset(size_t i) {
+    data[i / 64] &= ~((uint64_t) 1 << (i % 64));
+  }
+  void assign(size_t i, bool value) {
+    if(value) set(i); else reset(i);
+  }
+
+  void push_back(bool value);
+  void resize(size_t bits, bool value = false);
+  void fill(bool value);
+
+  // the operands must have the same size
+  bitmask& operator&=(const bitmask& other) {
+    words_and(data, other.data, nwords);
+    return *this;
+  }
+  bitmask& operator|=(const bitmask& other) {
+    words_or(data, other.data, nwords);
+    return *this;
+  }
+  // removes all bits which are set in other
+  bitmask& andnot(const bitmask& other) {
+    words_andnot(data, other.data, nwords);
+    return *this;
+  }
+
+  size_t count(void) const { return words_popcount(data, nwords); }
+  bool any(void) const;
+
+  // position of the first set bit which is not less than i, or size() if there is none.
+  // the usual way to walk through the mask is
+  //   for(size_t i = m.next(0); i < m.size(); i = m.next(i + 1))
+  size_t next(size_t i) const;
+};
+
+#endif /* __BITMASK_H */
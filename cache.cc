@@ -0,0 +1,308 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cache.h"
+
+// a rough price of list and map nodes for one entry
+static const size_t ENTRY_OVERHEAD = 128;
+
+const unsigned long directory_cache::DECAY_LOOKUPS;
+const unsigned long directory_cache::HOT_USES;
+const size_t directory_cache::TRACKED_KEYS;
+
+directory_cache::directory_cache(size_t budget_bytes, size_t views, size_t view_budget_bytes) :
+  lru(), index(), budget(budget_bytes), used(0), current_generation(0),
+  uses(), lookups(0), hot(), views(), max_views(views), view_budget(view_budget_bytes), view_used(0),
+  hits(0), misses(0), derived(0), evictions(0), retained(0), view_hits(0), views_updated(0)
+{ }
+
+directory_cache::key directory_cache::canonical(std::vector<dispatcher::tagid> ids){
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+
+directory_cache::value directory_cache::find(const key& k, unsigned long generation, bool *wants_view){
+  std::lock_guard<std::mutex> guard(lock);
+  if(wants_view != NULL) *wants_view = false;
+  if(generation != current_generation){
+    ++misses;
+    return value();
+  }
+  noteUse(k);
+  std::map<key, view>::iterator w = views.find(k);
+  if(w != views.end()){
+    ++hits;
+    ++view_hits;
+    return w->second.v;
+  }
+  if(wants_view != NULL) *wants_view = std::binary_search(hot.begin(), hot.end(), k);
+  std::map<key, lru_list::iterator>::iterator it = index.find(k);
+  if(it == index.end()){
+    ++misses;
+    return value();
+  }
+  ++hits;
+  // move to the front
+  lru.splice(lru.begin(), lru, it->second);
+  return it->second->v;
+}
+
+directory_cache::value directory_cache::peek(const key& k, unsigned long generation) const {
+  std::lock_guard<std::mutex> guard(lock);
+  if(generation != current_generation) return value();
+  std::map<key, view>::const_iterator w = views.find(k);
+  if(w != views.end()) return w->second.v;
+  std::map<key, lru_list::iterator>::const_iterator it = index.find(k);
+  return it == index.end() ? value() : it->second->v;
+}
+
+directory_cache::value directory_cache::findParent(const key& k, unsigned long generation,
+						   dispatcher::tagid *missing){
+  std::lock_guard<std::mutex> guard(lock);
+  value best;
+  if(generation != current_generation) return best;
+  key parent;
+  for(size_t i = 0; i < k.size(); ++i){
+    // removing one element keeps the key sorted
+    parent.assign(k.begin(), k.begin() + i);
+    parent.insert(parent.end(), k.begin() + i + 1, k.end());
+    value candidate;
+    std::map<key, view>::iterator w = views.find(parent);
+    if(w != views.end()){
+      candidate = w->second.v;
+    }else{
+      std::map<key, lru_list::iterator>::iterator it = index.find(parent);
+      if(it == index.end()) continue;
+      candidate = it->second->v;
+    }
+    if(!best || candidate->files.cardinality() < best->files.cardinality()){
+      best = candidate;
+      *missing = k[i];
+    }
+  }
+  if(best) ++derived;
+  return best;
+}
+
+void directory_cache::insert(const key& k, const value& v, unsigned long generation){
+  size_t bytes = v->memoryUsage() + k.size() * sizeof(dispatcher::tagid) + ENTRY_OVERHEAD;
+
+  std::lock_guard<std::mutex> guard(lock);
+  // computed by a dispatcher which is not current, ids inside are meaningless now
+  if(generation != current_generation) return;
+  // a listing bigger than the whole cache would only flush everything else
+  if(bytes > budget) return;
+  if(views.find(k) != views.end()) return;
+
+  std::map<key, lru_list::iterator>::iterator it = index.find(k);
+  if(it != index.end()){
+    used -= it->second->bytes;
+    lru.erase(it->second);
+    index.erase(it);
+  }
+  entry e;
+  e.k = k;
+  e.v = v;
+  e.bytes = bytes;
+  lru.push_front(e);
+  index[k] = lru.begin();
+  used += bytes;
+  evict();
+}
+
+void directory_cache::evict(void){
+  while(used > budget && !lru.empty()){
+    entry& e = lru.back();
+    used -= e.bytes;
+    index.erase(e.k);
+    lru.pop_back();
+    ++evictions;
+  }
+}
+
+void directory_cache::noteUse(const key& k){
+  if(max_views == 0) return;
+  std::map<key, unsigned long>::iterator it = uses.find(k);
+  if(it != uses.end()) it->second++;
+  else if(uses.size() < TRACKED_KEYS) uses.insert(std::make_pair(k, 1ul));
+  if(++lookups >= DECAY_LOOKUPS) decay();
+}
+
+void directory_cache::decay(void){
+  lookups = 0;
+  std::vector< std::pair<unsigned long, const key *> > ranked;
+  for(std::map<key, unsigned long>::iterator it = uses.begin(); it != uses.end(); ++it){
+    if(it->second >= HOT_USES) ranked.push_back(std::make_pair(it->second, &it->first));
+  }
+  size_t n = std::min(max_views, ranked.size());
+  std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+		    [](const std::pair<unsigned long, const key *>& a, const std::pair<unsigned long, const key *>& b){
+		      return a.first > b.first;
+		    });
+  hot.clear();
+  for(size_t i = 0; i < n; ++i) hot.push_back(*ranked[i].second);
+  std::sort(hot.begin(), hot.end());
+  for(std::map<key, view>::iterator it = views.begin(); it != views.end(); ){
+    if(std::binary_search(hot.begin(), hot.end(), it->first)){
+      ++it;
+    }else{
+      view_used -= it->second.bytes;
+      it = views.erase(it);
+    }
+  }
+  for(std::map<key, unsigned long>::iterator it = uses.begin(); it != uses.end(); ){
+    it->second /= 2;
+    if(it->second == 0) it = uses.erase(it); else ++it;
+  }
+}
+
+void directory_cache::dropViews(void){
+  views.clear();
+  view_used = 0;
+  uses.clear();
+  hot.clear();
+  lookups = 0;
+}
+
+void directory_cache::materialize(const key& k, const value& v, const std::vector<size_t>& counts,
+				  unsigned long generation){
+  view w;
+  w.v = std::make_shared<directory_listing>(*v);
+  w.counts.assign(counts.begin(), counts.end());
+  w.bytes = w.v->memoryUsage() + w.counts.size() * sizeof(uint32_t) +
+    k.size() * sizeof(dispatcher::tagid) + ENTRY_OVERHEAD;
+
+  std::lock_guard<std::mutex> guard(lock);
+  if(generation != current_generation || !std::binary_search(hot.begin(), hot.end(), k)) return;
+  if(views.find(k) != views.end() || view_used + w.bytes > view_budget) return;
+  // served by the view from now on
+  std::map<key, lru_list::iterator>::iterator it = index.find(k);
+  if(it != index.end()){
+    used -= it->second->bytes;
+    lru.erase(it->second);
+    index.erase(it);
+  }
+  view_used += w.bytes;
+  std::swap(views[k], w);
+}
+
+// the changes are applied file by file in their order: a file entering the directory
+// adds its tags to the counts, a file leaving it takes them away
+void directory_cache::updateView(const key& k, view& w, const dispatcher::delta& changes){
+  // readers keep what they have, the view goes on with a copy
+  if(w.v.use_count() > 1) w.v = std::make_shared<directory_listing>(*w.v);
+  directory_listing& l = *w.v;
+  for(size_t i = 0; i < changes.files.size(); ++i){
+    const std::vector<dispatcher::tagid>& before = changes.files[i].first;
+    const std::vector<dispatcher::tagid>& after = changes.files[i].second;
+    dispatcher::fileid f = changes.file_ids[i].first;
+    // files without tags are in the root directory, while they exist
+    bool was = changes.file_ids[i].second != dispatcher::delta::CREATED &&
+      std::includes(before.begin(), before.end(), k.begin(), k.end());
+    bool is = changes.file_ids[i].second != dispatcher::delta::REMOVED &&
+      std::includes(after.begin(), after.end(), k.begin(), k.end());
+    if(!was && !is) continue;
+    for(size_t j = 0; was && j < before.size(); ++j){
+      dispatcher::tagid t = before[j];
+      if(std::binary_search(k.begin(), k.end(), t) || t >= w.counts.size() || w.counts[t] == 0) continue;
+      if(--w.counts[t] == 0) l.subtags.reset(t);
+    }
+    for(size_t j = 0; is && j < after.size(); ++j){
+      dispatcher::tagid t = after[j];
+      if(std::binary_search(k.begin(), k.end(), t)) continue;
+      if(t >= w.counts.size()) w.counts.resize(t + 1, 0);
+      if(t >= l.subtags.size()) l.subtags.resize(t + 1);
+      if(w.counts[t]++ == 0) l.subtags.set(t);
+    }
+    if(was && !is) l.files.remove(f);
+    if(is && !was) l.files.add(f);
+  }
+  l.files.optimize();
+  view_used -= w.bytes;
+  w.bytes = l.memoryUsage() + w.counts.size() * sizeof(uint32_t) +
+    k.size() * sizeof(dispatcher::tagid) + ENTRY_OVERHEAD;
+  view_used += w.bytes;
+  ++views_updated;
+}
+
+void directory_cache::invalidate(unsigned long generation){
+  std::lock_guard<std::mutex> guard(lock);
+  current_generation = generation;
+  lru.clear();
+  index.clear();
+  used = 0;
+  dropViews();
+}
+
+void directory_cache::retain(unsigned long from, const dispatcher::delta& changes, unsigned long generation){
+  std::lock_guard<std::mutex> guard(lock);
+  bool all = from != current_generation || changes.rebuilt;
+  current_generation = generation;
+  // views of keys with a renamed tag go; so does everything when the files changed
+  // can't be told apart (ids mean nothing, or they are not known)
+  if(all || changes.file_ids.size() != changes.files.size()) dropViews();
+  for(std::map<key, view>::iterator it = views.begin(); it != views.end(); ){
+    bool renamed = false;
+    for(size_t i = 0; i < it->first.size() && !renamed; ++i){
+      renamed = std::binary_search(changes.renamed_tags.begin(), changes.renamed_tags.end(), it->first[i]);
+    }
+    if(!renamed && changes.affects(it->first)) updateView(it->first, it->second, changes);
+    if(renamed || it->second.bytes > view_budget){
+      view_used -= it->second.bytes;
+      it = views.erase(it);
+    }else{
+      ++it;
+    }
+  }
+  for(lru_list::iterator it = lru.begin(); it != lru.end(); ){
+    if(all || changes.affects(it->k)){
+      used -= it->bytes;
+      index.erase(it->k);
+      it = lru.erase(it);
+    }else{
+      ++retained;
+      ++it;
+    }
+  }
+}
+
+void directory_cache::setBudget(size_t budget_bytes){
+  std::lock_guard<std::mutex> guard(lock);
+  budget = budget_bytes;
+  evict();
+}
+
+void directory_cache::setViews(size_t views, size_t view_budget_bytes){
+  std::lock_guard<std::mutex> guard(lock);
+  max_views = views;
+  view_budget = view_budget_bytes;
+  // chosen again after the next DECAY_LOOKUPS lookups
+  dropViews();
+}
+
+std::string directory_cache::report(void) const {
+  std::lock_guard<std::mutex> guard(lock);
+  char buf[1024];
+  snprintf(buf, sizeof(buf),
+	   "generation: %lu\n"
+	   "entries: %zu\n"
+	   "bytes: %zu\n"
+	   "budget: %zu\n"
+	   "hits: %lu\n"
+	   "misses: %lu\n"
+	   "derived from parent: %lu\n"
+	   "evictions: %lu\n"
+	   "kept on reload: %lu\n"
+	   "hot views: %zu of %zu\n"
+	   "view bytes: %zu\n"
+	   "view budget: %zu\n"
+	   "view hits: %lu\n"
+	   "view updates: %lu\n",
+	   current_generation, lru.size(), used, budget, hits, misses, derived, evictions, retained,
+	   views.size(), max_views, view_used, view_budget, view_hits, views_updated);
+  return buf;
+}
@@ -0,0 +1,143 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <stddef.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bitmask.h"
+#include "dispatch.h"
+#include "posting.h"
+
+// structure of one directory, as computed by directoryStructure (see util.cc)
+struct directory_listing
+{
+  bitmask subtags;
+  posting_list files;
+
+  size_t memoryUsage(void) const {
+    return sizeof(*this) + subtags.wordCount() * sizeof(uint64_t) + files.memoryUsage();
+  }
+};
+
+// LRU cache of directory listings. "/a/b" and "/b/a" are the same directory, so the key
+// is the sorted list of tag ids. The cache is bounded by the (approximate) memory taken
+// by cached listings.
+//
+// Tag ids mean nothing in another dispatcher, so every lookup and insertion passes
+// the generation of the dispatcher it works with (see dispatcher::generation), and
+// entries are only served to and accepted from the current generation. A reload
+// switches the cache to the new dispatcher with invalidate(), so a listing computed
+// from the old one is never stored or served afterwards, even by threads which still
+// work with the old dispatcher. When the new dispatcher is the old one updated by a
+// difference, retain() keeps the entries the difference can't affect.
+//
+// A few directories usually take most of the lookups. Lookups are counted per key,
+// and the counts halve every DECAY_LOOKUPS lookups, so they follow what is used now;
+// the most used keys (at most `views` of them, with at least HOT_USES lookups) are
+// kept as views apart from the LRU list. A view is not evicted, and retain() updates
+// it by the changed files instead of dropping it: it keeps the number of its files
+// having every tag, so a subdirectory disappears exactly when its last file leaves.
+// Views take at most view_budget bytes.
+// All methods are thread safe.
+class directory_cache
+{
+public:
+  typedef std::vector<dispatcher::tagid> key;
+  typedef std::shared_ptr<const directory_listing> value;
+
+private:
+  struct entry
+  {
+    key k;
+    value v;
+    size_t bytes;
+  };
+  typedef std::list<entry> lru_list;
+  struct view
+  {
+    // copied before a change when readers hold it
+    std::shared_ptr<directory_listing> v;
+    // files of the listing by tag id, for the tags which are not in the key
+    std::vector<uint32_t> counts;
+    size_t bytes;
+  };
+
+  mutable std::mutex lock;
+  // most recently used entries are in front
+  lru_list lru;
+  std::map<key, lru_list::iterator> index;
+
+  size_t budget;
+  size_t used;
+  unsigned long current_generation;
+
+  // lookups of keys since the last decay, at most TRACKED_KEYS of them
+  std::map<key, unsigned long> uses;
+  unsigned long lookups;
+  // the keys which should have views, sorted
+  std::vector<key> hot;
+  std::map<key, view> views;
+  size_t max_views;
+  size_t view_budget;
+  size_t view_used;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long derived;
+  unsigned long evictions;
+  unsigned long retained;
+  unsigned long view_hits;
+  unsigned long views_updated;
+
+  void evict(void);
+  void noteUse(const key& k);
+  // halves the counts and chooses the hot keys again, dropping views of others
+  void decay(void);
+  void dropViews(void);
+  void updateView(const key& k, view& w, const dispatcher::delta& changes);
+
+public:
+  static const unsigned long DECAY_LOOKUPS = 4096;
+  static const unsigned long HOT_USES = 16;
+  static const size_t TRACKED_KEYS = 4096;
+
+  explicit directory_cache(size_t budget_bytes, size_t views = 16, size_t view_budget_bytes = 16 << 20);
+
+  // sorts ids and removes duplicates
+  static key canonical(std::vector<dispatcher::tagid> ids);
+
+  // returns an empty pointer on miss. *wants_view, if given, tells whether k is hot
+  // and has no view yet; then the caller gives its listing to materialize
+  value find(const key& k, unsigned long generation, bool *wants_view = NULL);
+  // looks for a cached directory one level up, i.e. for k without one of its tags;
+  // when there are several, the one with fewest files is returned and *missing is set
+  // to the tag which should be intersected with it to get k. Doesn't count as a lookup
+  value findParent(const key& k, unsigned long generation, dispatcher::tagid *missing);
+  // like find, but neither counted as a lookup nor making the entry recently used;
+  // for callers which only take a shortcut when the listing happens to be there
+  value peek(const key& k, unsigned long generation) const;
+  void insert(const key& k, const value& v, unsigned long generation);
+  // counts are the numbers of files of the listing having every subdirectory (see
+  // subtagCounts)
+  void materialize(const key& k, const value& v, const std::vector<size_t>& counts,
+		   unsigned long generation);
+
+  // drops everything and starts serving the given generation
+  void invalidate(unsigned long generation);
+  // switches from the generation `from` to `generation`, which differs by changes,
+  // dropping only affected entries; if the cache doesn't serve `from`, drops everything
+  void retain(unsigned long from, const dispatcher::delta& changes, unsigned long generation);
+  void setBudget(size_t budget_bytes);
+  void setViews(size_t views, size_t view_budget_bytes);
+
+  // human-readable counters, one "name: value" per line
+  std::string report(void) const;
+};
+
+#endif /* __CACHE_H */
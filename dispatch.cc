@@ -2,8 +2,10 @@
 #include <set>
 #include <algorithm>
 #include <functional>
+#include <atomic>
 
 #include "dispatch.h"
+#include "parallel.h"
 
 // std::set<std::string> dispatcher::filesWithTag(const std::string& t) const {
 //   relation rel("", t);
@@ -26,53 +28,593 @@
 //   return result;
 // }
 
-void dispatcher::defineFile(const std::string& f){
-  if(isTagDefined(f)) return;
-  if(isFileDefined(f)) return;
+const uint32_t dispatcher::NONE;
+const unsigned dispatcher::MAX_ROOTS;
+const uint16_t dispatcher::builder::NO_ROOT;
+const size_t dispatcher::COOCCURRENCE_MIN_FILES;
+
+unsigned long dispatcher::nextGeneration(void){
+  static std::atomic<unsigned long> counter(0);
+  return ++counter;
+}
+
+dispatcher::fileid dispatcher::defineFile(std::string_view f, unsigned root){
+  if(isTagDefined(f)) return NONE;
+  fileid existing = fileId(f);
+  if(existing != NONE) return existing;
   
-  fileid id = (fileid) files_count;
-  files_ids[f] = id;
-  files_names.push_back(f);
-  files_count++;
-
-  // empty list of tags
-  tags_of_file.push_back(std::vector<bool>(tags_count, false));
-  // modify every tag to have the desired number of possible files
+  fileid id;
+  if(!free_files.empty()){
+    id = free_files.back();
+    free_files.pop_back();
+    files_names.assign(id, f);
+    file_root[id] = root;
+  }else{
+    id = (fileid) files_count;
+    files_names.push_back(f);
+    file_root.push_back(root);
+    files_count++;
+    // empty list of tags; posting lists of tags don't depend on the number of files
+    tags_of_file.push_back(std::vector<tagid>());
+  }
+  files_ids.insert(f, id);
+  files_order.insert(id, files_names);
+  roots_ = std::max(roots_, root + 1);
+  all_files.add(id);
+  cooccurrence_valid = false;
+  return id;
+}
+
+dispatcher::tagid dispatcher::defineTag(std::string_view t){
+  if(isFileDefined(t)) return NONE;
+  tagid existing = tagId(t);
+  if(existing != NONE) return existing;
+
+  tagid id;
+  if(!free_tags.empty()){
+    id = free_tags.back();
+    free_tags.pop_back();
+    tags_names.assign(id, t);
+  }else{
+    id = (tagid) tags_count;
+    tags_names.push_back(t);
+    tags_count++;
+    // no files are tagged with this tag yet
+    files_with_tag.push_back(posting_list());
+  }
+  tags_ids.insert(t, id);
+  tags_order.insert(id, tags_names);
+  cooccurrence_valid = false;
+  return id;
+}
+void dispatcher::link(std::string_view f, std::string_view t){
+  fileid f_id = fileId(f);
+  tagid t_id = tagId(t);
+  if(f_id == NONE || t_id == NONE) return;
+  linkIds(f_id, t_id);
+}
+void dispatcher::linkIds(fileid f_id, tagid t_id){
+  std::vector<tagid>& filetags = tags_of_file[f_id];
+  std::vector<tagid>::iterator it = std::lower_bound(filetags.begin(), filetags.end(), t_id);
+  if(it != filetags.end() && *it == t_id) return;
+  filetags.insert(it, t_id);
+  files_with_tag[t_id].add(f_id);
+  cooccurrence_valid = false;
+}
+
+void dispatcher::unlinkIds(fileid f_id, tagid t_id){
+  std::vector<tagid>& filetags = tags_of_file[f_id];
+  std::vector<tagid>::iterator it = std::lower_bound(filetags.begin(), filetags.end(), t_id);
+  if(it == filetags.end() || *it != t_id) return;
+  filetags.erase(it);
+  files_with_tag[t_id].remove(f_id);
+  cooccurrence_valid = false;
+}
+
+void dispatcher::removeFile(fileid f){
+  std::vector<tagid>& filetags = tags_of_file[f];
+  for(size_t i = 0; i < filetags.size(); ++i) files_with_tag[filetags[i]].remove(f);
+  std::vector<tagid>().swap(filetags);
+  files_ids.erase(files_names[f], files_names);
+  files_order.erase(f, files_names);
+  files_names.assign(f, std::string_view());
+  all_files.remove(f);
+  free_files.push_back(f);
+  cooccurrence_valid = false;
+}
+
+void dispatcher::removeTag(tagid t){
+  posting_list& files = files_with_tag[t];
+  for(posting_list::const_iterator it = files.begin(); it != files.end(); ++it){
+    std::vector<tagid>& filetags = tags_of_file[*it];
+    filetags.erase(std::lower_bound(filetags.begin(), filetags.end(), t));
+  }
+  files.clear();
+  tags_ids.erase(tags_names[t], tags_names);
+  tags_order.erase(t, tags_names);
+  tags_names.assign(t, std::string_view());
+  free_tags.push_back(t);
+  cooccurrence_valid = false;
+}
+
+void dispatcher::optimize(void){
   for(size_t i = 0; i < tags_count; ++i){
-    files_with_tag[i].push_back(false);
+    files_with_tag[i].optimize();
+  }
+  all_files.optimize();
+  buildCooccurrence();
+}
+
+void dispatcher::buildCooccurrence(void){
+  used_tags = bitmask(tags_count, false);
+  cooccurrence.assign(tags_count, bitmask());
+  for(tagid t = 0; t < tags_count; ++t){
+    const posting_list& files = files_with_tag[t];
+    if(files.empty()) continue;
+    used_tags.set(t);
+    if(files.cardinality() < COOCCURRENCE_MIN_FILES) continue;
+    cooccurrence[t] = filesUnion(files);
+    cooccurrence[t].reset(t);
+  }
+  cooccurrence_valid = true;
+}
+
+void dispatcher::growCooccurrence(void){
+  if(used_tags.size() == tags_count) return;
+  used_tags.resize(tags_count);
+  cooccurrence.resize(tags_count);
+  for(tagid t = 0; t < tags_count; ++t){
+    if(cooccurrence[t].size() != 0) cooccurrence[t].resize(tags_count);
+  }
+}
+
+void dispatcher::refreshCooccurrence(const std::vector<tagid>& tags){
+  // new tags make every row longer
+  growCooccurrence();
+  for(size_t i = 0; i < tags.size(); ++i){
+    tagid t = tags[i];
+    const posting_list& files = files_with_tag[t];
+    used_tags.assign(t, !files.empty());
+    if(files.cardinality() < COOCCURRENCE_MIN_FILES){
+      cooccurrence[t] = bitmask();
+    }else{
+      cooccurrence[t] = filesUnion(files);
+      cooccurrence[t].reset(t);
+    }
+  }
+  cooccurrence_valid = true;
+}
+
+void dispatcher::updateCooccurrence(const std::vector<tagid>& before, const std::vector<tagid>& after){
+  std::vector<tagid> touched;
+  std::set_union(before.begin(), before.end(), after.begin(), after.end(), std::back_inserter(touched));
+  if(!std::includes(after.begin(), after.end(), before.begin(), before.end())){
+    // a lost tag may still co-occur through other files, only a recount tells
+    refreshCooccurrence(touched);
+    return;
+  }
+  // only additions: rows grow by the tags of the file
+  growCooccurrence();
+  for(size_t i = 0; i < after.size(); ++i){
+    tagid p = after[i];
+    used_tags.set(p);
+    if(files_with_tag[p].cardinality() < COOCCURRENCE_MIN_FILES) continue;
+    bitmask& row = cooccurrence[p];
+    if(row.size() != tags_count){
+      // just became popular
+      row = filesUnion(files_with_tag[p]);
+      row.reset(p);
+      continue;
+    }
+    for(size_t j = 0; j < after.size(); ++j) if(after[j] != p) row.set(after[j]);
+  }
+  cooccurrence_valid = true;
+}
+
+dispatcher::fileid dispatcher::retagFile(std::string_view file, const std::vector<tagid>& add,
+					 const std::vector<tagid>& remove, delta *changes, unsigned root){
+  bool had_cooccurrence = cooccurrence_valid;
+  fileid f = fileId(file);
+  bool fresh = f == NONE;
+  if(fresh) f = defineFile(file, root);
+  if(f == NONE) return NONE;
+  std::vector<tagid> before = fresh ? std::vector<tagid>() : tags_of_file[f];
+  for(size_t i = 0; i < remove.size(); ++i) unlinkIds(f, remove[i]);
+  for(size_t i = 0; i < add.size(); ++i) linkIds(f, add[i]);
+  const std::vector<tagid>& after = tags_of_file[f];
+
+  std::vector<tagid> touched;
+  std::set_symmetric_difference(before.begin(), before.end(), after.begin(), after.end(),
+				std::back_inserter(touched));
+  for(size_t i = 0; i < touched.size(); ++i) files_with_tag[touched[i]].optimize();
+  if(fresh) all_files.optimize();
+  if(had_cooccurrence) updateCooccurrence(before, after); else buildCooccurrence();
+
+  if(changes != NULL){
+    *changes = delta();
+    changes->rebuilt = false;
+    if(fresh || before != after){
+      changes->files.push_back(std::make_pair(before, after));
+      changes->file_ids.push_back(std::make_pair(f, fresh ? delta::CREATED : delta::RETAGGED));
+    }
+  }
+  return f;
+}
+
+void dispatcher::forgetFile(fileid f, delta *changes){
+  bool had_cooccurrence = cooccurrence_valid;
+  std::vector<tagid> before = tags_of_file[f];
+  removeFile(f);
+  for(size_t i = 0; i < before.size(); ++i) files_with_tag[before[i]].optimize();
+  all_files.optimize();
+  if(had_cooccurrence) refreshCooccurrence(before); else buildCooccurrence();
+  if(changes != NULL){
+    *changes = delta();
+    changes->rebuilt = false;
+    changes->files.push_back(std::make_pair(before, std::vector<tagid>()));
+    changes->file_ids.push_back(std::make_pair(f, delta::REMOVED));
+  }
+}
+
+dispatcher::tagid dispatcher::createTag(std::string_view name, delta *changes){
+  bool had_cooccurrence = cooccurrence_valid;
+  bool fresh = tagId(name) == NONE;
+  tagid t = defineTag(name);
+  if(t == NONE) return NONE;
+  if(had_cooccurrence) refreshCooccurrence(std::vector<tagid>(1, t)); else buildCooccurrence();
+  if(changes != NULL){
+    *changes = delta();
+    changes->rebuilt = false;
+    if(fresh) changes->renamed_tags.push_back(t);
   }
+  return t;
+}
+
+bool dispatcher::renameTag(tagid t, std::string_view name){
+  if(isTagDefined(name) || isFileDefined(name)) return false;
+  tags_ids.erase(tags_names[t], tags_names);
+  tags_order.erase(t, tags_names);
+  tags_names.assign(t, name);
+  tags_ids.insert(tags_names[t], t);
+  tags_order.insert(t, tags_names);
+  return true;
 }
 
-void dispatcher::defineTag(const std::string& t){
-  if(isFileDefined(t)) return;
-  if(isTagDefined(t)) return;
+bitmask dispatcher::childTags(const std::vector<tagid>& tags, const posting_list& files) const {
+  if(cooccurrence_valid && tags.empty()){
+    return used_tags;
+  }else if(cooccurrence_valid && tags.size() == 1 && cooccurrence[tags[0]].size() == tags_count){
+    return cooccurrence[tags[0]];
+  }
+  bitmask result = filesUnion(files);
+  for(size_t i = 0; i < tags.size(); ++i) result.reset(tags[i]);
+  return result;
+}
 
-  tagid id = (tagid) tags_count;
-  tags_ids[t] = id;
-  tags_names.push_back(t);
-  tags_count++;
+long dispatcher::childTagCount(const std::vector<tagid>& tags) const {
+  if(cooccurrence_valid && tags.empty()){
+    return used_tags.count();
+  }else if(cooccurrence_valid && tags.size() == 1 && cooccurrence[tags[0]].size() == tags_count){
+    return cooccurrence[tags[0]].count();
+  }
+  return -1;
+}
 
-  // no files are tagged with this tag yet
-  files_with_tag.push_back(std::vector<bool>(files_count, false));
-  // any file can now be tagged with newly created tag, so we need a slot to do it
+size_t dispatcher::linksMemoryUsage(void) const {
+  size_t result = 0;
+  for(size_t i = 0; i < tags_count; ++i){
+    result += files_with_tag[i].memoryUsage();
+  }
   for(size_t i = 0; i < files_count; ++i){
-    tags_of_file[i].push_back(false);
+    result += tags_of_file[i].capacity() * sizeof(tagid);
   }
+  for(size_t i = 0; i < cooccurrence.size(); ++i){
+    result += cooccurrence[i].wordCount() * sizeof(uint64_t);
+  }
+  return result;
 }
-void dispatcher::link(const std::string& f, const std::string& t){
-  if(!isFileDefined(f) || !isTagDefined(t)) return;
-  fileid f_id = files_ids[f];
-  tagid t_id = tags_ids[t];
-  tags_of_file[f_id][t_id] = true;
-  files_with_tag[t_id][f_id] = true;
+
+size_t dispatcher::namesMemoryUsage(void) const {
+  return files_names.memoryUsage() + tags_names.memoryUsage() + files_ids.memoryUsage() +
+    tags_ids.memoryUsage() + files_order.memoryUsage() + tags_order.memoryUsage();
 }
 
 void dispatcher::reset(void){
+  generation_ = nextGeneration();
   files_count = 0;
   tags_count = 0;
   
   tags_ids.clear();
   files_ids.clear();
+  tags_order.clear();
+  files_order.clear();
+  files_names.clear();
+  tags_names.clear();
   files_with_tag.clear();
   tags_of_file.clear();
+  all_files.clear();
+  file_root.clear();
+  roots_ = 1;
+  free_files.clear();
+  free_tags.clear();
+  cooccurrence_valid = false;
+  used_tags = bitmask();
+  cooccurrence.clear();
+}
+
+// BUILDER
+
+void dispatcher::builder::reserve(size_t files_hint, size_t tags_hint, size_t links_hint){
+  // characters are not known yet, the arenas grow by doubling
+  files.reserve(files_hint, 0);
+  tags.reserve(tags_hint, 0);
+  links.reserve(links_hint);
+}
+
+dispatcher::fileid dispatcher::builder::addFile(std::string_view name){
+  files.push_back(name);
+  return files.size() - 1;
+}
+
+dispatcher::tagid dispatcher::builder::addTag(std::string_view name){
+  tags.push_back(name);
+  return tags.size() - 1;
+}
+
+void dispatcher::builder::addLink(fileid f, tagid t){
+  links.push_back(std::make_pair((uint32_t) f, (uint32_t) t));
+}
+
+void dispatcher::builder::add(const dispatcher& d, unsigned root){
+  // builder ids of the tags of d
+  std::vector<tagid> tag_ids(d.tags_count, NONE);
+  for(tagid t = 0; t < d.tags_count; ++t){
+    std::string_view name = d.tags_names[t];
+    if(name.empty() || added_files.find(name, files) != NONE) continue;
+    tag_ids[t] = added_tags.find(name, tags);
+    if(tag_ids[t] != NONE) continue;
+    tag_ids[t] = addTag(name);
+    added_tags.insert(tags[tag_ids[t]], tag_ids[t]);
+  }
+  added_files.reserve(added_files.size() + d.all_files.cardinality());
+  for(posting_list::const_iterator it = d.all_files.begin(); it != d.all_files.end(); ++it){
+    std::string_view name = d.files_names[*it];
+    if(added_files.find(name, files) != NONE || added_tags.find(name, tags) != NONE) continue;
+    fileid f = addFile(name);
+    added_files.insert(files[f], f);
+    file_roots.resize(f, NO_ROOT);
+    file_roots.push_back(root);
+    const std::vector<tagid>& row = d.tags_of_file[*it];
+    for(size_t j = 0; j < row.size(); ++j) if(tag_ids[row[j]] != NONE) addLink(f, tag_ids[row[j]]);
+  }
+}
+
+void dispatcher::builder::groupByFile(std::vector<size_t>& start, std::vector<uint32_t>& by_file) const {
+  start.assign(files.size() + 1, 0);
+  for(size_t l = 0; l < links.size(); ++l) start[links[l].first + 1]++;
+  for(size_t i = 0; i < files.size(); ++i) start[i + 1] += start[i];
+  by_file.resize(links.size());
+  std::vector<size_t> fill(start.begin(), start.end() - 1);
+  for(size_t l = 0; l < links.size(); ++l) by_file[fill[links[l].first]++] = links[l].second;
+}
+
+// work items of parallelFor: rows are tiny, so they are handed out in blocks
+static const size_t BUILD_BLOCK = 4096;
+// more names than this changed by replace() make it sort the order of names again
+static const size_t ORDER_BULK = 64;
+// builder ids of files which d has in another root, in replace()
+static const uint32_t FOREIGN = dispatcher::NONE - 1;
+
+void dispatcher::builder::build(dispatcher& d, unsigned threads, delta *changes, unsigned root){
+  if(d.files_count != 0 || d.tags_count != 0){
+    replace(d, changes, root);
+  }else{
+    if(changes != NULL) *changes = delta();
+    d.reset();
+    size_t nfiles = files.size(), ntags = tags.size();
+    d.files_count = nfiles;
+    d.tags_count = ntags;
+
+    // the two dictionaries are independent and sized once
+    parallelFor(2, threads, [&](size_t which){
+	const name_arena& names = which == 0 ? files : tags;
+	name_table& ids = which == 0 ? d.files_ids : d.tags_ids;
+	ids.reserve(names.size());
+	for(size_t i = 0; i < names.size(); ++i) ids.insert(names[i], i);
+	(which == 0 ? d.files_order : d.tags_order).rebuild(names);
+      });
+
+    // rows of files: counting sort of links by file
+    std::vector<size_t> file_start;
+    std::vector<uint32_t> by_file;
+    groupByFile(file_start, by_file);
+    std::vector< std::pair<uint32_t, uint32_t> >().swap(links);
+
+    d.tags_of_file.resize(nfiles);
+    parallelFor((nfiles + BUILD_BLOCK - 1) / BUILD_BLOCK, threads, [&](size_t b){
+	for(size_t f = b * BUILD_BLOCK; f < nfiles && f < (b + 1) * BUILD_BLOCK; ++f){
+	  std::vector<uint32_t>::iterator first = by_file.begin() + file_start[f];
+	  std::vector<uint32_t>::iterator last = by_file.begin() + file_start[f + 1];
+	  std::sort(first, last);
+	  last = std::unique(first, last);
+	  d.tags_of_file[f].assign(first, last);
+	}
+      });
+    std::vector<uint32_t>().swap(by_file);
+
+    // columns of tags: walking the rows in the order of files gives every column
+    // already sorted, so they are filled straight into their final size
+    std::vector<size_t> tag_start(ntags + 1, 0);
+    for(size_t f = 0; f < nfiles; ++f){
+      const std::vector<tagid>& row = d.tags_of_file[f];
+      for(size_t j = 0; j < row.size(); ++j) tag_start[row[j] + 1]++;
+    }
+    for(size_t t = 0; t < ntags; ++t) tag_start[t + 1] += tag_start[t];
+    std::vector<uint32_t> by_tag(tag_start[ntags]);
+    {
+      std::vector<size_t> fill(tag_start.begin(), tag_start.end() - 1);
+      for(size_t f = 0; f < nfiles; ++f){
+	const std::vector<tagid>& row = d.tags_of_file[f];
+	for(size_t j = 0; j < row.size(); ++j) by_tag[fill[row[j]]++] = f;
+      }
+    }
+    d.files_with_tag.resize(ntags);
+    parallelFor((ntags + BUILD_BLOCK - 1) / BUILD_BLOCK, threads, [&](size_t b){
+	for(size_t t = b * BUILD_BLOCK; t < ntags && t < (b + 1) * BUILD_BLOCK; ++t){
+	  d.files_with_tag[t].assign(by_tag.data() + tag_start[t], by_tag.data() + tag_start[t + 1]);
+	}
+      });
+
+    d.all_files.addRange(0, nfiles);
+    d.file_root.assign(nfiles, root);
+    d.roots_ = root + 1;
+    for(size_t f = 0; f < file_roots.size(); ++f){
+      if(file_roots[f] == NO_ROOT) continue;
+      d.file_root[f] = file_roots[f];
+      d.roots_ = std::max(d.roots_, (unsigned) file_roots[f] + 1);
+    }
+    d.files_names.swap(files);
+    d.tags_names.swap(tags);
+    d.buildCooccurrence();
+  }
+  files.clear();
+  tags.clear();
+  links.clear();
+  added_files.clear();
+  added_tags.clear();
+  file_roots.clear();
+}
+
+void dispatcher::builder::replace(dispatcher& d, delta *changes, unsigned root){
+  bool had_cooccurrence = d.cooccurrence_valid;
+  d.generation_ = nextGeneration();
+  delta local;
+  delta& result = changes != NULL ? *changes : local;
+  result = delta();
+  result.rebuilt = false;
+
+  // builder ids to ids in d, NONE for names d doesn't have (in the same role),
+  // FOREIGN for files of other roots
+  std::vector<fileid> file_ids(files.size());
+  std::vector<tagid> tag_ids(tags.size());
+  std::vector<bool> file_kept(d.files_count, false), tag_kept(d.tags_count, false);
+  for(fileid f = 0; f < d.files_count; ++f) if(d.file_root[f] != root) file_kept[f] = true;
+  for(size_t i = 0; i < files.size(); ++i){
+    file_ids[i] = d.fileId(files[i]);
+    if(file_ids[i] == NONE) continue;
+    if(d.file_root[file_ids[i]] != root) file_ids[i] = FOREIGN; else file_kept[file_ids[i]] = true;
+  }
+  for(size_t i = 0; i < tags.size(); ++i){
+    tag_ids[i] = d.tagId(tags[i]);
+    if(tag_ids[i] != NONE) tag_kept[tag_ids[i]] = true;
+  }
+  // free ids are not "gone", they are just unused
+  for(size_t i = 0; i < d.free_files.size(); ++i) file_kept[d.free_files[i]] = true;
+  for(size_t i = 0; i < d.free_tags.size(); ++i) tag_kept[d.free_tags[i]] = true;
+  // tags which are not collected go with the files of this root; with several roots
+  // an empty tag may have been made for another one, and stays
+  std::vector<tagid> gone_tags;
+  for(tagid t = 0; t < d.tags_count; ++t){
+    if(tag_kept[t]) continue;
+    bool ours = d.roots_ == 1;
+    const posting_list& with = d.files_with_tag[t];
+    for(posting_list::const_iterator it = with.begin(); !ours && it != with.end(); ++it) ours = d.file_root[*it] == root;
+    if(ours) gone_tags.push_back(t);
+  }
+  // many names come and go: the order of names is sorted once at the end rather than
+  // kept up to date one name at a time
+  size_t new_files = std::count(file_ids.begin(), file_ids.end(), NONE);
+  size_t new_tags = std::count(tag_ids.begin(), tag_ids.end(), NONE);
+  if(new_files + std::count(file_kept.begin(), file_kept.end(), false) > ORDER_BULK) d.files_order.suspend();
+  if(new_tags + gone_tags.size() > ORDER_BULK) d.tags_order.suspend();
+
+  std::vector<size_t> start;
+  std::vector<uint32_t> by_file;
+  groupByFile(start, by_file);
+  std::vector<tagid> row;
+  // tags whose files or co-occurring tags may have changed
+  std::vector<tagid> touched;
+
+  // files which are gone free their ids and names first, a name may become a tag
+  for(fileid f = 0; f < d.files_count; ++f){
+    if(file_kept[f]) continue;
+    result.files.push_back(std::make_pair(d.tags_of_file[f], std::vector<tagid>()));
+    result.file_ids.push_back(std::make_pair(f, delta::REMOVED));
+    touched.insert(touched.end(), d.tags_of_file[f].begin(), d.tags_of_file[f].end());
+    d.removeFile(f);
+  }
+  for(size_t i = 0; i < tags.size(); ++i){
+    if(tag_ids[i] != NONE) continue;
+    tag_ids[i] = d.defineTag(tags[i]);
+    if(tag_ids[i] != NONE) result.renamed_tags.push_back(tag_ids[i]);
+  }
+  // files which stay: only differing rows are touched
+  for(size_t i = 0; i < files.size(); ++i){
+    if(file_ids[i] == NONE || file_ids[i] == FOREIGN) continue;
+    row.clear();
+    for(size_t j = start[i]; j < start[i + 1]; ++j){
+      if(tag_ids[by_file[j]] != NONE) row.push_back(tag_ids[by_file[j]]);
+    }
+    std::sort(row.begin(), row.end());
+    row.erase(std::unique(row.begin(), row.end()), row.end());
+    fileid f = file_ids[i];
+    if(row == d.tags_of_file[f]) continue;
+
+    std::vector<tagid> before = d.tags_of_file[f];
+    std::vector<tagid> removed, added;
+    std::set_difference(before.begin(), before.end(), row.begin(), row.end(), std::back_inserter(removed));
+    std::set_difference(row.begin(), row.end(), before.begin(), before.end(), std::back_inserter(added));
+    for(size_t j = 0; j < removed.size(); ++j) d.unlinkIds(f, removed[j]);
+    for(size_t j = 0; j < added.size(); ++j) d.linkIds(f, added[j]);
+    touched.insert(touched.end(), before.begin(), before.end());
+    touched.insert(touched.end(), row.begin(), row.end());
+    result.files.push_back(std::make_pair(before, row));
+    result.file_ids.push_back(std::make_pair(f, delta::RETAGGED));
+  }
+  // tags which are gone have no links left by now, unless files of other roots have them
+  for(size_t i = 0; i < gone_tags.size(); ++i){
+    if(!d.files_with_tag[gone_tags[i]].empty()) continue;
+    d.removeTag(gone_tags[i]);
+    result.renamed_tags.push_back(gone_tags[i]);
+  }
+  // new files take the freed ids
+  for(size_t i = 0; i < files.size(); ++i){
+    if(file_ids[i] != NONE) continue;
+    fileid f = d.defineFile(files[i], root);
+    if(f == NONE) continue;
+    row.clear();
+    for(size_t j = start[i]; j < start[i + 1]; ++j){
+      if(tag_ids[by_file[j]] != NONE) row.push_back(tag_ids[by_file[j]]);
+    }
+    std::sort(row.begin(), row.end());
+    row.erase(std::unique(row.begin(), row.end()), row.end());
+    for(size_t j = 0; j < row.size(); ++j) d.linkIds(f, row[j]);
+    touched.insert(touched.end(), row.begin(), row.end());
+    result.files.push_back(std::make_pair(std::vector<tagid>(), row));
+    result.file_ids.push_back(std::make_pair(f, delta::CREATED));
+  }
+
+  if(d.files_order.suspended()) d.files_order.rebuild(d.files_names);
+  if(d.tags_order.suspended()) d.tags_order.rebuild(d.tags_names);
+  touched.insert(touched.end(), result.renamed_tags.begin(), result.renamed_tags.end());
+  std::sort(touched.begin(), touched.end());
+  touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+  for(size_t i = 0; i < touched.size(); ++i) d.files_with_tag[touched[i]].optimize();
+  if(!result.files.empty()) d.all_files.optimize();
+  if(had_cooccurrence) d.refreshCooccurrence(touched); else d.buildCooccurrence();
+  std::sort(result.renamed_tags.begin(), result.renamed_tags.end());
+}
+
+bool dispatcher::delta::affects(const std::vector<tagid>& key) const {
+  if(rebuilt) return true;
+  for(size_t i = 0; i < key.size(); ++i){
+    if(std::binary_search(renamed_tags.begin(), renamed_tags.end(), key[i])) return true;
+  }
+  for(size_t i = 0; i < files.size(); ++i){
+    const std::vector<tagid>& before = files[i].first;
+    const std::vector<tagid>& after = files[i].second;
+    if(std::includes(before.begin(), before.end(), key.begin(), key.end())) return true;
+    if(std::includes(after.begin(), after.end(), key.begin(), key.end())) return true;
+  }
+  return false;
 }
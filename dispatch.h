@@ -2,64 +2,146 @@
 #define __DISPATCH_H
 
 #include <string>
+#include <string_view>
 #include <set>
-#include <map>
 #include <functional>
 #include <vector>
+#include <algorithm>
+#include <utility>
 #include <stdio.h>
+#include <stdint.h>
+
+#include "bitmask.h"
+#include "names.h"
+#include "posting.h"
 
 class dispatcher
 {
-private:
+public:
 
   // we need many-to-many relationship.
-  // we implement it using correspondence with strings and numbers (ids) to use them as indices in vectors
-  typedef size_t fileid;
-  typedef size_t tagid;
+  // we implement it using correspondence with strings and numbers (ids) to use them as indices in vectors.
+  // 32 bits are enough for ids (posting lists hold 32-bit values anyway) and halve the rows of files
+  typedef uint32_t fileid;
+  typedef uint32_t tagid;
+
+  // tags having at least that many files get a precomputed row in the co-occurrence index;
+  // for rarer tags scanning their files is cheap anyway
+  static const size_t COOCCURRENCE_MIN_FILES = 64;
+
+  // returned by defineFile/defineTag when the name is already taken by a tag/file
+  static const uint32_t NONE = name_table::EMPTY;
+
+  // files come from storage roots (directories with a .tags each) numbered from 0;
+  // tags are shared by all of them. A single storage is root 0
+  static const unsigned MAX_ROOTS = 256;
+
+  // see below
+  class builder;
+  struct delta;
+
+private:
+
+  // identifies the contents for caches outside of the dispatcher; unique in the process
+  unsigned long generation_;
 
   size_t files_count;
   size_t tags_count;
-  std::map<std::string, fileid> files_ids;
-  std::map<std::string, tagid> tags_ids;
-  std::vector<std::string> files_names;
-  std::vector<std::string> tags_names;
-
-  std::vector< std::vector<bool> > tags_of_file;
-  std::vector< std::vector<bool> > files_with_tag;
-
-  // inplace bitwise and for vector<bool>
-  void mask_and(std::vector<bool>& a, const std::vector<bool>& b) const {
-    for(size_t i = 0; i < a.size(); ++i){
-      a[i] = a[i] & b[i];
-    }
-  }
-  void mask_or(std::vector<bool>& a, const std::vector<bool>& b) const {
-    for(size_t i = 0; i < a.size(); ++i){
-      a[i] = a[i] | b[i];
-    }
-  }
-  
+  // names by ids in an arena, and hash tables of ids by names (see names.h); lookups
+  // take a string_view, so nothing is allocated to find a name
+  name_arena files_names;
+  name_arena tags_names;
+  name_table files_ids;
+  name_table tags_ids;
+  // ids in the order of names, for completion
+  name_order files_order;
+  name_order tags_order;
+
+  // sorted list of tags of every file; files have a handful of tags, so rows are sparse
+  std::vector< std::vector<tagid> > tags_of_file;
+  // most tags are sparse, so columns are compressed, see posting.h
+  std::vector<posting_list> files_with_tag;
+  // every defined file, i.e. the root directory
+  posting_list all_files;
+  // the storage root of every file, and one more than the highest root seen
+  std::vector<uint8_t> file_root;
+  unsigned roots_;
+
+  // ids of removed files and tags, given to the next defined ones; their names are
+  // empty and their rows and columns too
+  std::vector<fileid> free_files;
+  std::vector<tagid> free_tags;
+
+  // the index for small depths, built by optimize() and dropped by any modification:
+  // tags having at least one file (subdirectories of the root), and for popular tags
+  // the tags appearing together with them (subdirectories of "/tag")
+  bool cooccurrence_valid;
+  bitmask used_tags;
+  std::vector<bitmask> cooccurrence;
+
+  void buildCooccurrence(void);
+  // the same for the given tags only, while the rest of the index is still valid
+  void refreshCooccurrence(const std::vector<tagid>& tags);
+  // makes rows as long as there are tags
+  void growCooccurrence(void);
+  // after one file changed its tags from before to after (both sorted)
+  void updateCooccurrence(const std::vector<tagid>& before, const std::vector<tagid>& after);
+
+  // reads and writes the internals directly, see tagindex.h
+  friend class tag_index;
+
 public:
 
   dispatcher(void) :
-    files_count(0), tags_count(0), files_ids(), tags_ids(),
-    tags_of_file(), files_with_tag()
+    generation_(nextGeneration()), files_count(0), tags_count(0), files_names(), tags_names(),
+    files_ids(), tags_ids(), files_order(), tags_order(), tags_of_file(), files_with_tag(), all_files(),
+    file_root(), roots_(1), free_files(), free_tags(), cooccurrence_valid(false)
   { }
 
-  std::string filename(fileid f) const {
+  static unsigned long nextGeneration(void);
+  bool empty(void) const { return files_count == 0 && tags_count == 0; }
+  // ids are below these, some of them may be free
+  size_t fileIdCount(void) const { return files_count; }
+  size_t tagIdCount(void) const { return tags_count; }
+  // two dispatchers with equal contents may share a generation, so that caches
+  // filled from one stay valid for the other
+  void setGeneration(unsigned long g) { generation_ = g; }
+  unsigned long generation(void) const { return generation_; }
+
+  // views into the arena, valid until the dispatcher is changed; followed by '\0', so
+  // data() may be given to C functions
+  std::string_view filename(fileid f) const {
     return files_names[f];
   }
-  std::string tagname(tagid t) const {
+  std::string_view tagname(tagid t) const {
     return tags_names[t];
   }
+  fileid fileId(std::string_view f) const {
+    return files_ids.find(f, files_names);
+  }
+  tagid tagId(std::string_view t) const {
+    return tags_ids.find(t, tags_names);
+  }
+  // ids of files and tags whose names start with prefix, in the order of names
+  std::pair<const uint32_t *, const uint32_t *> filesWithPrefix(std::string_view prefix) const {
+    return files_order.range(prefix, files_names);
+  }
+  std::pair<const uint32_t *, const uint32_t *> tagsWithPrefix(std::string_view prefix) const {
+    return tags_order.range(prefix, tags_names);
+  }
+  const posting_list& allFiles(void) const { return all_files; }
+  unsigned rootOf(fileid f) const { return file_root[f]; }
+  // 1 unless files of several roots were ever defined
+  unsigned roots(void) const { return roots_; }
+  const posting_list& filesWith(tagid t) const { return files_with_tag[t]; }
+  // sorted
+  const std::vector<tagid>& tagsOf(fileid f) const { return tags_of_file[f]; }
   
-  bool isTagDefined(const std::string& t) const {
-    std::map<std::string, tagid>::const_iterator it = tags_ids.find(t);
-    return it != tags_ids.end();
+  bool isTagDefined(std::string_view t) const {
+    return tagId(t) != NONE;
   }
-  bool isFileDefined(const std::string& f) const {
-    std::map<std::string, fileid>::const_iterator it = files_ids.find(f);
-    return it != files_ids.end();
+  bool isFileDefined(std::string_view f) const {
+    return fileId(f) != NONE;
   }
   bool validTags(const std::vector<std::string>& tags) const {
     for(std::vector<std::string>::const_iterator it = tags.begin(); it != tags.end(); ++it){
@@ -73,19 +155,19 @@ public:
   // this function (unlike standard ones) takes a vector of strings and checks whether the selected file
   // has all of them on it
   bool hasTags(const std::string& filename, const std::vector<std::string>& tags) const {
-    if(!isFileDefined(filename)) return false;
+    fileid id = fileId(filename);
+    if(id == NONE) return false;
     
-    fileid id = files_ids.find(filename)->second;
-    const std::vector<bool>& filetags = tags_of_file[id];
+    const std::vector<tagid>& filetags = tags_of_file[id];
     for(size_t i = 0; i < tags.size(); ++i){
-      if(!isTagDefined(tags[i])){
+      tagid tid = tagId(tags[i]);
+      if(tid == NONE){
 	// something bad happened here. There is no exception handling mechanism, so we
 	// just pretend the only problem is that the file doesn't have such a tag
 	// (which is, by the way, true, since the tag is not registered, but situation is still very strange)
 	return false;
       }
-      tagid tid = tags_ids.find(tags[i])->second;
-      if(filetags[tid] == false) return false;
+      if(!std::binary_search(filetags.begin(), filetags.end(), tid)) return false;
     }
     return true;
   }
@@ -93,58 +175,184 @@ public:
   // the hopelessly specialized function. Of course, to create even an illusion of generality,
   // it would be neccessary to do something with this; for example, to create an analogous function
   // for converting a list of filenames to ids.
-  std::vector<bool> convertTagsToIds(const std::vector<std::string>& tags) const {
-    std::vector<bool> result(tags_count, false);
+  bitmask convertTagsToIds(const std::vector<std::string>& tags) const {
+    bitmask result(tags_count, false);
     for(size_t i = 0; i < tags.size(); ++i){
-      result[ tags_ids.find(tags[i])->second ] = true;
+      result.set( tagId(tags[i]) );
     }
     return result;
   }
-  // returns the list of files (as vector<bool> by ids) such that any file from
-  // the output has all passed tags
-  std::vector<bool> tagsIntersectionIds(const std::vector<tagid>& tags) const {
-    std::vector<bool> result(files_count, true);
+  std::vector<tagid> convertTagsToIdList(const std::vector<std::string>& tags) const {
+    std::vector<tagid> result;
     for(size_t i = 0; i < tags.size(); ++i){
-      tagid current_id = tags[i];
-      mask_and(result, files_with_tag[current_id]);
+      result.push_back( tagId(tags[i]) );
     }
     return result;
   }
-  std::vector<bool> tagsIntersection(const std::vector<bool>& tags) const {
-    std::vector<tagid> result;
+  // returns the list of files such that any file from the output has all passed tags.
+  // the lists are intersected starting from the shortest one (see posting_list::intersectAll)
+  posting_list tagsIntersectionIds(const std::vector<tagid>& tags) const {
+    if(tags.empty()){
+      // every file, stored as a few runs
+      return all_files;
+    }
+    std::vector<const posting_list *> lists;
     for(size_t i = 0; i < tags.size(); ++i){
-      if(tags[i]) result.push_back(i);
+      lists.push_back(&files_with_tag[tags[i]]);
+    }
+    return posting_list::intersectAll(lists);
+  }
+  // files of the directory one level deeper than the one containing files:
+  // costs about the size of files rather than of the whole tag
+  posting_list narrowIntersection(const posting_list& files, tagid tag) const {
+    return files.intersect(files_with_tag[tag]);
+  }
+  posting_list tagsIntersection(const bitmask& tags) const {
+    std::vector<tagid> result;
+    for(size_t i = tags.next(0); i < tags.size(); i = tags.next(i + 1)){
+      result.push_back(i);
     }
     return tagsIntersectionIds(result);
   }
 
   // from the list of files produces the vector of tags (represented by ids)
   // such that for every tag in the output there is at least one file which is tagged by it
-  std::vector<bool> filesUnionIds(const std::vector<fileid>& files) const {
-    std::vector<bool> result(tags_count, false);
+  // the cost is the total number of tags on passed files, not files * tags
+  bitmask filesUnionIds(const std::vector<fileid>& files) const {
+    bitmask result(tags_count, false);
     for(size_t i = 0; i < files.size(); ++i){
-      fileid current_id = files[i];
-      mask_or(result, tags_of_file[current_id]);
+      const std::vector<tagid>& filetags = tags_of_file[files[i]];
+      for(size_t j = 0; j < filetags.size(); ++j) result.set(filetags[j]);
     }
     return result;
   }
-  std::vector<bool> filesUnion(const std::vector<bool>& files) const {
-    std::vector<fileid> result;
-    for(size_t i = 0; i < files.size(); ++i){
-      if(files[i]) result.push_back(i);
+  bitmask filesUnion(const posting_list& files) const {
+    bitmask result(tags_count, false);
+    for(posting_list::const_iterator it = files.begin(); it != files.end(); ++it){
+      const std::vector<tagid>& filetags = tags_of_file[*it];
+      for(size_t j = 0; j < filetags.size(); ++j) result.set(filetags[j]);
     }
-    return filesUnionIds(result);
+    return result;
   }
 
+  // subdirectories of the directory given by tags: tags (except the passed ones) which
+  // appear on at least one of the files, which must be tagsIntersectionIds(tags).
+  // for the root and for popular single tags this is a lookup in the co-occurrence index
+  bitmask childTags(const std::vector<tagid>& tags, const posting_list& files) const;
+  // the number of those tags when the co-occurrence index has them (the root and popular
+  // single tags), without the files; -1 otherwise
+  long childTagCount(const std::vector<tagid>& tags) const;
+
   // note: due to representation of directories
   // there must be no file named equally like tag
   // and no tag named equally like file
-  void defineFile(const std::string& f);
-  void defineTag(const std::string& t);
-  void link(const std::string& f, const std::string& t);
+  // both return the id of the (possibly already existing) file or tag, or NONE.
+  // A new file belongs to root, an existing one stays where it is
+  fileid defineFile(std::string_view f, unsigned root = 0);
+  tagid defineTag(std::string_view t);
+  void link(std::string_view f, std::string_view t);
+  void linkIds(fileid f, tagid t);
+  void unlinkIds(fileid f, tagid t);
+  // remove the file or tag with all its links; the id becomes free
+  void removeFile(fileid f);
+  void removeTag(tagid t);
+  // compacts posting lists and builds the co-occurrence index after loading
+  void optimize(void);
+
+  // editing of a loaded dispatcher, one change at a time (tagging through the mount).
+  // Unlike the functions above these keep the co-occurrence index up to date and
+  // describe the change in changes (if given), see builder::build; the generation is
+  // left to the caller.
+  // adds and removes tags of the file, defining it in root if needed; NONE if it is a tag
+  fileid retagFile(std::string_view file, const std::vector<tagid>& add,
+		   const std::vector<tagid>& remove, delta *changes, unsigned root = 0);
+  void forgetFile(fileid f, delta *changes);
+  // NONE if the name is taken by a file
+  tagid createTag(std::string_view name, delta *changes);
+  // ids don't change, so nothing computed from ids is affected; false if the name is taken
+  bool renameTag(tagid t, std::string_view name);
+  // approximate heap usage of the file-tag relation, in bytes
+  size_t linksMemoryUsage(void) const;
+  // the same for names and the dictionaries
+  size_t namesMemoryUsage(void) const;
 
   void reset(void);
   
 };
 
+// two-phase construction of a whole dispatcher: names and links are collected first,
+// then every structure is sized once and filled in a single pass, so building is
+// linear in the number of links. Used by the loader; small changes go through
+// defineFile/defineTag/linkIds as usual.
+class dispatcher::builder
+{
+private:
+  name_arena files;
+  name_arena tags;
+  // (file, tag) in builder ids; may contain duplicates
+  std::vector< std::pair<uint32_t, uint32_t> > links;
+  // names collected by add(), and the roots of its files (NO_ROOT for files collected
+  // by addFile)
+  name_table added_files;
+  name_table added_tags;
+  std::vector<uint16_t> file_roots;
+  static const uint16_t NO_ROOT = 0xffff;
+
+  // (file, tag) pairs grouped by file: tags of file f are by_file[start[f]..start[f + 1])
+  void groupByFile(std::vector<size_t>& start, std::vector<uint32_t>& by_file) const;
+  void replace(dispatcher& d, delta *changes, unsigned root);
+
+public:
+
+  void reserve(size_t files_hint, size_t tags_hint, size_t links_hint);
+
+  // ids are consecutive from 0 in the order of calls. Names must be distinct and no
+  // file may be named like a tag: the builder doesn't look names up, the caller
+  // resolves that (the loader does it while indexing)
+  fileid addFile(std::string_view name);
+  tagid addTag(std::string_view name);
+  void addLink(fileid f, tagid t);
+  // every file of d with its tags, as files of root. Names collected by earlier calls
+  // win: a file already collected, or named like a tag collected, is skipped, and so
+  // are tags named like collected files
+  void add(const dispatcher& d, unsigned root);
+
+  size_t fileCount(void) const { return files.size(); }
+  size_t tagCount(void) const { return tags.size(); }
+  size_t linkCount(void) const { return links.size(); }
+
+  // makes the files of root in d exactly the collected files with their links, and
+  // leaves the builder empty. An empty d is built in bulk (on up to `threads` threads)
+  // and gets ids equal to the builder ones; files collected by add() keep their roots
+  // there. Otherwise only the difference is applied:
+  // files of root which are gone are removed, new ones take freed ids first, links of
+  // files are compared one by one; the cost is a lookup per name plus the size of the
+  // changes. Files of other roots are left alone, a name they have is skipped; tags
+  // which are not collected are removed when no file has them any more. What was
+  // changed is written to changes, if given. The dispatcher is optimized afterwards.
+  void build(dispatcher& d, unsigned threads = 1, delta *changes = NULL, unsigned root = 0);
+};
+
+// changes made by builder::build, for keeping cached results of directories which
+// are not affected
+struct dispatcher::delta
+{
+  // nothing can be compared with the previous contents
+  bool rebuilt;
+  // (tags before, tags after) of every changed file, both sorted
+  std::vector< std::pair< std::vector<tagid>, std::vector<tagid> > > files;
+  // their ids, in the order of the changes, and whether the change created or removed
+  // the file: the id of a removed file may come again for a new one
+  enum file_event { RETAGGED, CREATED, REMOVED };
+  std::vector< std::pair<fileid, file_event> > file_ids;
+  // sorted ids of tags which were removed or given to new tags
+  std::vector<tagid> renamed_tags;
+
+  delta(void) : rebuilt(true), files(), file_ids(), renamed_tags() { }
+
+  // whether the directory given by the sorted set of tags may have other files or
+  // subdirectories now: some changed file had or has all of them
+  bool affects(const std::vector<tagid>& key) const;
+};
+
 #endif /* __DISPATCH_H */
@@ -9,28 +9,214 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 
 #include <string>
+#include <string_view>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <iterator>
 
+#include "bitmask.h"
+#include "cache.h"
 #include "dispatch.h"
+#include "journal.h"
+#include "posting.h"
+#include "stats.h"
 #include "util.h"
 #include "parser.h"
-
-std::string storage_path;
+#include "query.h"
+#include "rcu.h"
+#include "tagindex.h"
+#include "watcher.h"
 
 // neccessary attributes applied to all virtual files
-time_t mount_time;
 uid_t uid;
 gid_t gid;
 
-// dispatcher is an engine for all tag operations (intersections and so on)
-static dispatcher disp;
+// everything which is replaced by reload. Snapshots are immutable: fuse runs
+// requests in several threads, which read the current snapshot without locks,
+// while reload builds a new one aside and swaps it in (see rcu.h)
+struct tag_snapshot
+{
+  // dispatcher is an engine for all tag operations (intersections and so on)
+  dispatcher disp;
+  // used as the time of all virtual files
+  time_t mount_time;
+};
+static rcu_pointer<tag_snapshot> current;
+typedef rcu_pointer<tag_snapshot>::guard snapshot_guard;
+
+// listings of recently visited directories; the budget may be changed by --cache-mb.
+// The most used ones are kept up to date as views (see directory_cache), as many as
+// --hot-views says in at most --hot-views-mb
+static const size_t default_cache_mb = 64;
+static const size_t default_hot_views = 16;
+static const size_t default_hot_views_mb = 16;
+static directory_cache dircache(default_cache_mb << 20, default_hot_views, default_hot_views_mb << 20);
+
+// "/.trivialfs" is a virtual directory with read-only files describing the running daemon.
+// it is not shown in the root listing and can't clash with tags unless somebody
+// really names a tag ".trivialfs"
+static const char *control_dir = ".trivialfs";
+static const char *control_files[] = { "cache", "reload", "stats", "stats.json", NULL };
+
+// every tag directory has a hidden read-only file ".stats" with counts of its files and
+// subdirectories, and of files in every subdirectory; it hides a tag named so
+static const char *stats_file = ".stats";
+
+// every tag directory has a hidden directory ".complete" too: ".complete/fo" lists only
+// the files and subdirectories whose names start with "fo"; the files are found in the
+// sorted names without going through the whole directory (see completeDirectory), for
+// shell completion in huge directories. ".complete" itself lists nothing
+static const char *complete_dir = ".complete";
+
+// .tags is reloaded automatically after it changes, unless --no-watch is given;
+// the delay merges bursts of writes into one reload
+static const unsigned watch_delay_ms = 200;
+static bool watch_enabled = true;
+
+// one writer at a time: the watcher, "touch reload" and tagging through the mount
+// may come together
+static std::mutex write_lock;
+
+// tags changed through the mount (symlink, unlink, rename, mkdir) are appended to
+// storage/.tags.journal, and the journal is compacted into .tags after that many
+// changes, on every reload and on unmount
+static const size_t compact_records = 4096;
+
+// the storages merged into the mount, roots of the dispatcher in the same order
+// (see dispatcher::MAX_ROOTS). Every one has its .tags, journal and watcher, and is
+// reloaded on its own when its .tags changes
+struct storage_root
+{
+  std::string path;
+  tag_journal journal;
+  // false when the journal can't be written, e.g. the storage is read-only
+  bool writable;
+  // .tags as written by the last compaction, which the watcher must not reload
+  struct stat compacted_tags;
+  // records the last compaction left in the journal, see compactJournal
+  size_t kept;
+  file_watcher watcher;
+
+  storage_root(const std::string& p) : path(p), journal(), writable(false), compacted_tags(), kept(0), watcher() { }
+};
+// never changed after mount
+static std::deque<storage_root> roots;
+// changes are applied to two copies of the snapshot in turn: the one being published
+// and the one readers have just left (see rcu_pointer::replace), so that a change costs
+// its own size rather than a copy of the dispatcher. Both have equal contents and
+// generations between changes; NULL until the first change after a reload
+static tag_snapshot *spare = NULL;
+// what the last reload did, for /.trivialfs/reload
+struct reload_info
+{
+  unsigned long count;
+  time_t when;
+  double seconds;
+  const char *trigger;
+  // -1 for all of them
+  int root;
+  // how many storages were loaded, and how many of them through the index
+  unsigned loaded;
+  unsigned from_index;
+  bool rebuilt;
+  size_t changed_files;
+};
+static std::mutex reload_info_lock;
+static reload_info last_reload;
+
+// INODES
+// The kernel asks about names in a directory it knows by inode number (lookup), and
+// remembers the answers (entries) and attributes for `timeout` seconds, so a path seen
+// once is walked without coming here. Names which don't exist are remembered for
+// a second only, nothing tells the kernel when they appear. Changes of tags drop from
+// the kernel what they affect, see invalidateKernel.
+static const double default_timeout = 3600;
+static double timeout = default_timeout;
+static const double negative_timeout = 1;
+
+// An inode number is the address of a node; the root is FUSE_ROOT_ID. A directory is
+// the path it was looked up by, since the kernel wants one parent for it ("/a/b" and
+// "/b/a" are two inodes with one listing, cached by the set of tags). A file, which is
+// a symlink to the storage, has one inode wherever it is seen. A node lives while the
+// kernel remembers it, until forget brings lookups to zero. Everything but lookups,
+// links and seen_in is fixed when the node is made, and is read without node_lock,
+// except the path of directories, which a renamed tag changes (see renameNodes)
+struct inode_node
+{
+  enum kind { DIRECTORY, LINK, CONTROL_DIR, CONTROL_FILE, STATS_FILE, COMPLETE_ROOT, COMPLETE_DIR };
+  kind type;
+  // where it was looked up, NULL for links and the root
+  inode_node *parent;
+  // the last element of the path, the name of the file for links; a directory named
+  // by a tag is renamed with it, under node_lock
+  std::string name;
+  // directories: the path from the root; completion directories have the elements of
+  // the tag directory they complete in, and the prefix as the name. Read without
+  // node_lock, so a rename replaces it as a whole, and every version is kept until
+  // the node is forgotten
+  std::atomic<const std::vector<std::string> *> path;
+  std::vector< std::unique_ptr< const std::vector<std::string> > > paths;
+  uint64_t lookups;
+  // directories: names of links looked up in them, checked after changes
+  std::set<std::string> links;
+  // links: the directories they were looked up in
+  std::set<inode_node*> seen_in;
+
+  inode_node(kind t, inode_node *p, const std::string& n, const std::vector<std::string>& e) :
+    type(t), parent(p), name(n), path(NULL), paths(), lookups(0), links(), seen_in() {
+    setPath(e);
+  }
+  const std::vector<std::string>& elements(void) const { return *path.load(std::memory_order_acquire); }
+  void setPath(const std::vector<std::string>& e) {
+    paths.push_back(std::unique_ptr< const std::vector<std::string> >(new std::vector<std::string>(e)));
+    path.store(paths.back().get(), std::memory_order_release);
+  }
+};
+static std::mutex node_lock;
+static inode_node root_node(inode_node::DIRECTORY, NULL, "", std::vector<std::string>());
+// directories and control files by (parent, name), links by name
+static std::map<std::pair<inode_node*, std::string>, inode_node*> dir_nodes;
+static std::unordered_map<std::string, inode_node*> link_nodes;
+// directories checked after changes (tag and completion ones, but the root) by the names
+// in their paths, so that a change visits those which may contain its files rather than
+// all of them; see indexNames. Under node_lock
+static std::unordered_map<std::string, std::set<inode_node*> > dirs_by_name;
+// the ones whose path includes no tag (only exclusions and unions), which any change
+// may affect, like the root
+static std::set<inode_node*> dirs_without_tags;
+
+// invalidations waiting for the notifier thread: of the entry name in ino, or of the
+// attributes and data of ino when name is empty
+struct kernel_notice
+{
+  fuse_ino_t ino;
+  std::string name;
+};
+static std::mutex notice_lock;
+static std::condition_variable notice_ready;
+static std::deque<kernel_notice> notices;
+static bool notifier_running = false;
+static std::thread notifier;
+static struct fuse_chan *channel = NULL;
+
+static void invalidateKernel(const dispatcher::delta& changes, bool every_dir);
+static void queueNotices(std::vector<kernel_notice>& found);
+static kernel_notice entryNotice(const inode_node *dir, const std::string& name);
+static void renameNodes(const std::string& from, const std::string& to);
 
 // auxiliary function that's used only to check whether we can read .tags
 // in particular it checks whether file exists
@@ -42,180 +228,1273 @@ bool isFileReadable(std::string path){
   return true;
 }
 
+static bool isSameFile(const struct stat& a, const struct stat& b){
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+    a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+// a delta of two consecutive changes: affects() is true if it is for either of them
+static void mergeDelta(dispatcher::delta& into, const dispatcher::delta& more){
+  into.rebuilt = into.rebuilt || more.rebuilt;
+  into.files.insert(into.files.end(), more.files.begin(), more.files.end());
+  into.file_ids.insert(into.file_ids.end(), more.file_ids.begin(), more.file_ids.end());
+  std::vector<dispatcher::tagid> renamed;
+  std::set_union(into.renamed_tags.begin(), into.renamed_tags.end(),
+		 more.renamed_tags.begin(), more.renamed_tags.end(), std::back_inserter(renamed));
+  into.renamed_tags.swap(renamed);
+}
+
+// writes the files of root in disp (which must contain every journaled change) to its
+// .tags and empties its journal. .tags has no place for a tag without files (made by
+// mkdir, or left by its last file), so such tags stay in the journal of the first
+// storage as NEW_TAG records, as new tags go there (see journalsOf). Called with
+// write_lock held
+static bool compactJournal(const dispatcher& disp, unsigned root){
+  storage_root& s = roots[root];
+  if(s.journal.records() == s.kept) return true;
+  struct stat written;
+  if(!saveTags(disp, s.path + "/.tags", &written, root)) return false;
+  s.compacted_tags = written;
+  // the next mount doesn't have to parse what we have just written; the index can't
+  // hold several roots, those are parsed again
+  if(roots.size() == 1) tag_index::save(disp, s.path + "/.tags.index", written);
+  if(!s.journal.clear()) return false;
+  s.kept = 0;
+  if(root != 0) return true;
+  for(dispatcher::tagid t = 0; t < disp.tagIdCount(); ++t){
+    std::string_view name = disp.tagname(t);
+    // free ids have no name
+    if(name.empty() || !disp.filesWith(t).empty()) continue;
+    if(!s.journal.append(journal_record(journal_record::NEW_TAG, name))) return false;
+    s.kept++;
+  }
+  return true;
+}
+
+// the storage of a file, for the target of its link
+static const std::string& storageOf(const dispatcher& disp, std::string_view name){
+  dispatcher::fileid f = disp.fileId(name);
+  return roots[f == dispatcher::NONE ? 0 : disp.rootOf(f)].path;
+}
+
+// must not be called while holding a snapshot_guard: publish() waits for all of them
+// the new snapshot starts as a copy of the current one and is updated by the difference
+// with .tags, so cached directories which didn't change survive.
+// trigger says who asked for it: "mount", "touch" or "watch"; root is the storage to
+// reload, -1 for all. Changes in the journal are applied over the new contents of
+// .tags, which is then compacted. The storages of a mount are loaded in parallel
+static void reloadTags(const char *trigger, int root){
+  std::lock_guard<std::mutex> serial(write_lock);
+  struct stat source;
+  if(strcmp(trigger, "watch") == 0 && stat((roots[root].path + "/.tags").c_str(), &source) == 0 &&
+     isSameFile(source, roots[root].compacted_tags)){
+    // our own compaction, which is what is loaded already
+    return;
+  }
+  unsigned first = root < 0 ? 0 : root, last = root < 0 ? roots.size() : root + 1;
+  struct timespec start, finish;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  tag_snapshot *fresh;
+  {
+    snapshot_guard old = current.read();
+    fresh = old.get() == NULL ? new tag_snapshot : new tag_snapshot(*old);
+  }
+  unsigned long previous = fresh->disp.generation();
+  dispatcher::delta changes;
+  unsigned from_index = 0;
+  if(roots.size() > 1 && fresh->disp.empty()){
+    std::vector<std::string> paths;
+    for(size_t r = 0; r < roots.size(); ++r) paths.push_back(roots[r].path);
+    from_index = loadRoots(fresh->disp, paths);
+  }else{
+    for(unsigned r = first; r < last; ++r){
+      dispatcher::delta more;
+      if(loadStorage(fresh->disp, roots[r].path, 0, &more, r)) from_index++;
+      if(r == first) changes = more; else mergeDelta(changes, more);
+    }
+  }
+  bool replayed = false;
+  for(unsigned r = first; r < last; ++r){
+    size_t records = tag_journal::replay(roots[r].path + "/.tags.journal", [&](const journal_record& j){
+	dispatcher::delta more;
+	applyRecord(fresh->disp, j, &more, r);
+	mergeDelta(changes, more);
+      });
+    if(records == 0) continue;
+    replayed = true;
+    if(roots[r].writable) compactJournal(fresh->disp, r);
+  }
+  if(replayed) fresh->disp.setGeneration(dispatcher::nextGeneration());
+  fresh->mount_time = time(NULL);
+  // the copy for changes is of the old contents
+  delete spare;
+  spare = NULL;
+  dircache.retain(previous, changes, fresh->disp.generation());
+  current.publish(fresh);
+  invalidateKernel(changes, true);
+
+  clock_gettime(CLOCK_MONOTONIC, &finish);
+  op_stats::global().record(op_stats::RELOAD, (finish.tv_sec - start.tv_sec) * 1000000000ull +
+			    finish.tv_nsec - start.tv_nsec);
+  std::lock_guard<std::mutex> guard(reload_info_lock);
+  last_reload.count++;
+  last_reload.when = time(NULL);
+  last_reload.seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) * 1e-9;
+  last_reload.trigger = trigger;
+  last_reload.root = root;
+  last_reload.loaded = last - first;
+  last_reload.from_index = from_index;
+  last_reload.rebuilt = changes.rebuilt;
+  last_reload.changed_files = changes.files.size();
+}
+
+// the storages whose journals get the record: the one of the file, root for a new
+// file, the first one for a new tag, and every one having files with a renamed tag
+static std::vector<unsigned> journalsOf(const dispatcher& disp, const journal_record& r, unsigned root){
+  std::vector<unsigned> result;
+  if(r.op == journal_record::RETAG || r.op == journal_record::FORGET){
+    dispatcher::fileid f = disp.fileId(r.name);
+    result.push_back(f == dispatcher::NONE ? root : disp.rootOf(f));
+  }else if(r.op == journal_record::RENAME_TAG && roots.size() > 1){
+    std::vector<bool> has(roots.size(), false);
+    dispatcher::tagid t = disp.tagId(r.name);
+    if(t != dispatcher::NONE){
+      const posting_list& files = disp.filesWith(t);
+      for(posting_list::const_iterator it = files.begin(); it != files.end(); ++it) has[disp.rootOf(*it)] = true;
+    }
+    for(unsigned i = 0; i < roots.size(); ++i) if(has[i]) result.push_back(i);
+  }
+  if(result.empty()) result.push_back(0);
+  return result;
+}
+
+// applies one change made through the mount: to the spare copy, which is published,
+// then to the copy the readers have left, which becomes the spare one. A new file goes
+// to storage root. Callers check names beforehand; returns 0 or -errno
+static int editTags(const journal_record& r, unsigned root = 0){
+  std::lock_guard<std::mutex> serial(write_lock);
+  if(spare == NULL){
+    snapshot_guard snap = current.read();
+    spare = new tag_snapshot(*snap);
+  }
+  std::vector<unsigned> journals = journalsOf(spare->disp, r, root);
+  for(size_t i = 0; i < journals.size(); ++i) if(!roots[journals[i]].writable) return -EROFS;
+  unsigned long previous = spare->disp.generation();
+  dispatcher::delta changes;
+  int error = 0;
+  if(!applyRecord(spare->disp, r, &changes, root)){
+    // a name was taken by the other kind meanwhile
+    error = -EEXIST;
+  }else{
+    // every journal gets the record or none does
+    for(size_t i = 0; i < journals.size() && error == 0; ++i){
+      if(roots[journals[i]].journal.append(r)) continue;
+      error = -EIO;
+      while(i-- > 0){
+	if(!roots[journals[i]].journal.dropLast()){
+	  fprintf(stderr, "Can't undo a change in %s/.tags.journal\n", roots[journals[i]].path.c_str());
+	}
+      }
+    }
+  }
+  if(error != 0){
+    // the copies may differ now, the next change starts from a fresh one
+    delete spare;
+    spare = NULL;
+    return error;
+  }
+  unsigned long generation = dispatcher::nextGeneration();
+  spare->disp.setGeneration(generation);
+  spare->mount_time = time(NULL);
+  dircache.retain(previous, changes, generation);
+
+  tag_snapshot *old = current.replace(spare);
+  applyRecord(old->disp, r, NULL, root);
+  old->disp.setGeneration(generation);
+  old->mount_time = spare->mount_time;
+  spare = old;
+  if(r.op == journal_record::RENAME_TAG) renameNodes(r.name, r.new_name);
+  // a renamed tag may be in queries, which aren't renamed and are gone now
+  invalidateKernel(changes, r.op == journal_record::RENAME_TAG);
+  for(size_t i = 0; i < journals.size(); ++i){
+    storage_root& s = roots[journals[i]];
+    if(s.journal.records() >= s.kept + compact_records) compactJournal(spare->disp, journals[i]);
+  }
+  return 0;
+}
+
+static std::string reloadReport(void){
+  // before reload_info_lock, which reloadTags takes while holding write_lock
+  size_t pending = 0;
+  bool writable = true;
+  {
+    std::lock_guard<std::mutex> serial(write_lock);
+    for(size_t r = 0; r < roots.size(); ++r){
+      pending += roots[r].journal.records();
+      writable = writable && roots[r].writable;
+    }
+  }
+  std::lock_guard<std::mutex> guard(reload_info_lock);
+  char when[64];
+  struct tm tm;
+  localtime_r(&last_reload.when, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S %z", &tm);
+  char changed[32];
+  snprintf(changed, sizeof(changed), "%zu", last_reload.changed_files);
+  char source[64];
+  if(last_reload.from_index == 0) snprintf(source, sizeof(source), ".tags");
+  else if(last_reload.from_index == last_reload.loaded) snprintf(source, sizeof(source), "binary index");
+  else snprintf(source, sizeof(source), "binary index for %u of %u storages",
+		last_reload.from_index, last_reload.loaded);
+  std::string storages;
+  for(size_t r = 0; r < roots.size(); ++r){
+    storages += r == 0 ? "" : ", ";
+    storages += roots[r].path;
+  }
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+	   "reloads: %lu\n"
+	   "last: %s\n"
+	   "duration: %.3f s\n"
+	   "trigger: %s\n"
+	   "reloaded: %s\n"
+	   "source: %s\n"
+	   "changed files: %s\n"
+	   "watching: %s\n"
+	   "journaled changes: %zu%s\n",
+	   last_reload.count, when, last_reload.seconds, last_reload.trigger,
+	   last_reload.root < 0 ? "all storages" : roots[last_reload.root].path.c_str(),
+	   source, last_reload.rebuilt ? "all" : changed, watch_enabled ? "yes" : "no",
+	   pending, writable ? "" : " (read-only)");
+  return "storages: " + storages + "\n" + buf;
+}
+
 static void initDefaults(void){
-  disp.reset();
-  loadTags(disp, storage_path + "/.tags");
-  mount_time = time(NULL);
   uid = getuid();
   gid = getgid();
+  reloadTags("mount", -1);
 }
 
-bool is_root(const char *path){
-  return (*path == '/') && (*(path + 1) == '\0');
+static bool isControlFile(const std::string& name){
+  for(const char **file = control_files; *file != NULL; ++file){
+    if(name == *file) return true;
+  }
+  return false;
 }
 
-static int tri_getattr(const char *path, struct stat *st){
-  memset(st, 0, sizeof(struct stat));
+// fills contents of the control file, returns false if there is no such file
+static bool controlFile(const std::string& name, std::string *contents){
+  if(name == "cache"){
+    if(contents != NULL) *contents = dircache.report();
+    return true;
+  }
+  if(name == "reload"){
+    if(contents != NULL) *contents = reloadReport();
+    return true;
+  }
+  if(name == "stats"){
+    if(contents != NULL) *contents = op_stats::global().report();
+    return true;
+  }
+  if(name == "stats.json"){
+    if(contents != NULL) *contents = op_stats::global().json();
+    return true;
+  }
+  return false;
+}
+
+// .stats of dir: numbers of files and subdirectories, then "count tag" for every
+// subdirectory, the most populous first
+static std::string directoryStats(const dispatcher& disp, const inode_node *dir){
+  directory_cache::value listing = directoryStructure(disp, dircache, dir->elements());
+  std::vector<size_t> counts = subtagCounts(disp, *listing);
+  std::vector< std::pair<size_t, dispatcher::tagid> > order;
+  for(size_t i = listing->subtags.next(0); i < listing->subtags.size(); i = listing->subtags.next(i + 1)){
+    order.push_back(std::make_pair(counts[i], i));
+  }
+  std::sort(order.begin(), order.end(), [&](const std::pair<size_t, dispatcher::tagid>& a,
+					    const std::pair<size_t, dispatcher::tagid>& b){
+	      return a.first != b.first ? a.first > b.first : disp.tagname(a.second) < disp.tagname(b.second);
+	    });
+  char buf[64];
+  snprintf(buf, sizeof(buf), "files: %zu\nsubdirectories: %zu\n", listing->files.cardinality(), order.size());
+  std::string contents(buf);
+  for(size_t i = 0; i < order.size(); ++i){
+    snprintf(buf, sizeof(buf), "%zu ", order[i].first);
+    contents += buf;
+    contents += disp.tagname(order[i].second);
+    contents += '\n';
+  }
+  return contents;
+}
+
+static fuse_ino_t inodeOf(const inode_node *n){
+  return n == &root_node ? FUSE_ROOT_ID : (fuse_ino_t) (uintptr_t) n;
+}
+
+static inode_node *node(fuse_ino_t ino){
+  return ino == FUSE_ROOT_ID ? &root_node : (inode_node *) (uintptr_t) ino;
+}
+
+static bool isDirectory(const inode_node *n){
+  return n->type == inode_node::DIRECTORY || n->type == inode_node::CONTROL_DIR ||
+    n->type == inode_node::COMPLETE_ROOT || n->type == inode_node::COMPLETE_DIR;
+}
+
+// the control directory or a virtual file, or a name which would be one
+static bool isControl(const inode_node *dir, const std::string& name){
+  if(dir->type != inode_node::DIRECTORY) return dir->type != inode_node::LINK;
+  return name == stats_file || name == complete_dir || (dir == &root_node && name == control_dir);
+}
+
+// whether the node still names something: the kernel may ask about a node after a
+// change, until it gets the invalidation
+static bool stillExists(const dispatcher& disp, const inode_node *n){
+  switch(n->type){
+  case inode_node::DIRECTORY:
+    return n == &root_node || validDirectory(disp, n->elements());
+  case inode_node::LINK:
+    return disp.isFileDefined(n->name);
+  case inode_node::STATS_FILE:
+  case inode_node::COMPLETE_ROOT:
+  case inode_node::COMPLETE_DIR:
+    return stillExists(disp, n->parent);
+  default:
+    return true;
+  }
+}
 
-  // last element in path (it may be name of tag, actually)
-  std::string filename;
-  bool is_directory = false;
-  bool is_file = false;
-  
-  if(is_root(path)){
-    is_directory = true;
+// what name is in dir by the snapshot, false if nothing
+static bool findEntry(const dispatcher& disp, const inode_node *dir, const std::string& name,
+		      inode_node::kind *type){
+  if(dir->type == inode_node::CONTROL_DIR){
+    *type = inode_node::CONTROL_FILE;
+    return isControlFile(name);
+  }
+  if(dir == &root_node && name == control_dir){
+    *type = inode_node::CONTROL_DIR;
+    return true;
+  }
+  if(dir->type == inode_node::COMPLETE_ROOT){
+    *type = inode_node::COMPLETE_DIR;
+    return stillExists(disp, dir);
+  }
+  if(dir->type == inode_node::COMPLETE_DIR){
+    // only what the directory lists; entries are found like in the tag directory
+    if(name.compare(0, dir->name.size(), dir->name) != 0) return false;
+  }else if(name == stats_file || name == complete_dir){
+    *type = name == stats_file ? inode_node::STATS_FILE : inode_node::COMPLETE_ROOT;
+    return stillExists(disp, dir);
+  }
+  path_kind kind;
+  {
+    op_timer timer(op_stats::RESOLVE);
+    kind = resolveEntry(disp, dir->elements(), name);
+  }
+  switch(kind){
+  case FILE_ENTRY:
+    *type = inode_node::LINK;
+    return true;
+  case DIRECTORY_ENTRY:
+    *type = inode_node::DIRECTORY;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// the node of name in dir, with one more lookup on it
+// every name in the path: the elements as they are and the tags inside queries ("-a",
+// "(a|b)"), which is more than the tags the directory includes. *includes is false when
+// no element can include a tag (see tag_query::addElement)
+static std::vector<std::string> indexNames(const std::vector<std::string>& elements, bool *includes){
+  std::vector<std::string> names;
+  *includes = false;
+  for(size_t i = 0; i < elements.size(); ++i){
+    names.push_back(elements[i]);
+    std::string_view e = elements[i];
+    bool excluded = e.size() > 1 && e[0] == '-';
+    if(excluded) e.remove_prefix(1);
+    bool united = false;
+    if(e.size() >= 2 && e.front() == '(' && e.back() == ')'){
+      e = e.substr(1, e.size() - 2);
+      united = e.find('|') != std::string_view::npos;
+      while(true){
+	size_t bar = e.find('|');
+	names.push_back(std::string(e.substr(0, bar)));
+	if(bar == std::string_view::npos) break;
+	e.remove_prefix(bar + 1);
+      }
+    }else if(excluded){
+      names.push_back(std::string(e));
+    }
+    *includes = *includes || (!excluded && !united);
+  }
+  return names;
+}
+
+static bool isCheckedDirectory(const inode_node *n){
+  return n != &root_node && (n->type == inode_node::DIRECTORY || n->type == inode_node::COMPLETE_DIR);
+}
+
+// whether n, which had the path elements, is still known; n may have been deleted, so
+// it is only compared. Under node_lock
+static bool isIndexed(const inode_node *n, const std::vector<std::string>& elements){
+  if(elements.empty()) return dirs_without_tags.count((inode_node *) n) != 0;
+  std::unordered_map<std::string, std::set<inode_node*> >::const_iterator it = dirs_by_name.find(elements[0]);
+  return it != dirs_by_name.end() && it->second.count((inode_node *) n) != 0;
+}
+
+// both under node_lock
+static void indexNode(inode_node *n){
+  if(!isCheckedDirectory(n)) return;
+  bool includes;
+  std::vector<std::string> names = indexNames(n->elements(), &includes);
+  for(size_t i = 0; i < names.size(); ++i) dirs_by_name[names[i]].insert(n);
+  if(!includes) dirs_without_tags.insert(n);
+}
+
+static void unindexNode(inode_node *n){
+  if(!isCheckedDirectory(n)) return;
+  bool includes;
+  std::vector<std::string> names = indexNames(n->elements(), &includes);
+  for(size_t i = 0; i < names.size(); ++i){
+    std::unordered_map<std::string, std::set<inode_node*> >::iterator it = dirs_by_name.find(names[i]);
+    if(it == dirs_by_name.end()) continue;
+    it->second.erase(n);
+    if(it->second.empty()) dirs_by_name.erase(it);
+  }
+  dirs_without_tags.erase(n);
+}
+
+static inode_node *rememberEntry(inode_node *dir, const std::string& name, inode_node::kind type){
+  std::lock_guard<std::mutex> guard(node_lock);
+  inode_node *&n = type == inode_node::LINK ? link_nodes[name] : dir_nodes[std::make_pair(dir, name)];
+  if(n == NULL){
+    std::vector<std::string> elements = dir->elements();
+    if(type == inode_node::DIRECTORY) elements.push_back(name);
+    n = new inode_node(type, type == inode_node::LINK ? NULL : dir, name, elements);
+    indexNode(n);
+  }
+  if(type == inode_node::LINK){
+    n->seen_in.insert(dir);
+    dir->links.insert(name);
+  }
+  n->lookups++;
+  return n;
+}
+
+// the kernel doesn't forget a directory before the entries in it, so a node is never
+// left with a parent which was deleted
+static void forgetNode(inode_node *n, uint64_t nlookup){
+  std::lock_guard<std::mutex> guard(node_lock);
+  if(n == &root_node) return;
+  n->lookups -= std::min(n->lookups, nlookup);
+  if(n->lookups > 0) return;
+  if(n->type == inode_node::LINK){
+    for(std::set<inode_node*>::iterator it = n->seen_in.begin(); it != n->seen_in.end(); ++it){
+      (*it)->links.erase(n->name);
+    }
+    link_nodes.erase(n->name);
   }else{
-    std::vector<std::string> tags = splitPath(path);
-    filename = extractFilename(tags);
-
-    // now tags should be really vector of valid tags
-    
-    /* we assume there are no files and tags named the same
-       so when last element in path is tag, it's directory
-    */
-    if(disp.isTagDefined(filename)){
-      if(!disp.validTags(tags)) return -ENOENT;
-      is_directory = true;
-    }else if(disp.isFileDefined(filename)){
-      if(!doesFileExist(disp, tags, filename)){
-	return -ENOENT;
-      }      
-      is_file = true;
-    }
-  }
-  
-  if(is_directory){
+    for(std::set<std::string>::iterator it = n->links.begin(); it != n->links.end(); ++it){
+      std::unordered_map<std::string, inode_node*>::iterator link = link_nodes.find(*it);
+      if(link != link_nodes.end()) link->second->seen_in.erase(n);
+    }
+    // a renamed node may have left its key to another one
+    std::map<std::pair<inode_node*, std::string>, inode_node*>::iterator it =
+      dir_nodes.find(std::make_pair(n->parent, n->name));
+    if(it != dir_nodes.end() && it->second == n) dir_nodes.erase(it);
+    unindexNode(n);
+  }
+  delete n;
+}
+
+// a directory counts its files in st_size, and its subdirectories in st_nlink (two more,
+// as usual) when its listing is cached or they are known without it (the root and
+// popular tags). Lookups come for every element of every path, so they only count the
+// files and never fill the cache; otherwise st_nlink is 1, which tools like find take
+// as "unknown", until opendir lists the directory and drops these attributes from the
+// kernel cache
+static void fillAttr(const tag_snapshot& snap, const inode_node *n, struct stat *st){
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = inodeOf(n);
+  time_t when = snap.mount_time;
+  switch(n->type){
+  case inode_node::DIRECTORY:
+    {
+      op_timer timer(op_stats::LISTING);
+      long subdirs;
+      st->st_mode = S_IFDIR | 0700;
+      st->st_size = directoryFileCount(snap.disp, dircache, n->elements(), &subdirs);
+      st->st_nlink = subdirs < 0 ? 1 : 2 + subdirs;
+    }
+    break;
+  case inode_node::CONTROL_DIR:
+  case inode_node::COMPLETE_ROOT:
+  case inode_node::COMPLETE_DIR:
     st->st_mode = S_IFDIR | 0700;
     st->st_nlink = 2;
-  }else if(is_file){
+    break;
+  case inode_node::LINK:
     st->st_mode = S_IFLNK | 0400;
     st->st_nlink = 1;
     // +1 for '/' between storage path and filename
-    st->st_size = storage_path.size() + filename.size() + 1;
-  }else{
-    /* there is no such file at all */
-    return -ENOENT;
+    st->st_size = storageOf(snap.disp, n->name).size() + n->name.size() + 1;
+    break;
+  case inode_node::CONTROL_FILE:
+  case inode_node::STATS_FILE:
+    // contents are generated on open, so the size is unknown; see tri_open
+    st->st_mode = S_IFREG | 0400;
+    st->st_nlink = 1;
+    when = time(NULL);
+    break;
   }
-  /* writing defaults */
   st->st_uid = uid;
   st->st_gid = gid;
-  
-  st->st_atime = mount_time;
-  st->st_mtime = mount_time;
-  st->st_ctime = mount_time;
-  return 0;
+  st->st_atime = st->st_mtime = st->st_ctime = when;
 }
 
-static int tri_opendir(const char *path, struct fuse_file_info *fi){
-  if(is_root(path)) return 0;
-  // all elements in path must be valid tags
-  std::vector<std::string> tags = splitPath(path);
-  if(!disp.validTags(tags)) return -ENOENT;
+// control files change all the time
+static double attrTimeout(const inode_node *n){
+  return n->type == inode_node::CONTROL_FILE || n->type == inode_node::STATS_FILE ? 0 : timeout;
+}
 
-  return 0;
+// answers a lookup of name in dir, also after mkdir and symlink. Missing names are
+// remembered by the kernel for a while (negative entries) if negative is true,
+// otherwise they are an error
+static void replyEntry(fuse_req_t req, inode_node *dir, const std::string& name, bool negative){
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  // held until the node is remembered, so a change published meanwhile waits for it
+  // and then sees the node in invalidateKernel
+  snapshot_guard snap = current.read();
+  inode_node::kind type;
+  if(!findEntry(snap->disp, dir, name, &type)){
+    if(!negative){
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+    e.ino = 0;
+    e.entry_timeout = negative_timeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  inode_node *n = rememberEntry(dir, name, type);
+  e.ino = inodeOf(n);
+  fillAttr(*snap, n, &e.attr);
+  e.attr_timeout = attrTimeout(n);
+  e.entry_timeout = timeout;
+  // the request was interrupted, the kernel didn't get the node
+  if(fuse_reply_entry(req, &e) != 0) forgetNode(n, 1);
 }
 
-static int tri_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi){
-  // directories are always tags, files are always files
-  // so we will use a pair consisting of tags we are to show as subdirectories
-  // and files which lie in the current directory
-  // and we are going to keep the list by (internal to dispatcher) ids
-  // so dirs.first is a bool vector which has 'true' at nth place if the ith tag is
-  // to be shown
+static void tri_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+  op_timer timer(op_stats::LOOKUP);
+  inode_node *dir = node(parent);
+  if(!isDirectory(dir)){
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  replyEntry(req, dir, name, true);
+}
 
-  std::vector<std::string> tags = splitPath(path);
-  if(!disp.validTags(tags)) return -ENOENT;
-  
-  std::pair< std::vector<bool>, std::vector<bool> > structure = directoryStructure(disp, tags);
-  std::vector<bool> dirs = structure.first;
-  std::vector<bool> files = structure.second;
-  
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+static void tri_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup){
+  forgetNode(node(ino), nlookup);
+  fuse_reply_none(req);
+}
 
-  for(size_t i = 0; i < dirs.size(); ++i){
-    if(dirs[i]){
-      filler(buf, disp.tagname(i).c_str(), NULL, 0);
-    }
-  }
-  for(size_t i = 0; i < files.size(); ++i){
-    if(files[i]){
-      filler(buf, disp.filename(i).c_str(), NULL, 0);
+static void tri_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  op_timer timer(op_stats::GETATTR);
+  const inode_node *n = node(ino);
+  struct stat st;
+  {
+    snapshot_guard snap = current.read();
+    if(!stillExists(snap->disp, n)){
+      fuse_reply_err(req, ENOENT);
+      return;
     }
+    fillAttr(*snap, n, &st);
   }
+  fuse_reply_attr(req, &st, attrTimeout(n));
+}
 
-  return 0;
+static void tri_readlink(fuse_req_t req, fuse_ino_t ino){
+  op_timer timer(op_stats::READLINK);
+  const inode_node *n = node(ino);
+  if(n->type != inode_node::LINK){
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  snapshot_guard snap = current.read();
+  if(!snap->disp.isFileDefined(n->name)){
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  // storage path + "/" + filename; the buffer of the thread is reused
+  static thread_local std::string target;
+  target.assign(storageOf(snap->disp, n->name));
+  target += '/';
+  target += n->name;
+  fuse_reply_readlink(req, target.c_str());
 }
 
-static int tri_open(const char *path, struct fuse_file_info *fi){
-  std::vector<std::string> tags = splitPath(path);
-  std::string filename = extractFilename(tags);
-  bool exist = doesFileExist(disp, tags, filename);
-  if(!exist){
-    return -ENOENT;
+static void tri_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  op_timer timer(op_stats::OPEN);
+  const inode_node *n = node(ino);
+  if(isDirectory(n)){
+    fuse_reply_err(req, EISDIR);
+    return;
   }
   /* if file is opened not only for reading */
   if((fi->flags & 3) != O_RDONLY){
-    return -EACCES;
+    fuse_reply_err(req, EACCES);
+    return;
   }
-  /* all is ok */
-  return 0;
+  if(n->type == inode_node::CONTROL_FILE || n->type == inode_node::STATS_FILE){
+    std::string contents;
+    if(n->type == inode_node::CONTROL_FILE){
+      controlFile(n->name, &contents);
+    }else{
+      snapshot_guard snap = current.read();
+      if(!stillExists(snap->disp, n)){
+	fuse_reply_err(req, ENOENT);
+	return;
+      }
+      contents = directoryStats(snap->disp, n->parent);
+    }
+    // a snapshot of the contents lives until release; direct_io makes the kernel
+    // ignore st_size, which is unknown in getattr
+    fi->fh = (uint64_t) new std::string(contents);
+    fi->direct_io = 1;
+  }else if(!current.read()->disp.isFileDefined(n->name)){
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  if(fuse_reply_open(req, fi) != 0) delete (std::string *) fi->fh;
+}
+
+static void replySlice(fuse_req_t req, const std::string& contents, size_t size, off_t offset){
+  if(offset >= (off_t) contents.size()){
+    fuse_reply_buf(req, NULL, 0);
+    return;
+  }
+  fuse_reply_buf(req, contents.data() + offset, std::min(size, contents.size() - offset));
+}
+
+static void tri_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		     struct fuse_file_info *fi){
+  op_timer timer(op_stats::READ);
+  // only control files are readable, real files are symlinks
+  if(fi->fh == 0){
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  replySlice(req, *(const std::string *) fi->fh, size, offset);
 }
 
-static int tri_readlink(const char *path, char *buf, size_t size){
+static void tri_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  delete (std::string *) fi->fh;
+  fi->fh = 0;
+  fuse_reply_err(req, 0);
+}
+
+// OPEN DIRECTORIES
+// readdir is answered in pieces as large as the kernel asks for, so huge directories
+// cost no more memory than the listing, which is shared with the cache. The offset of
+// an entry tells where the next piece starts. It is the id of the entry in its section
+// (subdirectories, then files), and ids don't change when tags are edited. So a
+// directory changed while it is being read goes on from its new listing, without
+// repeating or skipping the entries which stayed.
+static const off_t tags_offset = (off_t) 1 << 32;
+static const off_t files_offset = (off_t) 2 << 32;
+
+struct dir_cursor
+{
+  // made by opendir, and again by readdir when the snapshot has changed
+  directory_cache::value listing;
+  unsigned long generation;
+};
+
+// the kernel doesn't need inode numbers of listed entries, it looks them up. This is
+// what libfuse gives when it doesn't know them, 0 would make readdir skip the entry
+static const fuse_ino_t unknown_ino = 0xffffffff;
 
-  std::vector<std::string> path_v = splitPath(path);
-  std::string filename = extractFilename(path_v);
-  
-  if(!doesFileExist(disp, path_v, filename)) return -ENOENT;
-  
-  std::string contents = storage_path + "/" + filename;
-  // note: "+ 1" and "- 1" are here to include trailing '\0' byte
-  memcpy(buf, contents.c_str(),
-	 std::min(size, contents.size() + 1));
+// a piece of a listing being filled by readdir
+struct dir_piece
+{
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+
+  // false when the entry doesn't fit, then the piece is full
+  bool add(const char *name, mode_t type, off_t next){
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = unknown_ino;
+    st.st_mode = type;
+    size_t len = fuse_add_direntry(req, buf + used, size - used, name, &st, next);
+    if(len > size - used) return false;
+    used += len;
+    return true;
+  }
+};
+
+// what a directory other than the control one lists by the snapshot. A tag directory
+// whose listing wasn't cached may have given the kernel attributes without the number
+// of subdirectories (see fillAttr); they are dropped, so the next stat counts them
+static directory_cache::value listingOf(const dispatcher& disp, const inode_node *n){
+  op_timer timer(op_stats::LISTING);
+  switch(n->type){
+  case inode_node::COMPLETE_ROOT:
+    return std::make_shared<directory_listing>();
+  case inode_node::COMPLETE_DIR:
+    return std::make_shared<directory_listing>(completeDirectory(disp, dircache, n->elements(), n->name));
+  default: {
+    bool computed;
+    directory_cache::value listing = directoryStructure(disp, dircache, n->elements(), &computed);
+    if(computed){
+      std::vector<kernel_notice> found(1, entryNotice(n, std::string()));
+      queueNotices(found);
+    }
+    return listing;
+  }
+  }
+}
+
+static void tri_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  op_timer timer(op_stats::OPENDIR);
+  const inode_node *n = node(ino);
+  if(!isDirectory(n)){
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  dir_cursor *cursor = new dir_cursor;
+  cursor->generation = 0;
+  if(n->type != inode_node::CONTROL_DIR){
+    snapshot_guard snap = current.read();
+    // all elements in path must be valid tags or queries over them
+    if(!stillExists(snap->disp, n)){
+      delete cursor;
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+    cursor->listing = listingOf(snap->disp, n);
+    cursor->generation = snap->disp.generation();
+  }
+  fi->fh = (uint64_t) cursor;
+  if(fuse_reply_open(req, fi) != 0) delete cursor;
+}
+
+static void tri_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			struct fuse_file_info *fi){
+  op_timer timer(op_stats::READDIR);
+  const inode_node *n = node(ino);
+  dir_cursor *cursor = (dir_cursor *) fi->fh;
+  // the piece is built in a buffer of the thread, which is reused
+  static thread_local std::string buf;
+  if(buf.size() < size) buf.resize(size);
+  dir_piece piece = { req, &buf[0], size, 0 };
+
+  if((offset < 1 && !piece.add(".", S_IFDIR, 1)) || (offset < 2 && !piece.add("..", S_IFDIR, 2))){
+    fuse_reply_buf(req, piece.buf, piece.used);
+    return;
+  }
+  if(n->type == inode_node::CONTROL_DIR){
+    size_t i = offset >= files_offset ? offset - files_offset + 1 : 0;
+    for(; control_files[i] != NULL && piece.add(control_files[i], S_IFREG, files_offset + i); ++i);
+    fuse_reply_buf(req, piece.buf, piece.used);
+    return;
+  }
+
+  snapshot_guard snap = current.read();
+  const dispatcher& disp = snap->disp;
+  if(cursor->generation != disp.generation()){
+    if(!stillExists(disp, n)){
+      // removed while being read: nothing more
+      fuse_reply_buf(req, piece.buf, piece.used);
+      return;
+    }
+    cursor->listing = listingOf(disp, n);
+    cursor->generation = disp.generation();
+  }
+  const bitmask& dirs = cursor->listing->subtags;
+  const posting_list& files = cursor->listing->files;
+  op_timer fill(op_stats::FILL);
+
+  if(offset < files_offset){
+    size_t first = offset >= tags_offset ? offset - tags_offset + 1 : 0;
+    for(size_t i = dirs.next(first); i < dirs.size(); i = dirs.next(i + 1)){
+      if(!piece.add(disp.tagname(i).data(), S_IFDIR, tags_offset + i)){
+	fuse_reply_buf(req, piece.buf, piece.used);
+	return;
+      }
+    }
+  }
+  uint32_t first = offset >= files_offset ? offset - files_offset + 1 : 0;
+  for(posting_list::const_iterator it = files.lowerBound(first); it != files.end(); ++it){
+    if(!piece.add(disp.filename(*it).data(), S_IFLNK, files_offset + *it)) break;
+  }
+  fuse_reply_buf(req, piece.buf, piece.used);
+}
+
+static void tri_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  delete (dir_cursor *) fi->fh;
+  fuse_reply_err(req, 0);
+}
+
+static void tri_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		       struct fuse_file_info *fi){
+  if(parent == FUSE_ROOT_ID && strcmp(name, "reload") == 0) reloadTags("touch", -1);
+  fuse_reply_err(req, ENOENT);
+}
+
+// TAGGING
+// Changes of tags through the mount, see editTags. Every path element except the last
+// must be a tag, as everywhere; the tags of the directory are given to or taken from
+// the file (or tag) named by the last element:
+//   ln -s storage/file /a/b/      adds tags a and b to file
+//   rm /a/b/file                  removes b, the tag of the directory the file is in;
+//                                 in the root the file loses all its tags
+//   mv /a/b/file /a/c/            removes b and adds c
+//   mkdir /a/new                  defines tag new, which has no files yet (and is kept
+//                                 in the journal while it has none, see compactJournal)
+//   mv /a/old /a/new              renames tag old
+// The functions take the elements of the directory and the name in it, and return
+// 0 or -errno
+
+static std::vector<std::string> uniqueTags(std::vector<std::string> tags){
+  std::sort(tags.begin(), tags.end());
+  tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+  return tags;
+}
+
+static int makeTag(const std::vector<std::string>& tags, const std::string& name){
+  {
+    snapshot_guard snap = current.read();
+    if(!snap->disp.validTags(tags)) return -ENOENT;
+    if(snap->disp.isTagDefined(name) || snap->disp.isFileDefined(name)) return -EEXIST;
+  }
+  if(!isStorableName(name, true)) return -EINVAL;
+  return editTags(journal_record(journal_record::NEW_TAG, name));
+}
+
+static int linkFile(const std::string& target, const std::vector<std::string>& tags, const std::string& name){
+  // links always point to a storage, so the link may only be made to a file there:
+  // the one the file is in already, the first one for a bare name
+  unsigned root = roots.size();
+  for(unsigned r = 0; r < roots.size() && root == roots.size(); ++r){
+    if(target == roots[r].path + "/" + name) root = r;
+  }
+  if(target == name) root = 0;
+  if(root == roots.size()) return -EINVAL;
+  // a file without tags wouldn't be seen anywhere
+  if(tags.empty()) return -EPERM;
+  {
+    snapshot_guard snap = current.read();
+    if(!validDirectory(snap->disp, tags)) return -ENOENT;
+    // tags can be given by an ordinary directory only
+    if(!snap->disp.validTags(tags)) return -EPERM;
+    if(snap->disp.isTagDefined(name)) return -EEXIST;
+    dispatcher::fileid f = snap->disp.fileId(name);
+    if(f != dispatcher::NONE){
+      if(target != name && snap->disp.rootOf(f) != root) return -EINVAL;
+      root = snap->disp.rootOf(f);
+    }
+  }
+  if(!isStorableName(name, false)) return -EINVAL;
+  journal_record r(journal_record::RETAG, name);
+  r.add = uniqueTags(tags);
+  return editTags(r, root);
+}
+
+static int unlinkFile(const std::vector<std::string>& tags, const std::string& name){
+  {
+    snapshot_guard snap = current.read();
+    if(snap->disp.isTagDefined(name)) return -EISDIR;
+    if(!doesFileExist(snap->disp, tags, name)) return -ENOENT;
+    // a query directory has no tag to take away
+    if(!snap->disp.validTags(tags)) return -EPERM;
+  }
+  if(tags.empty()) return editTags(journal_record(journal_record::FORGET, name));
+  journal_record r(journal_record::RETAG, name);
+  r.remove.push_back(tags.back());
+  return editTags(r);
+}
+
+static int renameEntry(std::vector<std::string> from_tags, const std::string& from_name,
+		       std::vector<std::string> to_tags, const std::string& to_name){
+  from_tags = uniqueTags(from_tags);
+  to_tags = uniqueTags(to_tags);
+
+  bool is_tag;
+  {
+    snapshot_guard snap = current.read();
+    const dispatcher& disp = snap->disp;
+    if(!validDirectory(disp, to_tags)) return -ENOENT;
+    if(!disp.validTags(to_tags)) return -EPERM;
+    is_tag = disp.isTagDefined(from_name);
+    if(is_tag){
+      if(!disp.validTags(from_tags)) return -ENOENT;
+      // a tag is the same directory everywhere, so it can only be renamed in place
+      if(from_tags != to_tags) return -EINVAL;
+      if(from_name == to_name) return 0;
+      if(disp.isTagDefined(to_name) || disp.isFileDefined(to_name)) return -EEXIST;
+    }else{
+      if(!doesFileExist(disp, from_tags, from_name)) return -ENOENT;
+      if(!disp.validTags(from_tags)) return -EPERM;
+      // the name is the name of the file in the storage
+      if(from_name != to_name) return -EINVAL;
+    }
+  }
+  if(is_tag){
+    if(!isStorableName(to_name, true)) return -EINVAL;
+    journal_record r(journal_record::RENAME_TAG, from_name);
+    r.new_name = to_name;
+    return editTags(r);
+  }
+  journal_record r(journal_record::RETAG, from_name);
+  std::set_difference(to_tags.begin(), to_tags.end(), from_tags.begin(), from_tags.end(),
+		      std::back_inserter(r.add));
+  std::set_difference(from_tags.begin(), from_tags.end(), to_tags.begin(), to_tags.end(),
+		      std::back_inserter(r.remove));
+  if(r.add.empty() && r.remove.empty()) return 0;
+  return editTags(r);
+}
+
+// 0 if names may be changed in dir, otherwise the error
+static int editableIn(const inode_node *dir, const std::string& name){
+  if(isControl(dir, name)) return EACCES;
+  if(dir->type != inode_node::DIRECTORY) return ENOTDIR;
   return 0;
 }
 
-static int tri_create(const char *path, mode_t mode, struct fuse_file_info *fi){
+static void tri_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+  op_timer timer(op_stats::MKDIR);
+  inode_node *dir = node(parent);
+  int error = editableIn(dir, name);
+  if(error == 0) error = -makeTag(dir->elements(), name);
+  if(error != 0){
+    fuse_reply_err(req, error);
+    return;
+  }
+  replyEntry(req, dir, name, false);
+}
 
-  if(std::string(path) == "/reload") initDefaults();
-  return -ENOENT;
+static void tri_symlink(fuse_req_t req, const char *target, fuse_ino_t parent, const char *name){
+  op_timer timer(op_stats::SYMLINK);
+  inode_node *dir = node(parent);
+  int error = editableIn(dir, name);
+  if(error == 0) error = -linkFile(target, dir->elements(), name);
+  if(error != 0){
+    fuse_reply_err(req, error);
+    return;
+  }
+  replyEntry(req, dir, name, false);
 }
 
+static void tri_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+  op_timer timer(op_stats::UNLINK);
+  const inode_node *dir = node(parent);
+  int error = editableIn(dir, name);
+  if(error == 0) error = -unlinkFile(dir->elements(), name);
+  fuse_reply_err(req, error);
+}
 
-static struct fuse_operations tri_operations;
+static void tri_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		       fuse_ino_t newparent, const char *newname){
+  op_timer timer(op_stats::RENAME);
+  const inode_node *from = node(parent);
+  const inode_node *to = node(newparent);
+  int error = editableIn(from, name);
+  if(error == 0) error = editableIn(to, newname);
+  if(error == 0) error = -renameEntry(from->elements(), name, to->elements(), newname);
+  fuse_reply_err(req, error);
+}
 
-int main(int argc, char **argv){
+// KERNEL NOTIFICATIONS
+// A notification can't be sent while a request is being answered: the kernel may hold
+// locks it needs until the answer comes. So they are queued (also by changes made in
+// requests) and sent by a thread of their own
+
+static void queueNotices(std::vector<kernel_notice>& found){
+  if(found.empty()) return;
+  std::lock_guard<std::mutex> guard(notice_lock);
+  if(!notifier_running) return;
+  for(size_t i = 0; i < found.size(); ++i) notices.push_back(std::move(found[i]));
+  notice_ready.notify_one();
+}
+
+static void sendNotices(void){
+  std::unique_lock<std::mutex> lock(notice_lock);
+  while(true){
+    notice_ready.wait(lock, []{ return !notices.empty() || !notifier_running; });
+    if(!notifier_running) return;
+    kernel_notice n = std::move(notices.front());
+    notices.pop_front();
+    lock.unlock();
+    // errors mean the kernel has forgotten the inode or the entry already
+    if(n.name.empty()){
+      fuse_lowlevel_notify_inval_inode(channel, n.ino, 0, 0);
+    }else{
+      fuse_lowlevel_notify_inval_entry(channel, n.ino, n.name.data(), n.name.size());
+    }
+    lock.lock();
+  }
+}
+
+static kernel_notice entryNotice(const inode_node *dir, const std::string& name){
+  kernel_notice n = { inodeOf(dir), name };
+  return n;
+}
+
+// a renamed tag is renamed in the paths of the nodes as well: the kernel has moved
+// the entry it was renamed by and keeps the node (and the nodes under it). Entries of
+// the tag in other directories are dropped from the kernel cache. Called after the
+// rename was published, with write_lock held
+static void renameNodes(const std::string& from, const std::string& to){
+  std::vector<kernel_notice> found;
+  {
+    std::lock_guard<std::mutex> guard(node_lock);
+    std::vector<inode_node*> named;
+    for(std::map<std::pair<inode_node*, std::string>, inode_node*>::iterator it = dir_nodes.begin();
+	it != dir_nodes.end(); ++it){
+      inode_node *n = it->second;
+      std::vector<std::string> path = n->elements();
+      if(std::find(path.begin(), path.end(), from) == path.end()) continue;
+      std::replace(path.begin(), path.end(), from, to);
+      unindexNode(n);
+      n->setPath(path);
+      indexNode(n);
+      if(n->type == inode_node::DIRECTORY && n->name == from) named.push_back(n);
+    }
+    for(size_t i = 0; i < named.size(); ++i){
+      inode_node *n = named[i];
+      dir_nodes.erase(std::make_pair(n->parent, from));
+      n->name = to;
+      // a node left by the other name, if any, is gone for the kernel anyway
+      dir_nodes[std::make_pair(n->parent, to)] = n;
+      found.push_back(entryNotice(n->parent, from));
+    }
+  }
+  queueNotices(found);
+}
+
+// a directory node to check after a change, with its path copied under node_lock;
+// paths change only with write_lock held, which the caller of invalidateKernel has
+struct checked_dir
+{
+  inode_node *n;
+  std::vector<std::string> elements;
+};
+
+// called after a change was published, with write_lock held: entries of directories
+// which are gone and of files which left their directories are dropped from the
+// kernel cache, as well as attributes of directories whose contents changed.
+// A directory is affected only if a changed file has all of its tags before or after,
+// so only the directories having one of those tags in their path are visited (see
+// dirs_by_name), unless the change may have removed tags (a reload, a rename, a merge
+// of tags) and every directory must be checked for being gone. The queries over them
+// run without node_lock, which lookups need
+static void invalidateKernel(const dispatcher::delta& changes, bool every_dir){
+  every_dir = every_dir || changes.rebuilt;
+  std::vector<kernel_notice> found;
+  snapshot_guard snap = current.read();
+  const dispatcher& disp = snap->disp;
+  std::vector<checked_dir> checked;
+  {
+    std::lock_guard<std::mutex> guard(node_lock);
+    std::set<inode_node*> visit;
+    if(every_dir){
+      for(std::map<std::pair<inode_node*, std::string>, inode_node*>::iterator it = dir_nodes.begin();
+	  it != dir_nodes.end(); ++it){
+	if(isCheckedDirectory(it->second)) visit.insert(it->second);
+      }
+    }else{
+      visit = dirs_without_tags;
+      std::set<dispatcher::tagid> tags(changes.renamed_tags.begin(), changes.renamed_tags.end());
+      for(size_t i = 0; i < changes.files.size(); ++i){
+	tags.insert(changes.files[i].first.begin(), changes.files[i].first.end());
+	tags.insert(changes.files[i].second.begin(), changes.files[i].second.end());
+      }
+      for(std::set<dispatcher::tagid>::iterator t = tags.begin(); t != tags.end(); ++t){
+	std::unordered_map<std::string, std::set<inode_node*> >::iterator it =
+	  dirs_by_name.find(std::string(disp.tagname(*t)));
+	if(it != dirs_by_name.end()) visit.insert(it->second.begin(), it->second.end());
+      }
+    }
+    checked.reserve(visit.size() + 1);
+    checked.push_back(checked_dir{ &root_node, std::vector<std::string>() });
+    for(std::set<inode_node*>::iterator it = visit.begin(); it != visit.end(); ++it){
+      checked.push_back(checked_dir{ *it, (*it)->elements() });
+    }
+  }
+
+  std::vector<size_t> affected;
+  for(size_t i = 0; i < checked.size(); ++i){
+    inode_node *n = checked[i].n;
+    // a completion directory has the path of the tag directory it is in
+    if(n != &root_node && !validDirectory(disp, checked[i].elements)){
+      found.push_back(entryNotice(n->parent, n->name));
+      continue;
+    }
+    tag_query query;
+    query.parse(disp, checked[i].elements);
+    if(!changes.affects(query.included())) continue;
+    // new attributes (the time); the kernel doesn't cache listings
+    found.push_back(entryNotice(n, std::string()));
+    affected.push_back(i);
+  }
+
+  // links looked up in the affected directories; nodes forgotten meanwhile are skipped
+  {
+    std::lock_guard<std::mutex> guard(node_lock);
+    for(size_t i = 0; i < affected.size(); ++i){
+      inode_node *dir = checked[affected[i]].n;
+      if(dir != &root_node && !isIndexed(dir, checked[affected[i]].elements)) continue;
+      for(std::set<std::string>::iterator it = dir->links.begin(); it != dir->links.end(); ){
+	if(resolveEntry(disp, dir->elements(), *it) == FILE_ENTRY){
+	  ++it;
+	  continue;
+	}
+	found.push_back(entryNotice(dir, *it));
+	link_nodes[*it]->seen_in.erase(dir);
+	it = dir->links.erase(it);
+      }
+    }
+  }
+  queueNotices(found);
+}
+
+// threads are started here rather than in main, since the daemon may fork when going
+// to background
+static void tri_init(void *data, struct fuse_conn_info *conn){
+  for(size_t r = 0; r < roots.size() && watch_enabled; ++r){
+    watch_enabled = roots[r].watcher.start(roots[r].path, ".tags", watch_delay_ms, [r]{ reloadTags("watch", r); });
+    if(!watch_enabled) fprintf(stderr, "Can't watch %s for changes, use touch reload\n", roots[r].path.c_str());
+  }
+  notifier_running = true;
+  notifier = std::thread(sendNotices);
+}
 
+static void tri_destroy(void *data){
+  for(size_t r = 0; r < roots.size(); ++r) roots[r].watcher.stop();
+  {
+    std::lock_guard<std::mutex> guard(notice_lock);
+    notifier_running = false;
+    notices.clear();
+    notice_ready.notify_one();
+  }
+  if(notifier.joinable()) notifier.join();
+  std::lock_guard<std::mutex> serial(write_lock);
+  snapshot_guard snap = current.read();
+  for(size_t r = 0; r < roots.size(); ++r) if(roots[r].writable) compactJournal(snap->disp, r);
+}
+
+static struct fuse_lowlevel_ops tri_operations;
+
+// also used by the benchmark (fusebench.cc), which calls the handlers in process
+static const struct fuse_lowlevel_ops *operations(void){
+  tri_operations.lookup = tri_lookup;
+  tri_operations.forget = tri_forget;
   tri_operations.getattr = tri_getattr;
+  tri_operations.readlink = tri_readlink;
   tri_operations.opendir = tri_opendir;
   tri_operations.readdir = tri_readdir;
+  tri_operations.releasedir = tri_releasedir;
   tri_operations.open = tri_open;
-  tri_operations.readlink = tri_readlink;
+  tri_operations.read = tri_read;
+  tri_operations.release = tri_release;
   tri_operations.create = tri_create;
+  tri_operations.mkdir = tri_mkdir;
+  tri_operations.symlink = tri_symlink;
+  tri_operations.unlink = tri_unlink;
+  tri_operations.rename = tri_rename;
+  tri_operations.init = tri_init;
+  tri_operations.destroy = tri_destroy;
+  return &tri_operations;
+}
 
-  if(argc < 3){
-    printf("Usage:\n"
-	   "trivialfs /path/to/storage /mount/point\n");
-    exit(1);
+#ifndef TRIVIALFS_NO_MAIN
+
+int main(int argc, char **argv){
+
+  // options go before the paths
+  std::vector<char *> paths;
+  size_t hot_views = default_hot_views, hot_views_mb = default_hot_views_mb;
+  for(int i = 1; i < argc; ++i){
+    if(strncmp(argv[i], "--cache-mb=", 11) == 0){
+      dircache.setBudget((size_t) atol(argv[i] + 11) << 20);
+    }else if(strncmp(argv[i], "--hot-views=", 12) == 0){
+      hot_views = (size_t) atol(argv[i] + 12);
+    }else if(strncmp(argv[i], "--hot-views-mb=", 15) == 0){
+      hot_views_mb = (size_t) atol(argv[i] + 15);
+    }else if(strncmp(argv[i], "--timeout=", 10) == 0){
+      timeout = atof(argv[i] + 10);
+    }else if(strcmp(argv[i], "--no-watch") == 0){
+      watch_enabled = false;
+    }else{
+      paths.push_back(argv[i]);
+    }
   }
-  
-  storage_path = std::string(argv[1]);
-  // TODO:: use boost::string (starts_with)
-  if(storage_path.c_str()[0] != '/'){
-    fprintf(stderr, "Storage path must be absolute\n");
+  dircache.setViews(hot_views, hot_views_mb << 20);
+
+  if(paths.size() < 2 || paths.size() - 1 > dispatcher::MAX_ROOTS){
+    printf("Usage:\n"
+	   "trivialfs [--cache-mb=%zu] [--hot-views=%zu] [--hot-views-mb=%zu] [--timeout=%g] [--no-watch]\n"
+	   "          /path/to/storage [/another/storage ...] /mount/point\n",
+	   default_cache_mb, default_hot_views, default_hot_views_mb, default_timeout);
     exit(1);
   }
-  if(!isFileReadable(storage_path + "/.tags")){
-    fprintf(stderr, "No .tags found in storage directory; use trivialtags to make initial taggings before mounting\n");
-    exit(1);
+
+  // a file name in several storages is taken from the first one
+  for(size_t i = 0; i + 1 < paths.size(); ++i){
+    roots.emplace_back(std::string(paths[i]));
+    storage_root& s = roots.back();
+    // TODO:: use boost::string (starts_with)
+    if(s.path.c_str()[0] != '/'){
+      fprintf(stderr, "Storage path must be absolute\n");
+      exit(1);
+    }
+    if(!isFileReadable(s.path + "/.tags")){
+      fprintf(stderr, "No .tags found in storage directory %s; use trivialtags to make initial taggings before mounting\n",
+	      s.path.c_str());
+      exit(1);
+    }
+    // the journal is replayed by the first load
+    s.writable = s.journal.open(s.path + "/.tags.journal");
+    if(!s.writable) fprintf(stderr, "Can't write %s/.tags.journal, tags can't be changed there through the mount\n", s.path.c_str());
   }
   initDefaults();
+  // what fuse_main does for the high-level API; requests are run in several threads
+  // unless "-s" is given
   struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
   fuse_opt_add_arg(&args, argv[0]);
   // enable this to debug
   //  fuse_opt_add_arg(&args, "-f");
-  fuse_opt_add_arg(&args, argv[2]);
-  return fuse_main(args.argc, args.argv, &tri_operations, NULL);
+  fuse_opt_add_arg(&args, paths.back());
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+  if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0) return 1;
+  int error = 1;
+  channel = fuse_mount(mountpoint, &args);
+  if(channel != NULL){
+    struct fuse_session *se = fuse_lowlevel_new(&args, operations(), sizeof(tri_operations), NULL);
+    if(se != NULL){
+      if(fuse_daemonize(foreground) == 0 && fuse_set_signal_handlers(se) == 0){
+	fuse_session_add_chan(se, channel);
+	error = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+	fuse_remove_signal_handlers(se);
+	fuse_session_remove_chan(channel);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, channel);
+  }
+  fuse_opt_free_args(&args);
+  free(mountpoint);
+  return error == 0 ? 0 : 1;
 }
+
+#endif /* TRIVIALFS_NO_MAIN */
@@ -0,0 +1,235 @@
+// fuse.cc without its main, with the parts of libfuse it uses replaced by functions
+// which keep the reply in the request. Built into trivialfs-bench only
+#define TRIVIALFS_NO_MAIN
+#include "fuse.cc"
+
+#include "fusebench.h"
+
+struct fuse_req
+{
+  int error;
+  struct fuse_entry_param entry;
+  struct stat attr;
+  double attr_timeout;
+  const char *buf;
+  size_t size;
+};
+
+// the attributes the kernel would keep from replies, by inode; timeouts are longer than
+// any run, except 0, which isn't kept. Inodes drop out by the notices of the mount
+static std::map<fuse_ino_t, struct stat> kernel_attrs;
+
+static void keepAttributes(fuse_ino_t ino, const struct stat& attr, double timeout){
+  if(timeout > 0) kernel_attrs[ino] = attr;
+  else kernel_attrs.erase(ino);
+}
+
+// what the notifier thread would send, handled in the thread of the harness
+static void takeNotices(void){
+  std::lock_guard<std::mutex> guard(notice_lock);
+  for(size_t i = 0; i < notices.size(); ++i){
+    if(notices[i].name.empty()) kernel_attrs.erase(notices[i].ino);
+  }
+  notices.clear();
+}
+
+int fuse_reply_err(fuse_req_t req, int err){
+  req->error = err;
+  return 0;
+}
+
+void fuse_reply_none(fuse_req_t req){
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e){
+  // a negative entry
+  req->error = e->ino == 0 ? ENOENT : 0;
+  req->entry = *e;
+  return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout){
+  req->error = 0;
+  req->attr = *attr;
+  req->attr_timeout = attr_timeout;
+  return 0;
+}
+
+int fuse_reply_readlink(fuse_req_t req, const char *link){
+  req->error = 0;
+  req->buf = link;
+  req->size = strlen(link);
+  return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi){
+  req->error = 0;
+  return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size){
+  req->error = 0;
+  req->buf = buf;
+  req->size = size;
+  return 0;
+}
+
+// as in libfuse: struct fuse_dirent, padded to 8 bytes
+struct harness_dirent
+{
+  uint64_t ino;
+  uint64_t off;
+  uint32_t namelen;
+  uint32_t type;
+  char name[];
+};
+
+size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize, const char *name,
+			 const struct stat *stbuf, off_t off){
+  size_t namelen = strlen(name);
+  size_t len = (offsetof(harness_dirent, name) + namelen + 7) & ~(size_t) 7;
+  if(buf == NULL || len > bufsize) return len;
+  harness_dirent *d = (harness_dirent *) buf;
+  d->ino = stbuf->st_ino;
+  d->off = off;
+  d->namelen = namelen;
+  d->type = (stbuf->st_mode & S_IFMT) >> 12;
+  memcpy(d->name, name, namelen);
+  memset(d->name + namelen, 0, len - offsetof(harness_dirent, name) - namelen);
+  return len;
+}
+
+// notices are queued rather than sent here, see takeNotices
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino, off_t off, off_t len){
+  return 0;
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent, const char *name,
+				     size_t namelen){
+  return 0;
+}
+
+static const struct fuse_lowlevel_ops *ops = operations();
+
+void fuse_harness::mount(const std::string& storage, bool writable){
+  roots.clear();
+  roots.emplace_back(storage);
+  if(writable) roots.back().writable = roots.back().journal.open(storage + "/.tags.journal");
+  watch_enabled = false;
+  initDefaults();
+  // notices stay in the queue without the notifier thread
+  notifier_running = true;
+  kernel_attrs.clear();
+}
+
+unsigned long fuse_harness::lookupPath(const std::string& path){
+  fuse_ino_t ino = FUSE_ROOT_ID;
+  std::vector<std::string> elements = splitPath(path);
+  for(size_t i = 0; i < elements.size(); ++i){
+    fuse_req req;
+    ops->lookup(&req, ino, elements[i].c_str());
+    takeNotices();
+    if(req.error != 0) return 0;
+    ino = req.entry.ino;
+    keepAttributes(ino, req.entry.attr, req.entry.attr_timeout);
+  }
+  return ino;
+}
+
+void fuse_harness::forgetPath(const std::string& path){
+  std::vector<std::string> elements = splitPath(path);
+  // the deepest first, as the kernel does
+  std::vector<fuse_ino_t> inodes(1, FUSE_ROOT_ID);
+  for(size_t i = 0; i < elements.size(); ++i){
+    std::pair<inode_node*, std::string> key(node(inodes.back()), elements[i]);
+    std::map<std::pair<inode_node*, std::string>, inode_node*>::iterator dir = dir_nodes.find(key);
+    std::unordered_map<std::string, inode_node*>::iterator link = link_nodes.find(elements[i]);
+    if(dir != dir_nodes.end()) inodes.push_back(inodeOf(dir->second));
+    else if(link != link_nodes.end()) inodes.push_back(inodeOf(link->second));
+    else break;
+  }
+  for(size_t i = inodes.size(); i-- > 1; ){
+    fuse_req req;
+    ops->forget(&req, inodes[i], 1);
+  }
+}
+
+int fuse_harness::rename(const std::string& from, const std::string& to){
+  std::vector<std::string> from_dir = splitPath(from), to_dir = splitPath(to);
+  std::string from_name = extractFilename(from_dir), to_name = extractFilename(to_dir);
+  std::string from_parent, to_parent;
+  for(size_t i = 0; i < from_dir.size(); ++i) from_parent += "/" + from_dir[i];
+  for(size_t i = 0; i < to_dir.size(); ++i) to_parent += "/" + to_dir[i];
+  unsigned long parent = from_parent.empty() ? FUSE_ROOT_ID : lookupPath(from_parent);
+  unsigned long newparent = to_parent.empty() ? FUSE_ROOT_ID : lookupPath(to_parent);
+  if(parent == 0 || newparent == 0) return ENOENT;
+  fuse_req req;
+  ops->rename(&req, parent, from_name.c_str(), newparent, to_name.c_str());
+  takeNotices();
+  return req.error;
+}
+
+int fuse_harness::mkdir(const std::string& path){
+  std::vector<std::string> dir = splitPath(path);
+  std::string name = extractFilename(dir), parent_path;
+  for(size_t i = 0; i < dir.size(); ++i) parent_path += "/" + dir[i];
+  unsigned long parent = parent_path.empty() ? FUSE_ROOT_ID : lookupPath(parent_path);
+  if(parent == 0) return ENOENT;
+  fuse_req req;
+  ops->mkdir(&req, parent, name.c_str(), 0700);
+  takeNotices();
+  if(req.error == 0) keepAttributes(req.entry.ino, req.entry.attr, req.entry.attr_timeout);
+  return req.error;
+}
+
+bool fuse_harness::attributesKept(unsigned long ino){
+  takeNotices();
+  return kernel_attrs.count(ino) != 0;
+}
+
+void fuse_harness::unmount(void){
+  ops->destroy(NULL);
+  kernel_attrs.clear();
+}
+
+bool fuse_harness::getattr(unsigned long ino, struct stat *st){
+  fuse_req req;
+  ops->getattr(&req, ino, NULL);
+  takeNotices();
+  if(req.error != 0) return false;
+  *st = req.attr;
+  keepAttributes(ino, req.attr, req.attr_timeout);
+  return true;
+}
+
+bool fuse_harness::stat(unsigned long ino, struct stat *st){
+  takeNotices();
+  std::map<fuse_ino_t, struct stat>::iterator kept = kernel_attrs.find(ino);
+  if(kept == kernel_attrs.end()) return getattr(ino, st);
+  *st = kept->second;
+  return true;
+}
+
+long fuse_harness::readdir(unsigned long ino, size_t size){
+  fuse_req req;
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  ops->opendir(&req, ino, &fi);
+  if(req.error != 0) return -req.error;
+  long entries = 0;
+  off_t offset = 0;
+  while(true){
+    ops->readdir(&req, ino, size, offset, &fi);
+    if(req.error != 0 || req.size == 0) break;
+    // the next piece starts after the last entry of this one
+    for(size_t pos = 0; pos < req.size; ){
+      const harness_dirent *d = (const harness_dirent *) (req.buf + pos);
+      offset = d->off;
+      pos += (offsetof(harness_dirent, name) + d->namelen + 7) & ~(size_t) 7;
+      entries++;
+    }
+  }
+  ops->releasedir(&req, ino, &fi);
+  takeNotices();
+  return req.error != 0 ? -req.error : entries;
+}
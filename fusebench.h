@@ -0,0 +1,44 @@
+#ifndef __FUSEBENCH_H
+#define __FUSEBENCH_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+
+// the request handlers of trivialfs run in process, without the kernel and libfuse:
+// replies are kept instead of being sent, and the notices for the kernel drop the
+// attributes it would cache (see stat). Only for the benchmark and the tests; the
+// harness is single-threaded and mounts once
+class fuse_harness
+{
+public:
+  // loads storage/.tags as a mount does, without watching; changes through the mount
+  // go to storage/.tags.journal if writable
+  static void mount(const std::string& storage, bool writable = false);
+
+  // the inode of an absolute path, found by a lookup of every element from the root
+  // as the kernel does on a cold path; 0 if there is none. Every inode on the way
+  // is counted as looked up, see forgetPath
+  static unsigned long lookupPath(const std::string& path);
+  // forgets the inodes lookupPath found on the same path
+  static void forgetPath(const std::string& path);
+  // mv from to, for absolute paths in the mount; 0 or the error
+  static int rename(const std::string& from, const std::string& to);
+  // mkdir of an absolute path in the mount; 0 or the error
+  static int mkdir(const std::string& path);
+  // what the kernel asks of the mount when it is unmounted; nothing may be called after
+  static void unmount(void);
+  // false if there is no such inode any more
+  static bool getattr(unsigned long ino, struct stat *st);
+  // stat through the kernel: the attributes of the last lookup or getattr of the inode
+  // unless the mount has dropped them since, otherwise a getattr
+  static bool stat(unsigned long ino, struct stat *st);
+  // whether the kernel would still have attributes of the inode
+  static bool attributesKept(unsigned long ino);
+  // opens the directory and reads it all in pieces of size bytes; the number of
+  // entries (with "." and ".."), or -errno
+  static long readdir(unsigned long ino, size_t size);
+};
+
+#endif /* __FUSEBENCH_H */
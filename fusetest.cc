@@ -0,0 +1,183 @@
+// checks of the request handlers run in process (see fusebench.h); built and run by
+// "make test", not installed. Every check prints a line; the exit status is the number
+// of failed ones
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "dispatch.h"
+#include "fusebench.h"
+#include "journal.h"
+#include "util.h"
+
+static int failed = 0;
+
+static void check(bool ok, const char *what){
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  if(!ok) failed++;
+}
+
+static std::string makeStorage(const char *tags){
+  char dir[] = "/tmp/trivialfs-test-XXXXXX";
+  if(mkdtemp(dir) == NULL) return std::string();
+  std::string path = std::string(dir) + "/.tags";
+  FILE *f = fopen(path.c_str(), "w");
+  if(f == NULL) return std::string();
+  fputs(tags, f);
+  fclose(f);
+  return dir;
+}
+
+// mv of a tag directory: the kernel keeps the inodes it knows under the new name, so
+// they must go on working
+static void testRenameTag(void){
+  struct stat st;
+  unsigned long dir = fuse_harness::lookupPath("/old");
+  unsigned long sub = fuse_harness::lookupPath("/old/other");
+  unsigned long file = fuse_harness::lookupPath("/old/other/a.pdf");
+  check(dir != 0 && sub != 0 && file != 0, "paths under the tag are found");
+  check(fuse_harness::rename("/old", "/new") == 0, "the tag is renamed");
+  check(fuse_harness::getattr(dir, &st) && S_ISDIR(st.st_mode) && st.st_size == 2,
+	"the renamed directory has attributes");
+  // ".", "..", two files and the subdirectory
+  check(fuse_harness::readdir(dir, 4096) == 5, "the renamed directory is listed");
+  check(fuse_harness::getattr(sub, &st) && S_ISDIR(st.st_mode), "a directory under it has attributes");
+  check(fuse_harness::readdir(sub, 4096) == 3, "a directory under it is listed");
+  check(fuse_harness::getattr(file, &st) && S_ISLNK(st.st_mode), "a file under it has attributes");
+  check(fuse_harness::lookupPath("/new") == dir, "the new name finds the same inode");
+  check(fuse_harness::lookupPath("/other/new") != 0, "the tag is renamed in other directories");
+  check(fuse_harness::lookupPath("/old") == 0, "the old name is gone");
+}
+
+// getattr counts the files without listing the directory; the subdirectories are only
+// counted once it is listed, and then stat through the kernel cache sees them too
+static void testDirectoryAttributes(void){
+  struct stat st;
+  unsigned long dir = fuse_harness::lookupPath("/other");
+  check(fuse_harness::getattr(dir, &st) && st.st_size == 2 && st.st_nlink == 1,
+	"an unlisted directory counts its files");
+  check(fuse_harness::stat(dir, &st) && st.st_nlink == 1, "the kernel keeps the attributes");
+  check(fuse_harness::readdir(dir, 4096) == 5, "the directory is listed");
+  check(fuse_harness::stat(dir, &st) && st.st_nlink == 3, "listing drops the attributes kept without it");
+  check(fuse_harness::getattr(dir, &st) && st.st_size == 2 && st.st_nlink == 3,
+	"a listed directory counts its subdirectories");
+  check(fuse_harness::stat(1, &st) && st.st_nlink == 4, "the root counts its subdirectories unlisted");
+}
+
+// .complete/<prefix> lists the subdirectories and files starting with the prefix
+static void testCompletion(void){
+  unsigned long dir = fuse_harness::lookupPath("/other/.complete/n");
+  check(dir != 0 && fuse_harness::readdir(dir, 4096) == 3, "subdirectories are completed");
+  dir = fuse_harness::lookupPath("/other/.complete/a");
+  check(dir != 0 && fuse_harness::readdir(dir, 4096) == 3, "files are completed");
+  dir = fuse_harness::lookupPath("/new/.complete/o");
+  check(dir != 0 && fuse_harness::readdir(dir, 4096) == 3, "only subdirectories of the directory are completed");
+}
+
+// a change drops the attributes of the directories it may change, and only those
+static void testChangeDropsAttributes(void){
+  struct stat st;
+  unsigned long from = fuse_harness::lookupPath("/new");
+  unsigned long to = fuse_harness::lookupPath("/other");
+  unsigned long both = fuse_harness::lookupPath("/other/new");
+  check(fuse_harness::rename("/new/b.pdf", "/other/b.pdf") == 0, "a file is moved");
+  check(!fuse_harness::attributesKept(from) && !fuse_harness::attributesKept(to) &&
+	!fuse_harness::attributesKept(1), "the directories it left and entered are dropped");
+  check(fuse_harness::stat(from, &st) && st.st_size == 1 && fuse_harness::stat(to, &st) && st.st_size == 3,
+	"the directories are counted again");
+  check(fuse_harness::attributesKept(both), "a directory it isn't in is kept");
+}
+
+// a record which can't be applied leaves the tags as they were
+static void testRefusedRetag(void){
+  dispatcher disp;
+  disp.defineFile("a.pdf");
+  disp.defineTag("old");
+  disp.link("a.pdf", "old");
+  disp.optimize();
+  journal_record onto_tag(journal_record::RETAG, "old");
+  onto_tag.add.push_back("fresh");
+  check(!applyRecord(disp, onto_tag, NULL) && !disp.isTagDefined("fresh"),
+	"tagging a tag creates no tags");
+  journal_record with_file(journal_record::RETAG, "b.pdf");
+  with_file.add.push_back("fresh");
+  with_file.add.push_back("a.pdf");
+  check(!applyRecord(disp, with_file, NULL) && !disp.isTagDefined("fresh") && !disp.isFileDefined("b.pdf"),
+	"tagging with a file creates no tags");
+}
+
+// a file losing its last tag is forgotten, as it would be by writing .tags
+static void testLastTagRemoved(void){
+  dispatcher disp;
+  disp.defineFile("a.pdf");
+  disp.defineTag("old");
+  disp.defineTag("other");
+  disp.link("a.pdf", "old");
+  disp.link("a.pdf", "other");
+  disp.optimize();
+  journal_record r(journal_record::RETAG, "a.pdf");
+  r.remove.push_back("old");
+  dispatcher::delta changes;
+  check(applyRecord(disp, r, &changes) && disp.isFileDefined("a.pdf"), "a file with tags left stays");
+  r.remove[0] = "other";
+  check(applyRecord(disp, r, &changes) && !disp.isFileDefined("a.pdf") && changes.file_ids.size() == 1 &&
+	changes.file_ids[0].second == dispatcher::delta::REMOVED, "a file without tags is forgotten");
+  check(applyRecord(disp, r, &changes) && !disp.isFileDefined("a.pdf"), "untagging an unknown file defines nothing");
+}
+
+// a change going to several journals is taken back from those which got it
+static void testJournalUndo(const std::string& storage){
+  std::string path = storage + "/undo.journal";
+  tag_journal journal;
+  journal_record first(journal_record::NEW_TAG, "first");
+  journal_record second(journal_record::NEW_TAG, "second");
+  check(journal.open(path) && journal.append(first) && journal.append(second), "records are appended");
+  check(journal.dropLast() && journal.records() == 1, "the last record is dropped");
+  check(!journal.dropLast(), "only the last record can be dropped");
+  check(journal.append(second) && journal.records() == 2, "records are appended after a dropped one");
+  std::string names;
+  tag_journal::replay(path, [&](const journal_record& r){ names += r.name + " "; });
+  check(names == "first second ", "the journal has every record once");
+}
+
+// a tag made by mkdir has no place in .tags; it has to outlive the compaction on
+// unmount. Unmounts, so it goes last
+static void testEmptyTagKept(const std::string& storage){
+  check(fuse_harness::mkdir("/empty") == 0, "a tag is made by mkdir");
+  fuse_harness::unmount();
+  dispatcher disp;
+  loadTags(disp, storage + "/.tags");
+  size_t replayed = tag_journal::replay(storage + "/.tags.journal", [&](const journal_record& r){
+      applyRecord(disp, r, NULL);
+    });
+  check(replayed == 1 && disp.isTagDefined("empty") && disp.isTagDefined("new"),
+	"the empty tag is there after remounting");
+}
+
+int main(void){
+  std::string storage = makeStorage("a.pdf { old, other }\n"
+				    "b.pdf { old }\n"
+				    "c.pdf { other }\n");
+  if(storage.empty()){
+    fprintf(stderr, "Can't make a storage\n");
+    return 1;
+  }
+  fuse_harness::mount(storage, true);
+  testRenameTag();
+  testDirectoryAttributes();
+  testCompletion();
+  testChangeDropsAttributes();
+  testRefusedRetag();
+  testLastTagRemoved();
+  testJournalUndo(storage);
+  testEmptyTagKept(storage);
+
+  std::string cleanup = "rm -rf " + storage;
+  if(system(cleanup.c_str()) != 0) failed++;
+  return failed;
+}
@@ -0,0 +1,268 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dispatch.h"
+#include "journal.h"
+
+static void noChanges(dispatcher::delta *changes){
+  if(changes == NULL) return;
+  *changes = dispatcher::delta();
+  changes->rebuilt = false;
+}
+
+static bool losesAllTags(const dispatcher& disp, dispatcher::fileid f, const std::vector<std::string>& remove){
+  const std::vector<dispatcher::tagid>& tags = disp.tagsOf(f);
+  for(size_t i = 0; i < tags.size(); ++i){
+    if(std::find(remove.begin(), remove.end(), disp.tagname(tags[i])) == remove.end()) return false;
+  }
+  return true;
+}
+
+bool applyRecord(dispatcher& disp, const journal_record& r, dispatcher::delta *changes, unsigned root){
+  switch(r.op){
+  case journal_record::RETAG: {
+    // names are checked before anything is created, so a refused record leaves no tags
+    if(disp.isTagDefined(r.name)) return false;
+    for(size_t i = 0; i < r.add.size(); ++i){
+      if(r.add[i] == r.name || disp.isFileDefined(r.add[i])) return false;
+    }
+    // a file left without tags is forgotten, as by a batch (see tagFile) and by .tags,
+    // which has no place for it
+    dispatcher::fileid f = disp.fileId(r.name);
+    if(r.add.empty() && f == dispatcher::NONE){
+      noChanges(changes);
+      return true;
+    }
+    if(r.add.empty() && losesAllTags(disp, f, r.remove)){
+      disp.forgetFile(f, changes);
+      return true;
+    }
+    std::vector<dispatcher::tagid> add, remove, created;
+    for(size_t i = 0; i < r.add.size(); ++i){
+      dispatcher::tagid t = disp.tagId(r.add[i]);
+      if(t == dispatcher::NONE){
+	t = disp.createTag(r.add[i], NULL);
+	created.push_back(t);
+      }
+      add.push_back(t);
+    }
+    for(size_t i = 0; i < r.remove.size(); ++i){
+      dispatcher::tagid t = disp.tagId(r.remove[i]);
+      if(t != dispatcher::NONE) remove.push_back(t);
+    }
+    if(disp.retagFile(r.name, add, remove, changes, root) == dispatcher::NONE) return false;
+    if(changes != NULL){
+      changes->renamed_tags.insert(changes->renamed_tags.end(), created.begin(), created.end());
+      std::sort(changes->renamed_tags.begin(), changes->renamed_tags.end());
+    }
+    return true;
+  }
+  case journal_record::FORGET: {
+    dispatcher::fileid f = disp.fileId(r.name);
+    if(f == dispatcher::NONE){
+      noChanges(changes);
+      return true;
+    }
+    disp.forgetFile(f, changes);
+    return true;
+  }
+  case journal_record::NEW_TAG:
+    return disp.createTag(r.name, changes) != dispatcher::NONE;
+  case journal_record::RENAME_TAG: {
+    noChanges(changes);
+    dispatcher::tagid t = disp.tagId(r.name);
+    if(t == dispatcher::NONE) return false;
+    if(disp.renameTag(t, r.new_name)) return true;
+    // another root was renamed already and its files have the new name: the files of
+    // this root join them
+    dispatcher::tagid n = disp.tagId(r.new_name);
+    if(n == dispatcher::NONE) return false;
+    std::vector<dispatcher::fileid> files(disp.filesWith(t).begin(), disp.filesWith(t).end());
+    for(size_t i = 0; i < files.size(); ++i){
+      disp.retagFile(disp.filename(files[i]), std::vector<dispatcher::tagid>(1, n),
+		     std::vector<dispatcher::tagid>(1, t), NULL);
+    }
+    disp.removeTag(t);
+    disp.optimize();
+    if(changes != NULL) changes->rebuilt = true;
+    return true;
+  }
+  }
+  return false;
+}
+
+static bool isSpace(char c){
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+bool isStorableName(std::string_view name, bool is_tag){
+  if(name.empty() || isSpace(name.front()) || isSpace(name.back())) return false;
+  if(name.find('/') != std::string_view::npos || name.find('\0') != std::string_view::npos) return false;
+  // see parser.cc: a file name ends at '{', a tag at ',' or '}'
+  if(is_tag) return name.find_first_of(",}") == std::string_view::npos;
+  return name.find('{') == std::string_view::npos;
+}
+
+// ENCODING
+
+static void putField(std::string& out, char prefix, const std::string& value){
+  char len[32];
+  snprintf(len, sizeof(len), " %c%zu:", prefix, value.size());
+  out += len;
+  out += value;
+}
+
+static std::string encode(const journal_record& r){
+  std::string out(1, (char) r.op);
+  putField(out, '=', r.name);
+  if(r.op == journal_record::RENAME_TAG) putField(out, '>', r.new_name);
+  for(size_t i = 0; i < r.add.size(); ++i) putField(out, '+', r.add[i]);
+  for(size_t i = 0; i < r.remove.size(); ++i) putField(out, '-', r.remove[i]);
+  out += '\n';
+  return out;
+}
+
+// reads one record starting at p; returns false on a torn or broken record
+static bool decode(const char *&p, const char *end, journal_record& r){
+  if(p == end) return false;
+  r = journal_record((journal_record::kind) *p++, "");
+  if(r.op != journal_record::RETAG && r.op != journal_record::FORGET &&
+     r.op != journal_record::NEW_TAG && r.op != journal_record::RENAME_TAG) return false;
+  while(true){
+    if(p == end) return false;
+    if(*p == '\n'){
+      ++p;
+      return true;
+    }
+    if(*p++ != ' ' || p == end) return false;
+    char prefix = *p++;
+    size_t len = 0;
+    while(p != end && *p >= '0' && *p <= '9') len = len * 10 + (*p++ - '0');
+    if(p == end || *p++ != ':' || (size_t) (end - p) < len) return false;
+    std::string value(p, len);
+    p += len;
+    switch(prefix){
+    case '=': r.name = value; break;
+    case '>': r.new_name = value; break;
+    case '+': r.add.push_back(value); break;
+    case '-': r.remove.push_back(value); break;
+    default: return false;
+    }
+  }
+}
+
+// calls f for complete records; *valid is the length of the complete part
+static size_t parseJournal(const std::string& data, const std::function<void(const journal_record&)>& f,
+			   size_t *valid){
+  const char *p = data.data();
+  const char *end = p + data.size();
+  size_t count = 0;
+  journal_record r(journal_record::RETAG, "");
+  while(decode(p, end, r)){
+    f(r);
+    ++count;
+    *valid = p - data.data();
+  }
+  return count;
+}
+
+static bool readAll(int fd, std::string& data){
+  char buf[65536];
+  ssize_t len;
+  while((len = read(fd, buf, sizeof(buf))) > 0) data.append(buf, len);
+  return len == 0;
+}
+
+// JOURNAL
+
+tag_journal::~tag_journal(void){
+  if(fd >= 0) close(fd);
+}
+
+bool tag_journal::open(const std::string& p){
+  if(fd >= 0) close(fd);
+  path = p;
+  count = 0;
+  end = 0;
+  last = -1;
+  fd = ::open(p.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd < 0) return false;
+  std::string data;
+  if(!readAll(fd, data)){
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  size_t valid = 0;
+  count = parseJournal(data, [](const journal_record&){ }, &valid);
+  // new records go right after the last complete one
+  if(valid != data.size() && ftruncate(fd, valid) != 0){
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  end = valid;
+  return lseek(fd, valid, SEEK_SET) >= 0;
+}
+
+bool tag_journal::cut(off_t size){
+  if(ftruncate(fd, size) != 0 || lseek(fd, size, SEEK_SET) != size) return false;
+  end = size;
+  return true;
+}
+
+bool tag_journal::append(const journal_record& r){
+  if(fd < 0) return false;
+  std::string line = encode(r);
+  // a single write of a small record either happens or not
+  const char *p = line.data();
+  size_t left = line.size();
+  while(left > 0){
+    ssize_t written = write(fd, p, left);
+    if(written <= 0){
+      // the next record must not follow a torn one
+      cut(end);
+      return false;
+    }
+    p += written;
+    left -= written;
+  }
+  last = end;
+  end += line.size();
+  ++count;
+  return true;
+}
+
+bool tag_journal::dropLast(void){
+  if(fd < 0 || last < 0 || !cut(last)) return false;
+  last = -1;
+  --count;
+  return true;
+}
+
+bool tag_journal::clear(void){
+  if(fd < 0) return false;
+  count = 0;
+  last = -1;
+  return cut(0);
+}
+
+size_t tag_journal::replay(const std::string& p, const std::function<void(const journal_record&)>& f){
+  int in = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+  if(in < 0) return 0;
+  std::string data;
+  readAll(in, data);
+  close(in);
+  size_t valid = 0;
+  return parseJournal(data, f, &valid);
+}
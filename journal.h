@@ -0,0 +1,84 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dispatch.h"
+
+// one change of tags made through the mount
+struct journal_record
+{
+  enum kind {
+    RETAG = 'T',      // name gets tags `add` and loses tags `remove`
+    FORGET = 'F',     // file name loses all its tags and disappears
+    NEW_TAG = 'N',    // tag name without files (mkdir)
+    RENAME_TAG = 'R'  // tag name is called new_name now
+  };
+  kind op;
+  std::string name;
+  std::string new_name;
+  std::vector<std::string> add;
+  std::vector<std::string> remove;
+
+  journal_record(kind k, std::string_view n) : op(k), name(n), new_name(), add(), remove() { }
+};
+
+// applies the change to disp by names, so that the same record gives the same result
+// on equal dispatchers, and replaying the journal over .tags edited meanwhile does
+// something sensible: missing tags are created, missing files and tags are skipped.
+// Returns false if the record can't be applied (a name is taken by the other kind).
+// A RETAG taking the last tags of a file forgets it, like FORGET.
+// Files which are new to disp go to root; a tag renamed to an existing tag is merged
+// into it, as happens when the journals of several roots have the same rename
+bool applyRecord(dispatcher& disp, const journal_record& r, dispatcher::delta *changes,
+		 unsigned root = 0);
+
+// whether the name survives writing to .tags and parsing back
+bool isStorableName(std::string_view name, bool is_tag);
+
+// append-only log of changes made since .tags was written last time. Every record
+// is one line of length-prefixed fields, so names may contain anything:
+//   T =4:name +3:tag -5:other
+// A torn last line (after a crash) is ignored on replay.
+class tag_journal
+{
+private:
+  int fd;
+  std::string path;
+  size_t count;
+  // offsets of the end of the journal and of the record appended last
+  off_t end;
+  off_t last;
+
+  bool cut(off_t size);
+
+  tag_journal(const tag_journal&);
+  tag_journal& operator=(const tag_journal&);
+
+public:
+
+  tag_journal(void) : fd(-1), path(), count(0), end(0), last(-1) { }
+  ~tag_journal(void);
+
+  // opens (or creates) the journal for appending; count() is the number of records in it
+  bool open(const std::string& p);
+  // appends the record whole or not at all: what a failed write left is cut off
+  bool append(const journal_record& r);
+  // removes the record appended last, when a change going to several journals can't
+  // be written to a later one
+  bool dropLast(void);
+  size_t records(void) const { return count; }
+  // forgets everything, after the changes went to .tags
+  bool clear(void);
+
+  // calls f for every complete record of the journal at p, returns their number
+  static size_t replay(const std::string& p, const std::function<void(const journal_record&)>& f);
+};
+
+#endif /* __JOURNAL_H */
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "names.h"
+
+const uint32_t name_table::EMPTY;
+
+// ARENA
+
+void name_arena::reserve(size_t names, size_t characters){
+  refs.reserve(names);
+  chars.reserve(characters + names);
+}
+
+name_arena::ref name_arena::append(std::string_view name){
+  ref r = { 0, 0 };
+  if(name.empty()) return r;
+  // the name may move when the buffer grows
+  if(name.data() >= chars.data() && name.data() < chars.data() + chars.size()){
+    std::string copy(name);
+    return append(copy);
+  }
+  r.offset = chars.size();
+  r.length = name.size();
+  chars.insert(chars.end(), name.begin(), name.end());
+  chars.push_back('\0');
+  return r;
+}
+
+void name_arena::push_back(std::string_view name){
+  refs.push_back(append(name));
+}
+
+void name_arena::assign(size_t id, std::string_view name){
+  ref r = append(name);
+  if(refs[id].length != 0) garbage += refs[id].length + 1;
+  refs[id] = r;
+  if(garbage > 4096 && garbage > chars.size() / 2) compact();
+}
+
+void name_arena::compact(void){
+  std::vector<char> fresh;
+  fresh.reserve(chars.size() - garbage);
+  fresh.push_back('\0');
+  for(size_t i = 0; i < refs.size(); ++i){
+    if(refs[i].length == 0) continue;
+    const char *name = chars.data() + refs[i].offset;
+    refs[i].offset = fresh.size();
+    fresh.insert(fresh.end(), name, name + refs[i].length + 1);
+  }
+  chars.swap(fresh);
+  garbage = 0;
+}
+
+void name_arena::swap(name_arena& other){
+  chars.swap(other.chars);
+  refs.swap(other.refs);
+  std::swap(garbage, other.garbage);
+}
+
+void name_arena::clear(void){
+  chars.assign(1, '\0');
+  refs.clear();
+  garbage = 0;
+}
+
+// FNV-1a over 8-byte words with a final mix; names are short, and the word loop keeps
+// long ones cheap
+uint32_t name_table::hash(std::string_view name){
+  const uint64_t prime = 0x100000001b3ULL;
+  uint64_t h = 0xcbf29ce484222325ULL ^ name.size();
+  const char *p = name.data();
+  size_t left = name.size();
+  while(left >= 8){
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h = (h ^ w) * prime;
+    p += 8;
+    left -= 8;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, p, left);
+  h = (h ^ tail) * prime;
+  h ^= h >> 32;
+  h *= 0xd6e8feb86659fd93ULL;
+  h ^= h >> 32;
+  return (uint32_t) h;
+}
+
+void name_table::grow(size_t capacity){
+  std::vector<slot> old;
+  old.swap(slots);
+  slot empty = { 0, EMPTY };
+  slots.assign(capacity, empty);
+  for(size_t i = 0; i < old.size(); ++i){
+    if(old[i].id == EMPTY) continue;
+    size_t j = old[i].hash & mask();
+    while(slots[j].id != EMPTY) j = (j + 1) & mask();
+    slots[j] = old[i];
+  }
+}
+
+void name_table::reserve(size_t count){
+  size_t capacity = slots.empty() ? 16 : slots.size();
+  while(capacity / 4 * 3 < count) capacity *= 2;
+  if(capacity != slots.size()) grow(capacity);
+}
+
+void name_table::insert(std::string_view name, size_t id){
+  reserve(used + 1);
+  slot s = { hash(name), (uint32_t) id };
+  size_t i = s.hash & mask();
+  while(slots[i].id != EMPTY) i = (i + 1) & mask();
+  slots[i] = s;
+  used++;
+}
+
+void name_table::erase(std::string_view name, const name_arena& names){
+  if(used == 0) return;
+  uint32_t h = hash(name);
+  size_t i = h & mask();
+  while(slots[i].id != EMPTY && !(slots[i].hash == h && names[slots[i].id] == name)) i = (i + 1) & mask();
+  if(slots[i].id == EMPTY) return;
+  // backward shift: a following slot moves into the hole unless its home position
+  // lies cyclically within (hole, slot]
+  size_t hole = i;
+  for(size_t j = (i + 1) & mask(); slots[j].id != EMPTY; j = (j + 1) & mask()){
+    size_t home = slots[j].hash & mask();
+    bool stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+    if(stays) continue;
+    slots[hole] = slots[j];
+    hole = j;
+  }
+  slots[hole].id = EMPTY;
+  used--;
+}
+
+void name_table::clear(void){
+  slots.clear();
+  used = 0;
+}
+
+// ORDER
+
+void name_order::insert(size_t id, const name_arena& names){
+  if(!valid) return;
+  std::string_view name = names[id];
+  std::vector<uint32_t>::iterator it =
+    std::lower_bound(ids.begin(), ids.end(), name,
+		     [&](uint32_t a, std::string_view name){ return names[a] < name; });
+  ids.insert(it, (uint32_t) id);
+}
+
+void name_order::erase(size_t id, const name_arena& names){
+  if(!valid) return;
+  std::string_view name = names[id];
+  std::vector<uint32_t>::iterator it =
+    std::lower_bound(ids.begin(), ids.end(), name,
+		     [&](uint32_t a, std::string_view name){ return names[a] < name; });
+  // names are distinct, so the name is there once
+  if(it != ids.end() && *it == id) ids.erase(it);
+}
+
+void name_order::rebuild(const name_arena& names){
+  ids.clear();
+  for(size_t i = 0; i < names.size(); ++i){
+    if(!names[i].empty()) ids.push_back(i);
+  }
+  std::sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b){ return names[a] < names[b]; });
+  valid = true;
+}
+
+void name_order::clear(void){
+  ids.clear();
+  valid = true;
+}
+
+std::pair<const uint32_t *, const uint32_t *> name_order::range(std::string_view prefix,
+								 const name_arena& names) const {
+  const uint32_t *first = ids.data(), *last = ids.data() + ids.size();
+  first = std::lower_bound(first, last, prefix, [&](uint32_t a, std::string_view prefix){
+      return names[a] < prefix;
+    });
+  // the names with the prefix are followed by the first one which doesn't start with it
+  last = std::partition_point(first, last, [&](uint32_t a){
+      return names[a].substr(0, prefix.size()) == prefix;
+    });
+  return std::make_pair(first, last);
+}
@@ -0,0 +1,152 @@
+#ifndef __NAMES_H
+#define __NAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// names by ids, stored one after another in a single buffer instead of a heap block
+// (and a string header) each: a million names take one allocation, and copying them
+// is one memcpy. Every name is followed by '\0', so it can be passed to C functions
+// as it is. Offsets are 32 bits, names take less than 4 GiB together. Names which
+// are replaced or cleared leave their characters behind until they make up half of
+// the buffer, then the buffer is compacted; ids don't change, views of names do.
+// Views of names are valid until the next change of the arena
+class name_arena
+{
+public:
+  struct ref
+  {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+private:
+  // starts with the '\0' of empty names
+  std::vector<char> chars;
+  std::vector<ref> refs;
+  // characters of names which were replaced or cleared
+  size_t garbage;
+
+  void compact(void);
+  // where name is stored; the name may be in the arena itself
+  ref append(std::string_view name);
+
+  // reads and writes the buffer directly, see tagindex.h
+  friend class tag_index;
+
+public:
+
+  name_arena(void) : chars(1, '\0'), refs(), garbage(0) { }
+
+  // number of ids, including those with empty names
+  size_t size(void) const { return refs.size(); }
+  std::string_view operator[](size_t id) const {
+    return std::string_view(chars.data() + refs[id].offset, refs[id].length);
+  }
+  size_t memoryUsage(void) const { return chars.capacity() + refs.capacity() * sizeof(ref); }
+
+  void reserve(size_t names, size_t characters);
+  // the next id
+  void push_back(std::string_view name);
+  // an empty name frees the characters of the previous one
+  void assign(size_t id, std::string_view name);
+  void swap(name_arena& other);
+  void clear(void);
+};
+
+// dictionary from names to ids for names which are stored elsewhere (in the name
+// arena of the dispatcher, indexed by ids), so every name is kept once. Open addressing
+// with linear probing: a slot is the id and the hash of its name, so a lookup usually
+// compares a single name, and growing doesn't have to look at names at all. Erased
+// slots are filled by shifting the following ones back, there are no tombstones.
+// The arena of names is passed to every call rather than remembered, so that copies
+// of the dispatcher don't point to each other.
+class name_table
+{
+public:
+  struct slot
+  {
+    uint32_t hash;
+    uint32_t id;
+  };
+  static const uint32_t EMPTY = (uint32_t) -1;
+
+private:
+  // the size is zero or a power of two, at most 3/4 full
+  std::vector<slot> slots;
+  size_t used;
+
+  size_t mask(void) const { return slots.size() - 1; }
+  void grow(size_t capacity);
+
+  // reads and writes the slots directly, see tagindex.h
+  friend class tag_index;
+
+public:
+
+  name_table(void) : slots(), used(0) { }
+
+  // stable across runs and builds: the table is stored in the binary index as it is
+  static uint32_t hash(std::string_view name);
+
+  size_t size(void) const { return used; }
+  size_t memoryUsage(void) const { return slots.capacity() * sizeof(slot); }
+
+  // the id of the name, or EMPTY
+  uint32_t find(std::string_view name, const name_arena& names) const {
+    if(used == 0) return EMPTY;
+    uint32_t h = hash(name);
+    for(size_t i = h & mask(); slots[i].id != EMPTY; i = (i + 1) & mask()){
+      if(slots[i].hash == h && names[slots[i].id] == name) return slots[i].id;
+    }
+    return EMPTY;
+  }
+  // the name must not be in the table yet
+  void insert(std::string_view name, size_t id);
+  void erase(std::string_view name, const name_arena& names);
+  // makes room for that many names without growing
+  void reserve(size_t count);
+  void clear(void);
+};
+
+// ids sorted by their names, so that every name with a given prefix is found by
+// binary search (completion, see completeDirectory in util.h). Names are stored
+// elsewhere, as for name_table. Single names are inserted and erased in place, which
+// moves the ids after them; bulk changes suspend the order and rebuild it at the end
+class name_order
+{
+private:
+  std::vector<uint32_t> ids;
+  bool valid;
+
+  // reads and writes the ids directly, see tagindex.h
+  friend class tag_index;
+
+public:
+
+  name_order(void) : ids(), valid(true) { }
+
+  size_t size(void) const { return ids.size(); }
+  size_t memoryUsage(void) const { return ids.capacity() * sizeof(uint32_t); }
+
+  // names[id] must be set already
+  void insert(size_t id, const name_arena& names);
+  // names[id] must still be the name of id
+  void erase(size_t id, const name_arena& names);
+  // insert and erase do nothing until rebuild
+  void suspend(void) { valid = false; }
+  bool suspended(void) const { return !valid; }
+  // sorts the ids of all non-empty names (empty names are free ids)
+  void rebuild(const name_arena& names);
+  void clear(void);
+
+  // ids of names starting with prefix, in the order of names
+  std::pair<const uint32_t *, const uint32_t *> range(std::string_view prefix,
+						       const name_arena& names) const;
+};
+
+#endif /* __NAMES_H */
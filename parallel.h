@@ -0,0 +1,36 @@
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// number of threads used for loading; at least 1
+static inline unsigned defaultThreads(void){
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+// calls f(i) for every i in [0, count) on up to `threads` threads. Work items are
+// taken one by one from a shared counter, so uneven items are balanced. With one
+// thread (or one item) everything runs in the calling thread.
+template<class F>
+void parallelFor(size_t count, unsigned threads, F f){
+  if(threads <= 1 || count <= 1){
+    for(size_t i = 0; i < count; ++i) f(i);
+    return;
+  }
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> pool;
+  size_t workers = threads < count ? threads : count;
+  for(size_t w = 0; w < workers; ++w){
+    pool.push_back(std::thread([&next, count, &f]{
+	  for(size_t i = next++; i < count; i = next++) f(i);
+	}));
+  }
+  for(size_t w = 0; w < pool.size(); ++w) pool[w].join();
+}
+
+#endif /* __PARALLEL_H */
@@ -1,95 +1,125 @@
-#include <cstdio>
-#include <cstdlib>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
 
-#include <set>
-#include <utility>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "parser.h"
 
-parser::parser(const std::string& path) : p(NULL), contents(NULL){
-  FILE *f;
-  f = std::fopen(path.c_str(), "r");
-  if(f != NULL){
-    contents = (char *) std::malloc(200 * 1024);
-    int sz = std::fread(contents, 1, 200 * 1024, f);
-    contents[sz] = '\0';
-    std::fclose(f);
+parser::parser(const std::string& path) : contents(NULL), size(0){
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) return;
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size > 0){
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(m != MAP_FAILED){
+      contents = (char *) m;
+      size = st.st_size;
+      madvise(contents, size, MADV_SEQUENTIAL);
+    }
   }
+  // the mapping stays valid after close
+  close(fd);
 }
 
 parser::~parser(void){
-  if(contents != NULL) std::free(contents);
+  if(contents != NULL) munmap(contents, size);
 }
 
-parser::tags parser::read_tags(void){
-  tags t;
-  skip_spaces();
-  position token_start = p;
+void parser::parse(std::string_view part, const handler& h){
+  reader r(part);
+  name section_name;
+  tags section_tags;
+  while(r.read_name(section_name)){
+    r.read_tags(section_tags);
+    h(section_name, section_tags);
+  }
+}
+
+// a '}' may appear inside a file name, so the candidate boundary is accepted only if
+// there is no other '}' between it and the last '{' before it, i.e. it closes a list of tags
+static bool closes_section(const char *begin, const char *brace){
+  const char *open = (const char *) memrchr(begin, '{', brace - begin);
+  if(open == NULL) return false;
+  return memchr(open + 1, '}', brace - open - 1) == NULL;
+}
+
+std::vector<std::string_view> parser::split(size_t parts) const {
+  std::vector<std::string_view> result;
+  if(contents == NULL) return result;
+  if(parts == 0) parts = 1;
+
+  const char *start = contents;
+  const char *finish = contents + size;
+  for(size_t i = 1; i < parts && start < finish; ++i){
+    const char *cut = contents + size / parts * i;
+    if(cut <= start) continue;
+    // move the cut right after the next closing brace
+    const char *brace = cut;
+    while(true){
+      brace = (const char *) memchr(brace, '}', finish - brace);
+      if(brace == NULL || closes_section(contents, brace)) break;
+      ++brace;
+    }
+    if(brace == NULL) break;
+    result.push_back(std::string_view(start, brace + 1 - start));
+    start = brace + 1;
+  }
+  if(start < finish) result.push_back(std::string_view(start, finish - start));
+  return result;
+}
+
+// reads tags up to the closing '}' (or the end of file); empty tags are skipped
+void parser::reader::read_tags(tags& t){
+  t.clear();
   while(true){
-    while(*p != '}' && *p != ',') ++p;
+    skip_spaces();
+    if(is_eof()) break;
+    position token_start = p;
+    while(!is_eof() && *p != '}' && *p != ',') ++p;
 
-    // *p is separator, so it should be skipped
-    t.insert(cut_string(token_start, p - 1));
+    // *p is separator, so it is not a part of the tag
+    name tag = cut_string(token_start, p);
+    if(!tag.empty()) t.push_back(tag);
     // when separator is '}', tags finished
-    if(*p == '}') break;
+    if(is_eof() || *p == '}') break;
     ++p;
-    
-    skip_spaces();
-    if(is_eof()) break;
-    token_start = p;
   }
   // skipping '}'
   if(!is_eof()) ++p;
-  return t;
 }
-parser::name parser::read_name(void){
-  position token_start;
-  name n;
+
+// returns false when there are no more sections
+bool parser::reader::read_name(name& n){
   skip_spaces();
-  if(is_eof()) return name("");
-  token_start = p;
-  while(*p != '{'){
-    ++p;
-  }
-  // this string is executed when *p == '{', which is not part of name
-  n = cut_string(token_start, p - 1);
+  if(is_eof()) return false;
+  position token_start = p;
+  while(!is_eof() && *p != '{') ++p;
+  // a name without tags at the end of file is not a section
+  if(is_eof()) return false;
+  // '{' is not part of name
+  n = cut_string(token_start, p);
   ++p;
-  return n;
+  return true;
 }
-parser::section parser::read_section(void){
-  name section_name;
-  section_name = read_name();
-  if(is_eof()) return section();
 
-  tags section_tags;
-  section_tags = read_tags();
-  return std::make_pair(section_name, section_tags);
+void parser::reader::skip_spaces(void){
+  while(!is_eof() && is_space(*p)) ++p;
 }
-parser::config parser::read_all(void){
-  config result;
-  section sect;
-  
-  sect = read_section();
-  while(!is_eof()){
-    result.insert(sect);
-    sect = read_section();
-  }
-  return result;
-}
-
-void parser::skip_spaces(void){
-  while(is_space(*p)) ++p;
-}
-parser::name parser::cut_string(parser::position st, parser::position fi){
-  while(is_space(*st)) ++st;
-  while(is_space(*fi)) --fi;
-  return name(st, fi+1);
+// trimmed [st, fi)
+parser::name parser::reader::cut_string(parser::position st, parser::position fi){
+  while(st < fi && is_space(*st)) ++st;
+  while(fi > st && is_space(*(fi - 1))) --fi;
+  return name(st, fi - st);
 }
 bool parser::is_space(const char c){
-  return (c == ' ') || (c == '\n') || (c == '\t');
+  return (c == ' ') || (c == '\n') || (c == '\t') || (c == '\r');
 }
-bool parser::is_eof(void){
-  return *p == '\0';
+bool parser::reader::is_eof(void){
+  return p >= end;
 }
-
-
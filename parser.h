@@ -1,43 +1,72 @@
 #ifndef __PARSER_H
 #define __PARSER_H
 
-#include <set>
+#include <stddef.h>
+
+#include <functional>
 #include <string>
-#include <utility>
+#include <string_view>
+#include <vector>
 
+// reader of .tags files, which consist of sections
+//   name of file { tag1, tag2, ... }
+// The file is mapped into memory and names and tags are handed out as string_views
+// pointing into the mapping, so nothing is copied or allocated per section; the views
+// are valid while the parser lives.
 class parser
 {
 public:
   typedef const char* position;
-  typedef std::string name;
-  typedef std::set<std::string> tags;
-  typedef std::pair<name, tags> section;
-  typedef std::set<section> config;
-  
+  typedef std::string_view name;
+  typedef std::vector<std::string_view> tags;
+  // called for every section in order of appearance; the same file may come several times
+  typedef std::function<void(name, const tags&)> handler;
+
 private:
+  // the mapping, NULL for an empty or unreadable file
   char *contents;
-  position p;
+  size_t size;
+
+  // the parsing state; several readers may work on different parts of one file
+  class reader
+  {
+  private:
+    position p;
+    position end;
+
+    void skip_spaces(void);
+    name cut_string(position start, position finish);
+    bool is_eof(void);
+
+  public:
+    reader(std::string_view text) : p(text.data()), end(text.data() + text.size()) { }
 
-  tags read_tags(void);
-  name read_name(void);
-  section read_section(void);
-  config read_all(void);
+    void read_tags(tags& t);
+    bool read_name(name& n);
+  };
 
-  void skip_spaces(void);
-  name cut_string(position start, position finish);
-  bool is_space(char);
-  bool is_eof(void);
+  static bool is_space(char);
+
+  parser(const parser&);
+  parser& operator=(const parser&);
 
 public:
-  
+
   parser(const std::string& path);
   ~parser(void);
 
-  config parse(void){
-    if(contents == NULL) return config();
-    p = contents;
-    return read_all();
-  }
+  bool ok(void) const { return contents != NULL; }
+
+  std::string_view text(void) const { return std::string_view(contents, size); }
+
+  // streams all sections to the handler
+  void parse(const handler& h) { parse(text(), h); }
+  // the same for a part of the file, which must consist of whole sections (see split)
+  static void parse(std::string_view part, const handler& h);
+
+  // cuts the file into at most `parts` pieces of similar size on section boundaries,
+  // so that they can be parsed independently
+  std::vector<std::string_view> split(size_t parts) const;
 
 };
 
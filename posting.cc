@@ -0,0 +1,679 @@
+#include <algorithm>
+
+#include "bitmask.h"
+#include "posting.h"
+
+// CONTAINERS
+
+bool posting_list::container::contains(uint16_t v) const {
+  switch(type){
+  case ARRAY:
+    return std::binary_search(values.begin(), values.end(), v);
+  case BITMAP:
+    return (bits[v / 64] >> (v % 64)) & 1;
+  case RUN: {
+    // the last run starting not after v
+    size_t lo = 0, hi = values.size() / 2;
+    while(lo < hi){
+      size_t mid = (lo + hi) / 2;
+      if(values[2 * mid] <= v) lo = mid + 1; else hi = mid;
+    }
+    if(lo == 0) return false;
+    --lo;
+    return (uint32_t) v <= (uint32_t) values[2 * lo] + values[2 * lo + 1];
+  }
+  }
+  return false;
+}
+
+// all members of the container as a sorted list of lower halves
+static void expand(const posting_list::container& c, std::vector<uint16_t>& out){
+  out.clear();
+  out.reserve(c.cardinality);
+  switch(c.type){
+  case posting_list::ARRAY:
+    out = c.values;
+    break;
+  case posting_list::BITMAP:
+    for(size_t w = 0; w < posting_list::BITMAP_WORDS; ++w){
+      uint64_t word = c.bits[w];
+      while(word != 0){
+	out.push_back(w * 64 + __builtin_ctzll(word));
+	word &= word - 1;
+      }
+    }
+    break;
+  case posting_list::RUN:
+    for(size_t i = 0; i < c.values.size(); i += 2){
+      for(uint32_t v = c.values[i]; v <= (uint32_t) c.values[i] + c.values[i + 1]; ++v){
+	out.push_back(v);
+      }
+    }
+    break;
+  }
+}
+
+static void setRunBits(std::vector<uint64_t>& bits, const std::vector<uint16_t>& runs){
+  for(size_t i = 0; i < runs.size(); i += 2){
+    uint32_t first = runs[i], last = (uint32_t) runs[i] + runs[i + 1];
+    for(uint32_t v = first; v <= last; ){
+      // whole words at once when possible
+      if(v % 64 == 0 && v + 63 <= last){
+	bits[v / 64] = ~(uint64_t) 0;
+	v += 64;
+      }else{
+	bits[v / 64] |= (uint64_t) 1 << (v % 64);
+	++v;
+      }
+    }
+  }
+}
+
+static size_t countRuns(const posting_list::container& c){
+  size_t runs = 0;
+  switch(c.type){
+  case posting_list::ARRAY:
+    for(size_t i = 0; i < c.values.size(); ++i){
+      if(i == 0 || c.values[i] != c.values[i - 1] + 1) ++runs;
+    }
+    break;
+  case posting_list::BITMAP: {
+    uint64_t carry = 0;
+    for(size_t w = 0; w < posting_list::BITMAP_WORDS; ++w){
+      uint64_t word = c.bits[w];
+      // bits which start a run: set, with the previous bit clear
+      runs += __builtin_popcountll(word & ~((word << 1) | carry));
+      carry = word >> 63;
+    }
+    break;
+  }
+  case posting_list::RUN:
+    runs = c.values.size() / 2;
+    break;
+  }
+  return runs;
+}
+
+void posting_list::toBitmap(container& c){
+  if(c.type == BITMAP) return;
+  c.bits.assign(BITMAP_WORDS, 0);
+  if(c.type == ARRAY){
+    for(size_t i = 0; i < c.values.size(); ++i){
+      c.bits[c.values[i] / 64] |= (uint64_t) 1 << (c.values[i] % 64);
+    }
+  }else{
+    setRunBits(c.bits, c.values);
+  }
+  std::vector<uint16_t>().swap(c.values);
+  c.type = BITMAP;
+}
+
+void posting_list::toArray(container& c){
+  if(c.type == ARRAY) return;
+  std::vector<uint16_t> values;
+  expand(c, values);
+  c.values.swap(values);
+  std::vector<uint64_t>().swap(c.bits);
+  c.type = ARRAY;
+}
+
+// picks the smallest representation for the container
+void posting_list::normalize(container& c){
+  size_t runs = countRuns(c);
+  size_t array_size = 2 * (size_t) c.cardinality;
+  size_t bitmap_size = 8 * BITMAP_WORDS;
+  size_t run_size = 4 * runs;
+
+  if(run_size < array_size && run_size < bitmap_size){
+    if(c.type == RUN) return;
+    std::vector<uint16_t> values, result;
+    expand(c, values);
+    result.reserve(2 * runs);
+    for(size_t i = 0; i < values.size(); ){
+      size_t j = i;
+      while(j + 1 < values.size() && values[j + 1] == values[j] + 1) ++j;
+      result.push_back(values[i]);
+      result.push_back(values[j] - values[i]);
+      i = j + 1;
+    }
+    c.values.swap(result);
+    std::vector<uint64_t>().swap(c.bits);
+    c.type = RUN;
+  }else if(c.cardinality <= ARRAY_MAX){
+    toArray(c);
+  }else{
+    toBitmap(c);
+  }
+}
+
+// lower bound of x in v[lo..], searching with exponentially growing steps:
+// cheap when consecutive queries land close to each other
+static size_t gallop(const std::vector<uint16_t>& v, size_t lo, uint16_t x){
+  size_t step = 1;
+  while(lo + step < v.size() && v[lo + step] < x) step *= 2;
+  size_t first = lo + step / 2;
+  size_t last = std::min(lo + step + 1, v.size());
+  return std::lower_bound(v.begin() + first, v.begin() + last, x) - v.begin();
+}
+
+posting_list::container posting_list::intersectContainers(const container& x, const container& y){
+  // ordering by type halves the number of cases
+  const container& a = x.type <= y.type ? x : y;
+  const container& b = x.type <= y.type ? y : x;
+
+  container r;
+  r.key = a.key;
+  r.type = ARRAY;
+  r.cardinality = 0;
+
+  if(a.type == ARRAY && b.type == ARRAY){
+    const std::vector<uint16_t>& small = a.values.size() <= b.values.size() ? a.values : b.values;
+    const std::vector<uint16_t>& large = a.values.size() <= b.values.size() ? b.values : a.values;
+    r.values.reserve(small.size());
+    if(small.size() * 16 < large.size()){
+      size_t pos = 0;
+      for(size_t i = 0; i < small.size() && pos < large.size(); ++i){
+	pos = gallop(large, pos, small[i]);
+	if(pos < large.size() && large[pos] == small[i]) r.values.push_back(small[i]);
+      }
+    }else{
+      std::set_intersection(small.begin(), small.end(), large.begin(), large.end(),
+			    std::back_inserter(r.values));
+    }
+  }else if(a.type == ARRAY){
+    // array against bitmap or runs: keep the members of the array which are in b
+    r.values.reserve(a.values.size());
+    for(size_t i = 0; i < a.values.size(); ++i){
+      if(b.contains(a.values[i])) r.values.push_back(a.values[i]);
+    }
+  }else if(a.type == BITMAP){
+    r.type = BITMAP;
+    r.bits = a.bits;
+    if(b.type == BITMAP){
+      words_and(&r.bits[0], &b.bits[0], BITMAP_WORDS);
+    }else{
+      std::vector<uint64_t> mask(BITMAP_WORDS, 0);
+      setRunBits(mask, b.values);
+      words_and(&r.bits[0], &mask[0], BITMAP_WORDS);
+    }
+    r.cardinality = words_popcount(&r.bits[0], BITMAP_WORDS);
+    if(r.cardinality <= ARRAY_MAX) toArray(r);
+    return r;
+  }else{
+    // both are runs: intersect the intervals
+    r.type = RUN;
+    size_t i = 0, j = 0;
+    while(i < a.values.size() && j < b.values.size()){
+      uint32_t a_first = a.values[i], a_last = a_first + a.values[i + 1];
+      uint32_t b_first = b.values[j], b_last = b_first + b.values[j + 1];
+      uint32_t first = std::max(a_first, b_first), last = std::min(a_last, b_last);
+      if(first <= last){
+	r.values.push_back(first);
+	r.values.push_back(last - first);
+	r.cardinality += last - first + 1;
+      }
+      if(a_last < b_last) i += 2; else j += 2;
+    }
+    return r;
+  }
+  r.cardinality = r.values.size();
+  return r;
+}
+
+size_t posting_list::intersectionCount(const container& x, const container& y){
+  const container& a = x.type <= y.type ? x : y;
+  const container& b = x.type <= y.type ? y : x;
+
+  size_t count = 0;
+  if(a.type == ARRAY && b.type == ARRAY){
+    const std::vector<uint16_t>& small = a.values.size() <= b.values.size() ? a.values : b.values;
+    const std::vector<uint16_t>& large = a.values.size() <= b.values.size() ? b.values : a.values;
+    if(small.size() * 16 < large.size()){
+      size_t pos = 0;
+      for(size_t i = 0; i < small.size() && pos < large.size(); ++i){
+	pos = gallop(large, pos, small[i]);
+	if(pos < large.size() && large[pos] == small[i]) ++count;
+      }
+    }else{
+      size_t i = 0, j = 0;
+      while(i < small.size() && j < large.size()){
+	if(small[i] < large[j]) ++i;
+	else if(small[i] > large[j]) ++j;
+	else{ ++count; ++i; ++j; }
+      }
+    }
+  }else if(a.type == ARRAY){
+    for(size_t i = 0; i < a.values.size(); ++i){
+      if(b.contains(a.values[i])) ++count;
+    }
+  }else if(a.type == BITMAP && b.type == BITMAP){
+    for(size_t w = 0; w < BITMAP_WORDS; ++w) count += __builtin_popcountll(a.bits[w] & b.bits[w]);
+  }else if(a.type == BITMAP){
+    // the bits of a under every run of b
+    for(size_t i = 0; i < b.values.size(); i += 2){
+      uint32_t first = b.values[i], last = (uint32_t) b.values[i] + b.values[i + 1];
+      for(uint32_t w = first / 64; w <= last / 64; ++w){
+	uint64_t word = a.bits[w];
+	if(w == first / 64) word &= ~(uint64_t) 0 << (first % 64);
+	if(w == last / 64 && last % 64 != 63) word &= ((uint64_t) 1 << (last % 64 + 1)) - 1;
+	count += __builtin_popcountll(word);
+      }
+    }
+  }else{
+    size_t i = 0, j = 0;
+    while(i < a.values.size() && j < b.values.size()){
+      uint32_t a_first = a.values[i], a_last = a_first + a.values[i + 1];
+      uint32_t b_first = b.values[j], b_last = b_first + b.values[j + 1];
+      uint32_t first = std::max(a_first, b_first), last = std::min(a_last, b_last);
+      if(first <= last) count += last - first + 1;
+      if(a_last < b_last) i += 2; else j += 2;
+    }
+  }
+  return count;
+}
+
+// bits of the container in a bitmap of BITMAP_WORDS words
+static void containerBits(const posting_list::container& c, std::vector<uint64_t>& bits){
+  if(c.type == posting_list::BITMAP){
+    bits = c.bits;
+    return;
+  }
+  bits.assign(posting_list::BITMAP_WORDS, 0);
+  if(c.type == posting_list::ARRAY){
+    for(size_t i = 0; i < c.values.size(); ++i){
+      bits[c.values[i] / 64] |= (uint64_t) 1 << (c.values[i] % 64);
+    }
+  }else{
+    setRunBits(bits, c.values);
+  }
+}
+
+posting_list::container posting_list::subtractContainers(const container& a, const container& b){
+  container r;
+  r.key = a.key;
+  r.type = ARRAY;
+  r.cardinality = 0;
+  if(a.type == ARRAY){
+    // the members of the array which are not in b
+    r.values.reserve(a.values.size());
+    if(b.type == ARRAY){
+      std::set_difference(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(),
+			  std::back_inserter(r.values));
+    }else{
+      for(size_t i = 0; i < a.values.size(); ++i){
+	if(!b.contains(a.values[i])) r.values.push_back(a.values[i]);
+      }
+    }
+    r.cardinality = r.values.size();
+    return r;
+  }
+  // bitmaps and runs: ANDNOT of whole bitmaps
+  r.type = BITMAP;
+  containerBits(a, r.bits);
+  std::vector<uint64_t> mask;
+  containerBits(b, mask);
+  words_andnot(&r.bits[0], &mask[0], BITMAP_WORDS);
+  r.cardinality = words_popcount(&r.bits[0], BITMAP_WORDS);
+  if(r.cardinality <= ARRAY_MAX) toArray(r);
+  return r;
+}
+
+posting_list::container posting_list::uniteContainers(const container& a, const container& b){
+  container r;
+  r.key = a.key;
+  if(a.type == ARRAY && b.type == ARRAY && a.values.size() + b.values.size() <= ARRAY_MAX){
+    r.type = ARRAY;
+    r.values.reserve(a.values.size() + b.values.size());
+    std::set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(),
+		   std::back_inserter(r.values));
+    r.cardinality = r.values.size();
+    return r;
+  }
+  r.type = BITMAP;
+  containerBits(a, r.bits);
+  std::vector<uint64_t> other;
+  containerBits(b, other);
+  words_or(&r.bits[0], &other[0], BITMAP_WORDS);
+  r.cardinality = words_popcount(&r.bits[0], BITMAP_WORDS);
+  if(r.cardinality <= ARRAY_MAX) toArray(r);
+  return r;
+}
+
+// POSTING LIST
+
+posting_list::container *posting_list::findContainer(uint16_t key){
+  std::vector<container>::iterator it = containers.begin();
+  size_t lo = 0, hi = containers.size();
+  while(lo < hi){
+    size_t mid = (lo + hi) / 2;
+    if(containers[mid].key < key) lo = mid + 1; else hi = mid;
+  }
+  if(lo < containers.size() && containers[lo].key == key) return &*(it + lo);
+  return NULL;
+}
+const posting_list::container *posting_list::findContainer(uint16_t key) const {
+  return const_cast<posting_list *>(this)->findContainer(key);
+}
+
+size_t posting_list::memoryUsage(void) const {
+  size_t result = containers.capacity() * sizeof(container);
+  for(size_t i = 0; i < containers.size(); ++i){
+    result += containers[i].values.capacity() * sizeof(uint16_t);
+    result += containers[i].bits.capacity() * sizeof(uint64_t);
+  }
+  return result;
+}
+
+bool posting_list::contains(uint32_t id) const {
+  const container *c = findContainer(id >> 16);
+  return c != NULL && c->contains(id & 0xffff);
+}
+
+void posting_list::add(uint32_t id){
+  uint16_t key = id >> 16;
+  uint16_t low = id & 0xffff;
+
+  container *c;
+  // ids usually come in increasing order, so the last container is checked first
+  if(!containers.empty() && containers.back().key == key){
+    c = &containers.back();
+  }else{
+    c = findContainer(key);
+  }
+  if(c == NULL){
+    container fresh;
+    fresh.key = key;
+    fresh.type = ARRAY;
+    fresh.cardinality = 0;
+    std::vector<container>::iterator pos = containers.begin();
+    while(pos != containers.end() && pos->key < key) ++pos;
+    c = &*containers.insert(pos, fresh);
+  }
+
+  if(c->type == RUN){
+    if(c->contains(low)) return;
+    toBitmap(*c);
+  }
+  if(c->type == ARRAY){
+    if(c->values.empty() || c->values.back() < low){
+      c->values.push_back(low);
+    }else{
+      std::vector<uint16_t>::iterator it = std::lower_bound(c->values.begin(), c->values.end(), low);
+      if(*it == low) return;
+      c->values.insert(it, low);
+    }
+    if(c->values.size() > ARRAY_MAX) toBitmap(*c);
+  }else{
+    uint64_t& word = c->bits[low / 64];
+    uint64_t bit = (uint64_t) 1 << (low % 64);
+    if(word & bit) return;
+    word |= bit;
+  }
+  c->cardinality++;
+  total++;
+}
+
+void posting_list::remove(uint32_t id){
+  container *c = findContainer(id >> 16);
+  uint16_t low = id & 0xffff;
+  if(c == NULL || !c->contains(low)) return;
+  if(c->type == RUN){
+    if(c->cardinality <= ARRAY_MAX) toArray(*c); else toBitmap(*c);
+  }
+  if(c->type == ARRAY){
+    c->values.erase(std::lower_bound(c->values.begin(), c->values.end(), low));
+  }else{
+    c->bits[low / 64] &= ~((uint64_t) 1 << (low % 64));
+  }
+  c->cardinality--;
+  total--;
+  if(c->cardinality == 0) containers.erase(containers.begin() + (c - &containers[0]));
+}
+
+void posting_list::addRange(uint32_t first, uint32_t last){
+  while(first < last){
+    uint16_t key = first >> 16;
+    // end of this chunk or of the range
+    uint32_t chunk_last = std::min(last, ((uint32_t) key + 1) << 16);
+    if(findContainer(key) == NULL && (containers.empty() || containers.back().key < key)){
+      container c;
+      c.key = key;
+      c.type = RUN;
+      c.cardinality = chunk_last - first;
+      c.values.push_back(first & 0xffff);
+      c.values.push_back(chunk_last - first - 1);
+      containers.push_back(c);
+      total += c.cardinality;
+    }else{
+      for(uint32_t id = first; id < chunk_last; ++id) add(id);
+    }
+    first = chunk_last;
+  }
+}
+
+void posting_list::clear(void){
+  containers.clear();
+  total = 0;
+}
+
+void posting_list::assign(const uint32_t *first, const uint32_t *last){
+  clear();
+  while(first != last){
+    uint16_t key = *first >> 16;
+    const uint32_t *chunk_end = first;
+    while(chunk_end != last && (*chunk_end >> 16) == key) ++chunk_end;
+
+    containers.push_back(container());
+    container& c = containers.back();
+    c.key = key;
+    c.cardinality = chunk_end - first;
+    if(c.cardinality <= ARRAY_MAX){
+      c.type = ARRAY;
+      c.values.reserve(c.cardinality);
+      for(const uint32_t *p = first; p != chunk_end; ++p) c.values.push_back(*p & 0xffff);
+    }else{
+      c.type = BITMAP;
+      c.bits.assign(BITMAP_WORDS, 0);
+      for(const uint32_t *p = first; p != chunk_end; ++p){
+	uint16_t low = *p & 0xffff;
+	c.bits[low / 64] |= (uint64_t) 1 << (low % 64);
+      }
+    }
+    normalize(c);
+    total += c.cardinality;
+    first = chunk_end;
+  }
+  containers.shrink_to_fit();
+}
+
+void posting_list::optimize(void){
+  for(size_t i = 0; i < containers.size(); ++i){
+    normalize(containers[i]);
+    containers[i].values.shrink_to_fit();
+  }
+  containers.shrink_to_fit();
+}
+
+posting_list posting_list::intersect(const posting_list& other) const {
+  posting_list result;
+  size_t i = 0, j = 0;
+  while(i < containers.size() && j < other.containers.size()){
+    if(containers[i].key < other.containers[j].key){
+      ++i;
+    }else if(containers[i].key > other.containers[j].key){
+      ++j;
+    }else{
+      container c = intersectContainers(containers[i], other.containers[j]);
+      if(c.cardinality > 0){
+	result.total += c.cardinality;
+	result.containers.push_back(container());
+	std::swap(result.containers.back(), c);
+      }
+      ++i;
+      ++j;
+    }
+  }
+  return result;
+}
+
+size_t posting_list::intersectionCardinality(const posting_list& other) const {
+  size_t count = 0;
+  size_t i = 0, j = 0;
+  while(i < containers.size() && j < other.containers.size()){
+    if(containers[i].key < other.containers[j].key){
+      ++i;
+    }else if(containers[i].key > other.containers[j].key){
+      ++j;
+    }else{
+      count += intersectionCount(containers[i++], other.containers[j++]);
+    }
+  }
+  return count;
+}
+
+posting_list posting_list::subtract(const posting_list& other) const {
+  posting_list result;
+  size_t j = 0;
+  for(size_t i = 0; i < containers.size(); ++i){
+    while(j < other.containers.size() && other.containers[j].key < containers[i].key) ++j;
+    if(j == other.containers.size() || other.containers[j].key != containers[i].key){
+      // nothing to remove from this chunk
+      result.containers.push_back(containers[i]);
+      result.total += containers[i].cardinality;
+      continue;
+    }
+    container c = subtractContainers(containers[i], other.containers[j]);
+    if(c.cardinality > 0){
+      result.total += c.cardinality;
+      result.containers.push_back(container());
+      std::swap(result.containers.back(), c);
+    }
+  }
+  return result;
+}
+
+posting_list posting_list::unite(const posting_list& other) const {
+  posting_list result;
+  size_t i = 0, j = 0;
+  while(i < containers.size() || j < other.containers.size()){
+    if(j == other.containers.size() || (i < containers.size() && containers[i].key < other.containers[j].key)){
+      result.containers.push_back(containers[i++]);
+    }else if(i == containers.size() || containers[i].key > other.containers[j].key){
+      result.containers.push_back(other.containers[j++]);
+    }else{
+      result.containers.push_back(container());
+      container c = uniteContainers(containers[i++], other.containers[j++]);
+      std::swap(result.containers.back(), c);
+    }
+    result.total += result.containers.back().cardinality;
+  }
+  return result;
+}
+
+static bool smallerList(const posting_list *a, const posting_list *b){
+  return a->cardinality() < b->cardinality();
+}
+
+posting_list posting_list::intersectAll(std::vector<const posting_list *> lists){
+  if(lists.empty()) return posting_list();
+  std::sort(lists.begin(), lists.end(), smallerList);
+  posting_list result = *lists[0];
+  for(size_t i = 1; i < lists.size() && !result.empty(); ++i){
+    result = result.intersect(*lists[i]);
+  }
+  return result;
+}
+
+size_t posting_list::intersectAllCardinality(std::vector<const posting_list *> lists){
+  if(lists.empty()) return 0;
+  if(lists.size() == 1) return lists[0]->cardinality();
+  // the largest list is only counted against
+  std::sort(lists.begin(), lists.end(), smallerList);
+  const posting_list *largest = lists.back();
+  lists.pop_back();
+  if(lists.size() == 1) return lists[0]->intersectionCardinality(*largest);
+  return intersectAll(lists).intersectionCardinality(*largest);
+}
+
+posting_list posting_list::uniteAll(const std::vector<const posting_list *>& lists){
+  if(lists.empty()) return posting_list();
+  posting_list result = *lists[0];
+  for(size_t i = 1; i < lists.size(); ++i) result = result.unite(*lists[i]);
+  return result;
+}
+
+// ITERATION
+
+void posting_list::const_iterator::settle(void){
+  while(ci < list->containers.size()){
+    const container& c = list->containers[ci];
+    if(c.type == BITMAP){
+      size_t w = pos / 64;
+      if(w < BITMAP_WORDS){
+	uint64_t word = c.bits[w] & (~(uint64_t) 0 << (pos % 64));
+	while(word == 0 && ++w < BITMAP_WORDS) word = c.bits[w];
+	if(word != 0){
+	  pos = w * 64 + __builtin_ctzll(word);
+	  return;
+	}
+      }
+    }else if(pos < c.values.size()){
+      return;
+    }
+    ++ci;
+    pos = 0;
+    run_offset = 0;
+  }
+}
+
+uint32_t posting_list::const_iterator::operator*(void) const {
+  const container& c = list->containers[ci];
+  uint32_t low;
+  if(c.type == ARRAY) low = c.values[pos];
+  else if(c.type == BITMAP) low = pos;
+  else low = c.values[pos] + run_offset;
+  return ((uint32_t) c.key << 16) | low;
+}
+
+posting_list::const_iterator posting_list::lowerBound(uint32_t id) const {
+  uint16_t key = id >> 16;
+  uint16_t low = id & 0xffff;
+  std::vector<container>::const_iterator c =
+    std::lower_bound(containers.begin(), containers.end(), key,
+		     [](const container& c, uint16_t key){ return c.key < key; });
+  const_iterator it(this, c - containers.begin());
+  if(c == containers.end() || c->key != key) return it;
+  // somewhere inside the container of id
+  if(c->type == ARRAY){
+    it.pos = std::lower_bound(c->values.begin(), c->values.end(), low) - c->values.begin();
+  }else if(c->type == BITMAP){
+    it.pos = low;
+  }else{
+    it.pos = c->values.size();
+    for(size_t i = 0; i < c->values.size(); i += 2){
+      if((uint32_t) c->values[i] + c->values[i + 1] >= low){
+	it.pos = i;
+	it.run_offset = low > c->values[i] ? low - c->values[i] : 0;
+	break;
+      }
+    }
+  }
+  it.settle();
+  return it;
+}
+
+posting_list::const_iterator& posting_list::const_iterator::operator++(void){
+  const container& c = list->containers[ci];
+  if(c.type == RUN){
+    if(run_offset < c.values[pos + 1]){
+      ++run_offset;
+      return *this;
+    }
+    pos += 2;
+    run_offset = 0;
+  }else{
+    ++pos;
+  }
+  settle();
+  return *this;
+}
@@ -0,0 +1,130 @@
+#ifndef __POSTING_H
+#define __POSTING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iterator>
+#include <vector>
+
+// compressed set of 32-bit ids (the list of files having some tag), in the spirit of
+// roaring bitmaps. Ids are split into chunks of 2^16 by their upper half, and every
+// chunk is stored in the cheapest of three forms:
+//   ARRAY  -- sorted lower halves, for chunks with at most 4096 members;
+//   BITMAP -- 1024 words, for dense chunks;
+//   RUN    -- list of ranges [start, start + length], for long contiguous runs.
+// Sparse tags with a few files cost a few bytes instead of a bit per every file.
+class posting_list
+{
+public:
+  enum kind { ARRAY, BITMAP, RUN };
+
+  struct container
+  {
+    uint16_t key;
+    kind type;
+    uint32_t cardinality;
+    // ARRAY: sorted values; RUN: pairs (start, length), each run covers start..start+length
+    std::vector<uint16_t> values;
+    // BITMAP: always 1024 words
+    std::vector<uint64_t> bits;
+
+    bool contains(uint16_t v) const;
+  };
+
+  static const uint32_t ARRAY_MAX = 4096;
+  static const size_t BITMAP_WORDS = 1024;
+
+private:
+  std::vector<container> containers;
+  size_t total;
+
+  container *findContainer(uint16_t key);
+  const container *findContainer(uint16_t key) const;
+
+  static void toBitmap(container& c);
+  static void toArray(container& c);
+  static void normalize(container& c);
+  static container intersectContainers(const container& a, const container& b);
+  static size_t intersectionCount(const container& a, const container& b);
+  static container subtractContainers(const container& a, const container& b);
+  static container uniteContainers(const container& a, const container& b);
+
+  // reads and writes the internals directly, see tagindex.h
+  friend class tag_index;
+
+public:
+
+  posting_list(void) : containers(), total(0) { }
+
+  size_t cardinality(void) const { return total; }
+  bool empty(void) const { return total == 0; }
+  size_t containerCount(void) const { return containers.size(); }
+  // approximate heap usage in bytes
+  size_t memoryUsage(void) const;
+
+  bool contains(uint32_t id) const;
+  void add(uint32_t id);
+  void remove(uint32_t id);
+  // adds ids first, first+1, ..., last - 1
+  void addRange(uint32_t first, uint32_t last);
+  void clear(void);
+  // replaces the contents by ids from [first, last), which must be sorted and distinct;
+  // every container is allocated once in its final form, no optimize() needed
+  void assign(const uint32_t *first, const uint32_t *last);
+
+  // converts every container to its most compact representation; run containers are
+  // only ever created here and by addRange, so this should be called after bulk insertion
+  void optimize(void);
+
+  posting_list intersect(const posting_list& other) const;
+  // intersection of several lists: starts from the smallest one and stops as soon as
+  // the result becomes empty, so that a sparse tag makes the whole query cheap
+  static posting_list intersectAll(std::vector<const posting_list *> lists);
+  // sizes of the intersections above, counted without building them
+  size_t intersectionCardinality(const posting_list& other) const;
+  static size_t intersectAllCardinality(std::vector<const posting_list *> lists);
+  // ids which are not in other (ANDNOT); chunks missing from other are copied as they are,
+  // so the cost is about the size of this list
+  posting_list subtract(const posting_list& other) const;
+  posting_list unite(const posting_list& other) const;
+  static posting_list uniteAll(const std::vector<const posting_list *>& lists);
+
+  // forward iteration over ids in increasing order
+  class const_iterator
+  {
+  private:
+    const posting_list *list;
+    size_t ci;
+    // position inside the container: index in values for ARRAY and RUN, bit for BITMAP
+    size_t pos;
+    // offset inside the current run
+    uint32_t run_offset;
+
+    void settle(void);
+    friend class posting_list;
+
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef uint32_t value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const uint32_t *pointer;
+    typedef uint32_t reference;
+
+    const_iterator(const posting_list *l, size_t c) : list(l), ci(c), pos(0), run_offset(0) { settle(); }
+
+    uint32_t operator*(void) const;
+    const_iterator& operator++(void);
+    bool operator==(const const_iterator& other) const {
+      return ci == other.ci && pos == other.pos && run_offset == other.run_offset;
+    }
+    bool operator!=(const const_iterator& other) const { return !(*this == other); }
+  };
+
+  const_iterator begin(void) const { return const_iterator(this, 0); }
+  const_iterator end(void) const { return const_iterator(this, containers.size()); }
+  // the first id which is not less than id, found without walking the smaller ones
+  const_iterator lowerBound(uint32_t id) const;
+};
+
+#endif /* __POSTING_H */
@@ -0,0 +1,142 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#include "bitmask.h"
+#include "dispatch.h"
+#include "posting.h"
+#include "query.h"
+
+// tags of "(a|b|c)", or of a single tag; false if something is not a tag
+static bool parseTags(const dispatcher& disp, std::string_view s, std::vector<dispatcher::tagid>& tags){
+  tags.clear();
+  if(s.size() >= 2 && s.front() == '(' && s.back() == ')'){
+    s = s.substr(1, s.size() - 2);
+    while(true){
+      size_t bar = s.find('|');
+      dispatcher::tagid t = disp.tagId(s.substr(0, bar));
+      if(t == dispatcher::NONE) return false;
+      tags.push_back(t);
+      if(bar == std::string_view::npos) break;
+      s.remove_prefix(bar + 1);
+    }
+  }else{
+    dispatcher::tagid t = disp.tagId(s);
+    if(t == dispatcher::NONE) return false;
+    tags.push_back(t);
+  }
+  std::sort(tags.begin(), tags.end());
+  tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+  return true;
+}
+
+bool tag_query::addElement(const dispatcher& disp, std::string_view element){
+  dispatcher::tagid t = disp.tagId(element);
+  if(t != dispatcher::NONE){
+    include.push_back(t);
+    return true;
+  }
+  std::vector<tagid> tags;
+  if(element.size() > 1 && element[0] == '-'){
+    if(!parseTags(disp, element.substr(1), tags)) return false;
+    exclude.insert(exclude.end(), tags.begin(), tags.end());
+    return true;
+  }
+  if(!parseTags(disp, element, tags)) return false;
+  if(tags.size() == 1) include.push_back(tags[0]); else any_of.push_back(tags);
+  return true;
+}
+
+bool tag_query::parse(const dispatcher& disp, const std::vector<std::string>& path){
+  include.clear();
+  exclude.clear();
+  any_of.clear();
+  for(size_t i = 0; i < path.size(); ++i){
+    if(!addElement(disp, path[i])) return false;
+  }
+  std::sort(include.begin(), include.end());
+  include.erase(std::unique(include.begin(), include.end()), include.end());
+  std::sort(exclude.begin(), exclude.end());
+  exclude.erase(std::unique(exclude.begin(), exclude.end()), exclude.end());
+  std::sort(any_of.begin(), any_of.end());
+  return true;
+}
+
+static bool hasTag(const std::vector<dispatcher::tagid>& filetags, dispatcher::tagid t){
+  return std::binary_search(filetags.begin(), filetags.end(), t);
+}
+
+bool tag_query::matches(const dispatcher& disp, dispatcher::fileid f) const {
+  const std::vector<tagid>& filetags = disp.tagsOf(f);
+  for(size_t i = 0; i < include.size(); ++i){
+    if(!hasTag(filetags, include[i])) return false;
+  }
+  for(size_t i = 0; i < exclude.size(); ++i){
+    if(hasTag(filetags, exclude[i])) return false;
+  }
+  for(size_t i = 0; i < any_of.size(); ++i){
+    bool found = false;
+    for(size_t j = 0; j < any_of[i].size() && !found; ++j) found = hasTag(filetags, any_of[i][j]);
+    if(!found) return false;
+  }
+  return true;
+}
+
+// a positive term of the plan: a tag or a union, with the upper bound of its size
+struct query_term
+{
+  size_t estimate;
+  const std::vector<dispatcher::tagid> *tags;
+
+  bool operator<(const query_term& other) const { return estimate < other.estimate; }
+};
+
+posting_list tag_query::files(const dispatcher& disp) const {
+  if(plain()) return disp.tagsIntersectionIds(include);
+
+  std::vector< std::vector<tagid> > singles(include.size());
+  std::vector<query_term> terms;
+  for(size_t i = 0; i < include.size(); ++i){
+    singles[i].push_back(include[i]);
+    query_term q = { disp.filesWith(include[i]).cardinality(), &singles[i] };
+    terms.push_back(q);
+  }
+  for(size_t i = 0; i < any_of.size(); ++i){
+    query_term q = { 0, &any_of[i] };
+    for(size_t j = 0; j < any_of[i].size(); ++j) q.estimate += disp.filesWith(any_of[i][j]).cardinality();
+    terms.push_back(q);
+  }
+  std::sort(terms.begin(), terms.end());
+
+  posting_list result;
+  if(terms.empty()){
+    result = disp.allFiles();
+  }else{
+    std::vector<const posting_list *> first;
+    for(size_t j = 0; j < terms[0].tags->size(); ++j) first.push_back(&disp.filesWith((*terms[0].tags)[j]));
+    result = posting_list::uniteAll(first);
+  }
+  for(size_t i = 1; i < terms.size() && !result.empty(); ++i){
+    const std::vector<tagid>& tags = *terms[i].tags;
+    if(tags.size() == 1){
+      result = result.intersect(disp.filesWith(tags[0]));
+      continue;
+    }
+    posting_list narrowed;
+    for(size_t j = 0; j < tags.size(); ++j) narrowed = narrowed.unite(result.intersect(disp.filesWith(tags[j])));
+    std::swap(result, narrowed);
+  }
+  for(size_t i = 0; i < exclude.size() && !result.empty(); ++i){
+    result = result.subtract(disp.filesWith(exclude[i]));
+  }
+  return result;
+}
+
+bitmask tag_query::subtags(const dispatcher& disp, const posting_list& files) const {
+  if(plain()) return disp.childTags(include, files);
+  bitmask result = disp.filesUnion(files);
+  for(size_t i = 0; i < include.size(); ++i) result.reset(include[i]);
+  return result;
+}
@@ -0,0 +1,54 @@
+#ifndef __QUERY_H
+#define __QUERY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bitmask.h"
+#include "dispatch.h"
+#include "posting.h"
+
+// a directory path read as a boolean query over tags. Every element of the path is
+//   tag        -- files having the tag;
+//   -tag       -- files not having it;
+//   (a|b|c)    -- files having at least one of the tags;
+//   -(a|b|c)   -- files having none of them.
+// and the directory contains the files satisfying all elements, e.g. "/algebra/-finished"
+// or "/books/(ag|nt)". A name of an existing tag always means the tag itself, so
+// tags which look like operators keep working.
+class tag_query
+{
+private:
+  typedef dispatcher::tagid tagid;
+
+  // all sorted
+  std::vector<tagid> include;
+  std::vector<tagid> exclude;
+  std::vector< std::vector<tagid> > any_of;
+
+  bool addElement(const dispatcher& disp, std::string_view element);
+
+public:
+
+  // false if some element is neither a tag nor an operator over tags
+  bool parse(const dispatcher& disp, const std::vector<std::string>& path);
+
+  // only tags, i.e. an ordinary directory
+  bool plain(void) const { return exclude.empty() && any_of.empty(); }
+  const std::vector<tagid>& included(void) const { return include; }
+
+  // by the sorted tags of the file, without looking at posting lists
+  bool matches(const dispatcher& disp, dispatcher::fileid f) const;
+
+  // the files of the directory. The plan: positive terms (tags and unions) go from the
+  // smallest one; it is taken as it is and the others narrow it down, a union by
+  // intersecting what is left with each of its tags, so that a union costs about the
+  // result rather than its tags. Negations go last, as ANDNOT of what is left. With no
+  // positive terms the start is all files
+  posting_list files(const dispatcher& disp) const;
+  // subdirectories: the tags of these files except the included ones
+  bitmask subtags(const dispatcher& disp, const posting_list& files) const;
+};
+
+#endif /* __QUERY_H */
@@ -0,0 +1,71 @@
+#include <sched.h>
+
+#include "rcu.h"
+
+// per-thread state: the slot is claimed on the first read section of the thread
+// and given back when the thread exits
+struct rcu_thread
+{
+  rcu_domain::slot *slot;
+  unsigned nesting;
+
+  rcu_thread(void) : slot(NULL), nesting(0) { }
+  ~rcu_thread(void) {
+    if(slot != NULL) slot->taken.store(false, std::memory_order_release);
+  }
+};
+
+static thread_local rcu_thread this_thread;
+
+rcu_domain::rcu_domain(void) : epoch(1){
+  for(size_t i = 0; i < SLOTS; ++i){
+    slots[i].active.store(0);
+    slots[i].taken.store(false);
+  }
+}
+
+rcu_domain& rcu_domain::global(void){
+  static rcu_domain domain;
+  return domain;
+}
+
+rcu_domain::slot *rcu_domain::claimSlot(void){
+  while(true){
+    for(size_t i = 0; i < SLOTS; ++i){
+      bool expected = false;
+      if(!slots[i].taken.load(std::memory_order_relaxed) &&
+	 slots[i].taken.compare_exchange_strong(expected, true)){
+	return &slots[i];
+      }
+    }
+    // more threads than slots: wait for some of them to exit
+    sched_yield();
+  }
+}
+
+void rcu_domain::readLock(void){
+  rcu_thread& t = this_thread;
+  if(t.nesting++ > 0) return;
+  if(t.slot == NULL) t.slot = claimSlot();
+  // seq_cst store followed by the seq_cst load of the pointer in rcu_pointer::read:
+  // either synchronize() sees this epoch, or this reader sees the new pointer
+  t.slot->active.store(epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+}
+
+void rcu_domain::readUnlock(void){
+  rcu_thread& t = this_thread;
+  if(--t.nesting > 0) return;
+  t.slot->active.store(0, std::memory_order_release);
+}
+
+void rcu_domain::synchronize(void){
+  uint64_t target = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+  for(size_t i = 0; i < SLOTS; ++i){
+    while(true){
+      uint64_t active = slots[i].active.load(std::memory_order_seq_cst);
+      // idle, or entered after the new pointer was published
+      if(active == 0 || active >= target) break;
+      sched_yield();
+    }
+  }
+}
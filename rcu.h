@@ -0,0 +1,111 @@
+#ifndef __RCU_H
+#define __RCU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+// a minimal epoch-based RCU: readers announce the epoch they entered in, writers
+// publish a new version of the data and wait until no reader can still see the old one.
+// Readers never block and never write shared cache lines except their own slot.
+// There is one domain for the whole process; read sections may be nested.
+class rcu_domain
+{
+public:
+  // maximum number of threads inside read sections at the same time; more threads
+  // wait for a free slot
+  static const size_t SLOTS = 256;
+
+private:
+  struct slot
+  {
+    // 0 when the owner is outside of a read section, the entered epoch otherwise
+    std::atomic<uint64_t> active;
+    std::atomic<bool> taken;
+    char padding[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+  };
+
+  alignas(64) slot slots[SLOTS];
+  alignas(64) std::atomic<uint64_t> epoch;
+
+  rcu_domain(void);
+  rcu_domain(const rcu_domain&);
+  rcu_domain& operator=(const rcu_domain&);
+
+  slot *claimSlot(void);
+  friend struct rcu_thread;
+
+public:
+
+  static rcu_domain& global(void);
+
+  void readLock(void);
+  void readUnlock(void);
+  // returns when every read section which started before the call has finished
+  void synchronize(void);
+};
+
+// a pointer to an immutable object which can be replaced while being read.
+//   rcu_pointer<T>::guard g = p.read();   // lock-free
+//   g->something();                       // the object lives at least as long as g
+//   p.publish(new T(...));                // blocks until old readers are gone
+template<class T>
+class rcu_pointer
+{
+private:
+  std::atomic<const T *> current;
+  std::mutex writer;
+
+  rcu_pointer(const rcu_pointer&);
+  rcu_pointer& operator=(const rcu_pointer&);
+
+public:
+
+  class guard
+  {
+  private:
+    const T *ptr;
+
+    guard& operator=(const guard&);
+
+  public:
+    // the read section must be already entered
+    explicit guard(const T *p) : ptr(p) { }
+    guard(const guard& other) : ptr(other.ptr) {
+      rcu_domain::global().readLock();
+    }
+    ~guard(void) { rcu_domain::global().readUnlock(); }
+
+    const T *get(void) const { return ptr; }
+    const T& operator*(void) const { return *ptr; }
+    const T *operator->(void) const { return ptr; }
+  };
+
+  rcu_pointer(void) : current(NULL), writer() { }
+  ~rcu_pointer(void) { delete current.load(); }
+
+  guard read(void) const {
+    rcu_domain::global().readLock();
+    return guard(current.load(std::memory_order_seq_cst));
+  }
+
+  // takes ownership of fresh; the previous object is deleted when it is not used anymore
+  void publish(const T *fresh) {
+    std::lock_guard<std::mutex> lock(writer);
+    const T *old = current.exchange(fresh, std::memory_order_seq_cst);
+    rcu_domain::global().synchronize();
+    delete old;
+  }
+  // the same, but hands the previous object back (to be modified and published again)
+  // instead of deleting it; NULL if there was none
+  T *replace(const T *fresh) {
+    std::lock_guard<std::mutex> lock(writer);
+    const T *old = current.exchange(fresh, std::memory_order_seq_cst);
+    rcu_domain::global().synchronize();
+    return const_cast<T *>(old);
+  }
+};
+
+#endif /* __RCU_H */
@@ -0,0 +1,192 @@
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+static const char *op_names[] = {
+  "lookup", "getattr", "readlink", "open", "read", "opendir", "readdir", "mkdir", "symlink",
+  "unlink", "rename", "reload", "resolve", "listing", "fill"
+};
+
+// per-thread state: the slot is claimed on the first record of the thread and given
+// back, with its counters, when the thread exits
+struct stats_thread
+{
+  op_stats::slot *slot;
+  op_stats::counters *data;
+  bool tried;
+
+  stats_thread(void) : slot(NULL), data(NULL), tried(false) { }
+  ~stats_thread(void) {
+    if(slot != NULL) slot->taken.store(false, std::memory_order_release);
+  }
+};
+
+static thread_local stats_thread this_thread;
+
+op_stats::op_stats(void){
+  for(size_t i = 0; i < SLOTS; ++i){
+    slots[i].taken.store(false);
+    slots[i].data.store(NULL);
+  }
+}
+
+op_stats& op_stats::global(void){
+  static op_stats stats;
+  return stats;
+}
+
+const char *op_stats::name(op o){
+  return op_names[o];
+}
+
+op_stats::counters *op_stats::claimSlot(void){
+  for(size_t i = 0; i < SLOTS; ++i){
+    bool expected = false;
+    if(slots[i].taken.load(std::memory_order_relaxed) ||
+       !slots[i].taken.compare_exchange_strong(expected, true)) continue;
+    counters *data = slots[i].data.load(std::memory_order_acquire);
+    if(data == NULL){
+      data = new counters[OPS];
+      for(size_t o = 0; o < OPS; ++o){
+	data[o].count.store(0);
+	data[o].timed.store(0);
+	data[o].total_ns.store(0);
+	data[o].max_ns.store(0);
+	for(size_t b = 0; b < BUCKETS; ++b) data[o].buckets[b].store(0);
+      }
+      slots[i].data.store(data, std::memory_order_release);
+    }
+    this_thread.slot = &slots[i];
+    return data;
+  }
+  return NULL;
+}
+
+size_t op_stats::bucket(uint64_t ns){
+  if(ns < 8) return ns;
+  size_t e = 63 - __builtin_clzll(ns);
+  size_t b = (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+  return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+uint64_t op_stats::bucketValue(size_t b){
+  if(b < 8) return b;
+  size_t e = b / 8 + 2;
+  uint64_t width = (uint64_t) 1 << (e - 3);
+  return (8 + b % 8) * width + width / 2;
+}
+
+// only the owning thread writes its counters, so plain loads and stores do: no locked
+// instructions on the hot path
+static void add(std::atomic<uint64_t>& counter, uint64_t v){
+  counter.store(counter.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+bool op_stats::count(op o){
+  stats_thread& t = this_thread;
+  if(t.data == NULL){
+    // every thread tries once; the records of threads which got no slot are dropped
+    if(t.tried) return false;
+    t.tried = true;
+    t.data = claimSlot();
+    if(t.data == NULL) return false;
+  }
+  counters& c = t.data[o];
+  uint64_t n = c.count.load(std::memory_order_relaxed);
+  c.count.store(n + 1, std::memory_order_relaxed);
+  return n < SAMPLE_AFTER || n % SAMPLE_EVERY == 0;
+}
+
+void op_stats::time(op o, uint64_t ns){
+  stats_thread& t = this_thread;
+  if(t.data == NULL) return;
+  counters& c = t.data[o];
+  add(c.timed, 1);
+  add(c.total_ns, ns);
+  if(ns > c.max_ns.load(std::memory_order_relaxed)) c.max_ns.store(ns, std::memory_order_relaxed);
+  add(c.buckets[bucket(ns)], 1);
+}
+
+struct op_stats::summary
+{
+  uint64_t count;
+  uint64_t timed;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  std::vector<uint64_t> buckets;
+
+  // the smallest time which at least fraction q of the timed records don't exceed
+  uint64_t percentile(double q) const {
+    uint64_t rank = std::max((uint64_t) ceil(q * timed), (uint64_t) 1), seen = 0;
+    for(size_t b = 0; b < buckets.size(); ++b){
+      seen += buckets[b];
+      if(seen >= rank) return std::min(bucketValue(b), max_ns);
+    }
+    return max_ns;
+  }
+};
+
+// runs while the threads record: the sums are a moment of every thread, not of all of
+// them at once
+void op_stats::summarize(std::vector<summary>& sums) const {
+  sums.resize(OPS);
+  for(size_t o = 0; o < OPS; ++o){
+    sums[o].count = sums[o].timed = sums[o].total_ns = sums[o].max_ns = 0;
+    sums[o].buckets.assign(BUCKETS, 0);
+  }
+  for(size_t i = 0; i < SLOTS; ++i){
+    const counters *data = slots[i].data.load(std::memory_order_acquire);
+    if(data == NULL) continue;
+    for(size_t o = 0; o < OPS; ++o){
+      summary& s = sums[o];
+      s.count += data[o].count.load(std::memory_order_relaxed);
+      s.timed += data[o].timed.load(std::memory_order_relaxed);
+      s.total_ns += data[o].total_ns.load(std::memory_order_relaxed);
+      s.max_ns = std::max(s.max_ns, (uint64_t) data[o].max_ns.load(std::memory_order_relaxed));
+      for(size_t b = 0; b < BUCKETS; ++b) s.buckets[b] += data[o].buckets[b].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+std::string op_stats::report(void) const {
+  std::vector<summary> sums;
+  summarize(sums);
+  std::string contents;
+  char buf[256];
+  for(size_t o = 0; o < OPS; ++o){
+    const summary& s = sums[o];
+    if(s.timed == 0) continue;
+    snprintf(buf, sizeof(buf), "%s: %llu, mean %llu ns, p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns\n",
+	     op_names[o], (unsigned long long) s.count, (unsigned long long) (s.total_ns / s.timed),
+	     (unsigned long long) s.percentile(0.5), (unsigned long long) s.percentile(0.9),
+	     (unsigned long long) s.percentile(0.99), (unsigned long long) s.max_ns);
+    contents += buf;
+  }
+  return contents;
+}
+
+std::string op_stats::json(void) const {
+  std::vector<summary> sums;
+  summarize(sums);
+  std::string contents = "{";
+  char buf[256];
+  for(size_t o = 0; o < OPS; ++o){
+    const summary& s = sums[o];
+    snprintf(buf, sizeof(buf),
+	     "%s\"%s\": {\"count\": %llu, \"timed\": %llu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+	     "\"p99_ns\": %llu, \"max_ns\": %llu}",
+	     o == 0 ? "" : ", ", op_names[o], (unsigned long long) s.count,
+	     (unsigned long long) s.timed, (unsigned long long) s.total_ns,
+	     (unsigned long long) s.percentile(0.5),
+	     (unsigned long long) s.percentile(0.9),
+	     (unsigned long long) s.percentile(0.99), (unsigned long long) s.max_ns);
+    contents += buf;
+  }
+  contents += "}\n";
+  return contents;
+}
@@ -0,0 +1,114 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// counters and latency histograms of the operations of the mount and of stages inside
+// them. Every thread records into a block of its own, without locks or shared cache
+// lines; a report adds the blocks up. Histograms are log-linear, like HDR histograms:
+// eight buckets per power of two, so a percentile is within 12.5% of the real value.
+// Reading the clock costs more than a cached getattr, so every operation is counted,
+// but after the first SAMPLE_AFTER of a thread only one in SAMPLE_EVERY is timed
+class op_stats
+{
+public:
+  enum op {
+    // requests
+    LOOKUP, GETATTR, READLINK, OPEN, READ, OPENDIR, READDIR, MKDIR, SYMLINK, UNLINK, RENAME,
+    RELOAD,
+    // stages: resolving a name in a directory, computing a listing (intersections of
+    // tags and unions of alternatives), filling a readdir buffer
+    RESOLVE, LISTING, FILL,
+    OPS
+  };
+  // threads recording at the same time; the records of more threads are dropped
+  static const size_t SLOTS = 256;
+  // up to 2^40 ns, about 18 minutes; longer times fall into the last bucket
+  static const size_t BUCKETS = 38 * 8;
+  static const uint64_t SAMPLE_AFTER = 1024;
+  static const uint64_t SAMPLE_EVERY = 16;
+
+private:
+  struct counters
+  {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> timed;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> buckets[BUCKETS];
+  };
+  struct slot
+  {
+    std::atomic<bool> taken;
+    // allocated by the first thread taking the slot, kept for the next ones
+    std::atomic<counters *> data;
+  };
+
+  slot slots[SLOTS];
+
+  // counters of one operation, added up over the threads
+  struct summary;
+  void summarize(std::vector<summary>& sums) const;
+
+  op_stats(void);
+  op_stats(const op_stats&);
+  op_stats& operator=(const op_stats&);
+
+  counters *claimSlot(void);
+  friend struct stats_thread;
+
+  static size_t bucket(uint64_t ns);
+  // the middle of the values falling into bucket b
+  static uint64_t bucketValue(size_t b);
+
+public:
+
+  static op_stats& global(void);
+  static const char *name(op o);
+
+  // counts one operation; true if it should be timed
+  bool count(op o);
+  void time(op o, uint64_t ns);
+  // both, for operations which are timed anyway
+  void record(op o, uint64_t ns) {
+    count(o);
+    time(o, ns);
+  }
+
+  // one line per operation which happened: count, then mean, percentiles and maximum
+  // of the timed ones
+  std::string report(void) const;
+  // the same as one JSON object, times in ns
+  std::string json(void) const;
+};
+
+// records the time from construction to destruction:
+//   op_timer timer(op_stats::GETATTR);
+class op_timer
+{
+private:
+  op_stats::op o;
+  bool timed;
+  std::chrono::steady_clock::time_point start;
+
+  op_timer(const op_timer&);
+  op_timer& operator=(const op_timer&);
+
+public:
+  explicit op_timer(op_stats::op o) : o(o), timed(op_stats::global().count(o)) {
+    if(timed) start = std::chrono::steady_clock::now();
+  }
+  ~op_timer(void) {
+    if(!timed) return;
+    std::chrono::steady_clock::duration d = std::chrono::steady_clock::now() - start;
+    op_stats::global().time(o, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+  }
+};
+
+#endif /* __STATS_H */
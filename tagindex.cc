@@ -0,0 +1,407 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bitmask.h"
+#include "dispatch.h"
+#include "posting.h"
+#include "tagindex.h"
+
+const uint32_t tag_index::VERSION;
+
+static const char MAGIC[8] = { 'T', 'R', 'I', 'V', 'I', 'D', 'X', '\0' };
+
+struct tag_index::header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  // the .tags the index was made from
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t files;
+  uint64_t tags;
+  uint64_t links;
+  uint64_t containers;
+  uint64_t cooccurrence_rows;
+  uint64_t body_size;
+  uint64_t checksum;
+};
+
+// one container of a posting list; payload is counted in bytes from the start of
+// the payload section and in elements (uint16 values or uint64 words)
+struct index_container
+{
+  uint16_t key;
+  uint16_t type;
+  uint32_t cardinality;
+  uint64_t offset;
+  uint64_t length;
+};
+
+// four independent lanes keep the multiplications from waiting for each other;
+// size must be a multiple of 32
+static uint64_t checksum(const char *data, size_t size){
+  uint64_t lanes[4] = { 0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL };
+  const uint64_t prime = 0x100000001b3ULL;
+  for(size_t i = 0; i < size; i += 32){
+    uint64_t w[4];
+    memcpy(w, data + i, 32);
+    for(size_t l = 0; l < 4; ++l) lanes[l] = (lanes[l] ^ w[l]) * prime;
+  }
+  uint64_t h = size;
+  for(size_t l = 0; l < 4; ++l) h = (h ^ lanes[l]) * prime;
+  return h ^ (h >> 29);
+}
+
+// WRITING
+
+class index_writer
+{
+public:
+  std::vector<char> body;
+
+  void put(const void *p, size_t bytes) {
+    body.insert(body.end(), (const char *) p, (const char *) p + bytes);
+  }
+  template<class T>
+  void put(const std::vector<T>& v) { put(v.data(), v.size() * sizeof(T)); }
+  void align(size_t to = 8) {
+    while(body.size() % to != 0) body.push_back(0);
+  }
+};
+
+// the arena of names without the characters of replaced names: its size, references
+// and characters, then the number of defined names and the slots of the hash table as
+// they are, and the ids in the order of names; ids which are not in the table are free
+void tag_index::putNames(index_writer& w, const name_arena& names, const name_table& ids,
+			 const name_order& order){
+  std::vector<name_arena::ref> refs(names.size());
+  uint64_t chars = 1;
+  for(size_t i = 0; i < names.size(); ++i){
+    refs[i].offset = names[i].empty() ? 0 : chars;
+    refs[i].length = names[i].size();
+    if(!names[i].empty()) chars += names[i].size() + 1;
+  }
+  w.put(&chars, sizeof(chars));
+  w.put(refs);
+  w.align();
+  w.put("", 1);
+  for(size_t i = 0; i < names.size(); ++i){
+    if(!names[i].empty()) w.put(names[i].data(), names[i].size() + 1);
+  }
+  w.align();
+  uint64_t sizes[2] = { ids.used, ids.slots.size() };
+  w.put(sizes, sizeof(sizes));
+  w.put(ids.slots);
+  w.align();
+  w.put(order.ids);
+  w.align();
+}
+
+bool tag_index::save(const dispatcher& disp, const std::string& path, const struct stat& source){
+  // the index holds one storage: the files of other roots have no place in it
+  if(disp.roots_ > 1) return false;
+  index_writer w;
+  putNames(w, disp.files_names, disp.files_ids, disp.files_order);
+  putNames(w, disp.tags_names, disp.tags_ids, disp.tags_order);
+
+  std::vector<uint64_t> row_start(disp.files_count + 1, 0);
+  for(size_t f = 0; f < disp.files_count; ++f) row_start[f + 1] = row_start[f] + disp.tags_of_file[f].size();
+  w.put(row_start);
+  for(size_t f = 0; f < disp.files_count; ++f){
+    const std::vector<dispatcher::tagid>& row = disp.tags_of_file[f];
+    for(size_t j = 0; j < row.size(); ++j){
+      uint32_t t = row[j];
+      w.put(&t, sizeof(t));
+    }
+  }
+  w.align();
+
+  // descriptors first, payload after them
+  std::vector<uint64_t> container_start(disp.tags_count + 1, 0);
+  std::vector<index_container> descriptors;
+  uint64_t payload = 0;
+  for(size_t t = 0; t < disp.tags_count; ++t){
+    const std::vector<posting_list::container>& cs = disp.files_with_tag[t].containers;
+    for(size_t i = 0; i < cs.size(); ++i){
+      index_container d;
+      d.key = cs[i].key;
+      d.type = cs[i].type;
+      d.cardinality = cs[i].cardinality;
+      d.offset = payload;
+      if(cs[i].type == posting_list::BITMAP){
+	d.length = cs[i].bits.size();
+	payload += d.length * sizeof(uint64_t);
+      }else{
+	d.length = cs[i].values.size();
+	payload += (d.length * sizeof(uint16_t) + 7) / 8 * 8;
+      }
+      descriptors.push_back(d);
+    }
+    container_start[t + 1] = descriptors.size();
+  }
+  w.put(container_start);
+  w.put(descriptors);
+  for(size_t t = 0; t < disp.tags_count; ++t){
+    const std::vector<posting_list::container>& cs = disp.files_with_tag[t].containers;
+    for(size_t i = 0; i < cs.size(); ++i){
+      if(cs[i].type == posting_list::BITMAP){
+	w.put(cs[i].bits);
+      }else{
+	w.put(cs[i].values);
+	w.align();
+      }
+    }
+  }
+
+  // the co-occurrence index is stored only when it is valid; then every row has the
+  // same number of words as used_tags
+  std::vector<uint32_t> rows;
+  if(disp.cooccurrence_valid){
+    for(size_t t = 0; t < disp.tags_count; ++t){
+      if(disp.cooccurrence[t].size() == disp.tags_count && disp.tags_count != 0) rows.push_back(t);
+    }
+    w.put(disp.used_tags.words(), disp.used_tags.wordCount() * sizeof(uint64_t));
+    w.put(rows);
+    w.align();
+    for(size_t i = 0; i < rows.size(); ++i){
+      const bitmask& row = disp.cooccurrence[rows[i]];
+      w.put(row.words(), row.wordCount() * sizeof(uint64_t));
+    }
+  }
+  w.align(32);
+
+  header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = VERSION;
+  h.header_size = sizeof(h);
+  h.source_size = source.st_size;
+  h.source_mtime_sec = source.st_mtim.tv_sec;
+  h.source_mtime_nsec = source.st_mtim.tv_nsec;
+  h.files = disp.files_count;
+  h.tags = disp.tags_count;
+  h.links = row_start[disp.files_count];
+  h.containers = descriptors.size();
+  // rows + 1, so that 0 means "no co-occurrence section"
+  h.cooccurrence_rows = disp.cooccurrence_valid ? rows.size() + 1 : 0;
+  h.body_size = w.body.size();
+  h.checksum = checksum(w.body.data(), w.body.size());
+
+  char tmp_suffix[32];
+  snprintf(tmp_suffix, sizeof(tmp_suffix), ".tmp%d", (int) getpid());
+  std::string tmp = path + tmp_suffix;
+  FILE *f = fopen(tmp.c_str(), "w");
+  if(f == NULL) return false;
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(w.body.data(), 1, w.body.size(), f) == w.body.size();
+  ok = (fclose(f) == 0) && ok;
+  if(ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+  if(!ok) unlink(tmp.c_str());
+  return ok;
+}
+
+// READING
+
+// hands out consecutive pieces of the body; any read past the end fails the whole load
+class index_reader
+{
+private:
+  const char *p;
+  const char *end;
+
+public:
+  bool failed;
+
+  index_reader(const char *data, size_t size) : p(data), end(data + size), failed(false) { }
+
+  template<class T>
+  const T *take(size_t count) {
+    if(failed || count > (size_t) (end - p) / sizeof(T)){
+      failed = true;
+      return NULL;
+    }
+    const T *result = (const T *) p;
+    p += count * sizeof(T);
+    return result;
+  }
+  void align(void) {
+    size_t skip = (8 - (size_t) (uintptr_t) p % 8) % 8;
+    if(!failed && skip > (size_t) (end - p)) failed = true;
+    if(!failed) p += skip;
+  }
+};
+
+// fills names, the dictionary, the list of free ids and the order; the arena, the hash
+// table and the order are copied as they are, so nothing is hashed or sorted
+bool tag_index::takeNames(index_reader& r, size_t count, name_arena& names,
+			  name_table& ids, std::vector<uint32_t>& free_ids, name_order& order){
+  const uint64_t *total = r.take<uint64_t>(1);
+  const name_arena::ref *refs = r.take<name_arena::ref>(count);
+  r.align();
+  if(r.failed || *total == 0 || *total > UINT32_MAX) return false;
+  const char *chars = r.take<char>(*total);
+  r.align();
+  const uint64_t *sizes = r.take<uint64_t>(2);
+  if(sizes == NULL || sizes[0] > count || sizes[0] > sizes[1] / 4 * 3 ||
+     (sizes[1] & (sizes[1] - 1)) != 0) return false;
+  const name_table::slot *slots = r.take<name_table::slot>(sizes[1]);
+  r.align();
+  // every defined id once
+  const uint32_t *sorted = r.take<uint32_t>(sizes[0]);
+  r.align();
+  if(r.failed) return false;
+
+  // every name ends within the characters, with '\0'
+  for(size_t i = 0; i < count; ++i){
+    if(refs[i].offset >= *total || refs[i].length >= *total - refs[i].offset ||
+       chars[refs[i].offset + refs[i].length] != '\0') return false;
+  }
+  names.chars.assign(chars, chars + *total);
+  names.refs.assign(refs, refs + count);
+  names.garbage = 0;
+  std::vector<bool> used(count, false);
+  size_t defined = 0;
+  for(size_t i = 0; i < sizes[1]; ++i){
+    uint32_t id = slots[i].id;
+    if(id == name_table::EMPTY) continue;
+    if(id >= count || used[id]) return false;
+    used[id] = true;
+    defined++;
+  }
+  if(defined != sizes[0]) return false;
+  std::vector<bool> ordered(count, false);
+  for(size_t i = 0; i < defined; ++i){
+    if(sorted[i] >= count || !used[sorted[i]] || ordered[sorted[i]]) return false;
+    ordered[sorted[i]] = true;
+  }
+  order.ids.assign(sorted, sorted + defined);
+  ids.slots.assign(slots, slots + sizes[1]);
+  ids.used = defined;
+  for(size_t i = count; i-- > 0; ) if(!used[i]) free_ids.push_back(i);
+  return true;
+}
+
+bool tag_index::readBody(dispatcher& disp, const header& h, const char *body){
+  index_reader r(body, h.body_size);
+  if(!takeNames(r, h.files, disp.files_names, disp.files_ids, disp.free_files, disp.files_order)) return false;
+  if(!takeNames(r, h.tags, disp.tags_names, disp.tags_ids, disp.free_tags, disp.tags_order)) return false;
+  disp.files_count = h.files;
+  disp.tags_count = h.tags;
+  disp.all_files.addRange(0, h.files);
+  for(size_t i = 0; i < disp.free_files.size(); ++i) disp.all_files.remove(disp.free_files[i]);
+  disp.all_files.optimize();
+  disp.file_root.assign(h.files, 0);
+
+  const uint64_t *row_start = r.take<uint64_t>(h.files + 1);
+  const uint32_t *row_tags = r.take<uint32_t>(h.links);
+  r.align();
+  if(r.failed || row_start[h.files] != h.links) return false;
+  disp.tags_of_file.resize(h.files);
+  for(size_t f = 0; f < h.files; ++f){
+    if(row_start[f] > row_start[f + 1] || row_start[f + 1] > h.links) return false;
+    disp.tags_of_file[f].assign(row_tags + row_start[f], row_tags + row_start[f + 1]);
+    for(size_t j = 0; j < disp.tags_of_file[f].size(); ++j){
+      if(disp.tags_of_file[f][j] >= h.tags) return false;
+    }
+  }
+
+  const uint64_t *container_start = r.take<uint64_t>(h.tags + 1);
+  const index_container *descriptors = r.take<index_container>(h.containers);
+  if(r.failed || container_start[h.tags] != h.containers) return false;
+  // the payload ends where the last container ends
+  uint64_t payload_size = 0;
+  for(size_t i = 0; i < h.containers; ++i){
+    uint64_t bytes = descriptors[i].type == posting_list::BITMAP ?
+      descriptors[i].length * sizeof(uint64_t) : (descriptors[i].length * sizeof(uint16_t) + 7) / 8 * 8;
+    payload_size = std::max(payload_size, descriptors[i].offset + bytes);
+  }
+  const char *payload = r.take<char>(payload_size);
+  if(r.failed) return false;
+  disp.files_with_tag.resize(h.tags);
+  for(size_t t = 0; t < h.tags; ++t){
+    if(container_start[t] > container_start[t + 1] || container_start[t + 1] > h.containers) return false;
+    posting_list& list = disp.files_with_tag[t];
+    list.containers.resize(container_start[t + 1] - container_start[t]);
+    list.total = 0;
+    for(size_t i = 0; i < list.containers.size(); ++i){
+      const index_container& d = descriptors[container_start[t] + i];
+      posting_list::container& c = list.containers[i];
+      c.key = d.key;
+      c.type = (posting_list::kind) d.type;
+      c.cardinality = d.cardinality;
+      if(d.type == posting_list::BITMAP){
+	if(d.length != posting_list::BITMAP_WORDS) return false;
+	const uint64_t *words = (const uint64_t *) (payload + d.offset);
+	c.bits.assign(words, words + d.length);
+      }else if(d.type == posting_list::ARRAY || d.type == posting_list::RUN){
+	const uint16_t *values = (const uint16_t *) (payload + d.offset);
+	c.values.assign(values, values + d.length);
+      }else{
+	return false;
+      }
+      list.total += c.cardinality;
+    }
+  }
+
+  if(h.cooccurrence_rows != 0){
+    size_t words = bitmask::wordsFor(h.tags);
+    const uint64_t *used = r.take<uint64_t>(words);
+    const uint32_t *rows = r.take<uint32_t>(h.cooccurrence_rows - 1);
+    r.align();
+    const uint64_t *row_words = r.take<uint64_t>(words * (h.cooccurrence_rows - 1));
+    if(r.failed) return false;
+    disp.used_tags = bitmask(h.tags, used);
+    disp.cooccurrence.assign(h.tags, bitmask());
+    for(size_t i = 0; i + 1 < h.cooccurrence_rows; ++i){
+      if(rows[i] >= h.tags) return false;
+      disp.cooccurrence[rows[i]] = bitmask(h.tags, row_words + i * words);
+    }
+    disp.cooccurrence_valid = true;
+  }
+  return true;
+}
+
+bool tag_index::load(dispatcher& disp, const std::string& path, const struct stat& source){
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header)){
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) return false;
+  madvise(m, size, MADV_WILLNEED);
+
+  const header& h = *(const header *) m;
+  const char *body = (const char *) m + sizeof(header);
+  bool ok = memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0
+    && h.version == VERSION
+    && h.header_size == sizeof(header)
+    && h.source_size == (uint64_t) source.st_size
+    && h.source_mtime_sec == (int64_t) source.st_mtim.tv_sec
+    && h.source_mtime_nsec == (int64_t) source.st_mtim.tv_nsec
+    && h.body_size == size - sizeof(header)
+    && h.body_size % 32 == 0
+    && checksum(body, h.body_size) == h.checksum;
+
+  disp.reset();
+  if(ok) ok = readBody(disp, h, body);
+  // a half-filled dispatcher must not be used
+  if(!ok) disp.reset();
+  munmap(m, size);
+  return ok;
+}
@@ -0,0 +1,59 @@
+#ifndef __TAGINDEX_H
+#define __TAGINDEX_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "dispatch.h"
+#include "names.h"
+
+class index_writer;
+class index_reader;
+
+// binary image of a loaded dispatcher, kept next to .tags (as .tags.index) so that
+// mounting doesn't have to parse and resolve the whole text again.
+// The file is a header followed by 8-byte aligned sections:
+//   names of files and tags  -- the arenas (references and characters), plus the
+//                               slots of the hash tables and the ids in the order
+//                               of names (see names.h), so that names and
+//                               dictionaries are copied rather than built (ids
+//                               which are not in a hash table are free);
+//   tags of files            -- offsets of rows and tag ids (CSR);
+//   files with tags          -- descriptors of posting containers and their payload;
+//   co-occurrence index      -- used tags and rows of popular tags.
+// The header remembers size and modification time of .tags it was made from; an
+// index which doesn't match them, has another version or a wrong checksum is ignored.
+//
+// Loading copies every section into the vectors of the dispatcher rather than keeping
+// the large read-only arrays (posting payload, rows, names) in the mapping. That is one
+// more pass over the file and, while loading, its size in memory twice; in return the
+// dispatcher stays an ordinary value which changes through the mount edit in place and
+// copy (see editTags in fuse.cc), and the mapping is dropped right after loading, so an
+// index replaced later pins neither the old file nor its pages. The checksum reads
+// every byte anyway, so a mapping kept alive would save the copy but not the read.
+class tag_index
+{
+private:
+  struct header;
+  static bool readBody(dispatcher& disp, const header& h, const char *body);
+  static void putNames(index_writer& w, const name_arena& names, const name_table& ids,
+		       const name_order& order);
+  static bool takeNames(index_reader& r, size_t count, name_arena& names,
+			name_table& ids, std::vector<uint32_t>& free_ids, name_order& order);
+
+public:
+  static const uint32_t VERSION = 5;
+
+  // writes the index of disp made from the .tags described by source; the file is
+  // written under a temporary name and renamed, so readers never see a partial one.
+  // False if disp holds files of several roots
+  static bool save(const dispatcher& disp, const std::string& path, const struct stat& source);
+  // replaces the contents of disp by the index, if it is valid and made from source
+  static bool load(dispatcher& disp, const std::string& path, const struct stat& source);
+};
+
+#endif /* __TAGINDEX_H */
@@ -0,0 +1,105 @@
+// native counterpart of the trivialtags script: the same arguments for one file, and
+// a batch mode which applies any number of changes in one run (see batch.h).
+// .tags is loaded once, changed in memory and written once, atomically.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "batch.h"
+#include "dispatch.h"
+#include "tagindex.h"
+#include "util.h"
+
+static void usage(void){
+  printf("\n"
+	 "Usage:\n"
+	 "    trivialtags-native [-C storage] <name of file> [tag1, tag2, ...]\n"
+	 "    trivialtags-native [-C storage] --batch [file with changes]\n"
+	 "When no tag is passed, current tags for file will be printed.\n"
+	 "When tag starts with character '-', appropriate tag will be extracted from file\n"
+	 "If entire tag name is '-' all tags of file will be removed\n"
+	 "A batch (read from stdin if no file is given) consists of lines\n"
+	 "    name of file { tag1, -tag2, ... }\n"
+	 "with the same meaning of tags. The storage directory is the current one by default.\n");
+}
+
+static bool readAll(FILE *in, std::string& text){
+  char buf[65536];
+  size_t len;
+  while((len = fread(buf, 1, sizeof(buf), in)) > 0) text.append(buf, len);
+  return !ferror(in);
+}
+
+int main(int argc, char **argv){
+  std::string storage = ".";
+  int arg = 1;
+  if(arg + 1 < argc && strcmp(argv[arg], "-C") == 0){
+    storage = argv[arg + 1];
+    arg += 2;
+  }
+  bool batch = arg < argc && strcmp(argv[arg], "--batch") == 0;
+  if(batch ? argc - arg > 2 : (argc - arg < 1 || argc - arg > 2)){
+    usage();
+    return 1;
+  }
+
+  dispatcher disp;
+  loadStorage(disp, storage);
+
+  batch_stats stats;
+  if(batch){
+    FILE *in = stdin;
+    if(arg + 1 < argc && strcmp(argv[arg + 1], "-") != 0){
+      in = fopen(argv[arg + 1], "r");
+      if(in == NULL){
+	perror(argv[arg + 1]);
+	return 1;
+      }
+    }
+    std::string text;
+    bool ok = readAll(in, text);
+    if(in != stdin) fclose(in);
+    if(!ok){
+      fprintf(stderr, "Can't read the batch\n");
+      return 1;
+    }
+    stats = applyBatch(disp, text);
+  }else if(argc - arg == 1){
+    dispatcher::fileid f = disp.fileId(argv[arg]);
+    if(f == dispatcher::NONE){
+      printf("File %s is not tagged\n", argv[arg]);
+      return 0;
+    }
+    const std::vector<dispatcher::tagid>& tags = disp.tagsOf(f);
+    for(size_t i = 0; i < tags.size(); ++i){
+      printf("%s%s", i == 0 ? "" : ", ", disp.tagname(tags[i]).data());
+    }
+    printf("\n");
+    return 0;
+  }else{
+    tagFile(disp, argv[arg], splitWords(argv[arg + 1]), stats);
+  }
+
+  if(stats.rejected != 0){
+    fprintf(stderr, "%zu change(s) ignored: names of files and tags must differ\n", stats.rejected);
+  }
+  if(stats.added == 0 && stats.removed == 0) return 0;
+  std::string tags_path = storage + "/.tags";
+  struct stat written;
+  if(!saveTags(disp, tags_path, &written)){
+    perror(tags_path.c_str());
+    return 1;
+  }
+  // the next mount doesn't have to parse it
+  disp.optimize();
+  tag_index::save(disp, storage + "/.tags.index", written);
+  if(batch) printf("%zu file(s): %zu tag(s) added, %zu removed\n", stats.files, stats.added, stats.removed);
+  return 0;
+}
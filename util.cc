@@ -3,11 +3,22 @@
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <string_view>
+#include <unordered_map>
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
+#include <unistd.h>
 
+#include "bitmask.h"
+#include "cache.h"
 #include "dispatch.h"
+#include "posting.h"
+#include "parallel.h"
 #include "parser.h"
+#include "query.h"
+#include "tagindex.h"
 #include "util.h"
 
 // path ("/a/f/sad/sdf")
@@ -47,20 +58,125 @@ std::vector<std::string> splitPath(const std::string& path){
 //   (a) files, ie. links to real files in the storage which are tagged with "math" and "book"
 //   (b) directories, which correspond to different tags with non-empty intersection with "math" and "book"
 // we return the structure of the current directory (passed as the list of tags) as bitmasks corresponding
-// to internal masks in dispatcher (the nth bit in the .first is set if and only if the nth tag should be presented,
-// similarly for the .second, which is the bitmask of files lying in the path.
-std::pair< std::vector<bool>, std::vector<bool> > directoryStructure(const dispatcher& disp, const std::vector<std::string>& tags){
-  std::vector<bool> tags_by_id = disp.convertTagsToIds(tags);
+// to internal masks in dispatcher (the nth bit in the .first is set if and only if the nth tag should be presented),
+// and the .second is the posting list of files lying in the path.
+std::pair<bitmask, posting_list> directoryStructure(const dispatcher& disp, const std::vector<std::string>& tags){
+  std::vector<dispatcher::tagid> tags_by_id = disp.convertTagsToIdList(tags);
   
-  std::vector<bool> filelist = disp.tagsIntersection(tags_by_id);
-  std::vector<bool> total_taglist = disp.filesUnion(filelist);
+  posting_list filelist = disp.tagsIntersectionIds(tags_by_id);
+  bitmask total_taglist = disp.childTags(tags_by_id, filelist);
 
-  for(size_t i = 0; i < total_taglist.size(); ++i){
-    if(tags_by_id[i]) total_taglist[i] = false;
-  }
   return std::make_pair(total_taglist, filelist);
 }
 
+// the same through the cache of listings, for any valid directory (see validDirectory).
+// Only ordinary directories are cached: the key of the cache is a set of tags
+directory_cache::value directoryStructure(const dispatcher& disp, directory_cache& cache, const std::vector<std::string>& tags,
+					  bool *computed){
+  if(computed != NULL) *computed = true;
+  tag_query query;
+  query.parse(disp, tags);
+  if(!query.plain()){
+    std::shared_ptr<directory_listing> listing(new directory_listing);
+    listing->files = query.files(disp);
+    listing->subtags = query.subtags(disp, listing->files);
+    return listing;
+  }
+  directory_cache::key key = query.included();
+  bool wants_view;
+  directory_cache::value cached = cache.find(key, disp.generation(), &wants_view);
+  if(cached && computed != NULL) *computed = false;
+  if(!cached){
+    std::shared_ptr<directory_listing> listing(new directory_listing);
+    // browsing goes downwards, so the parent directory is usually cached
+    dispatcher::tagid missing;
+    directory_cache::value parent = cache.findParent(key, disp.generation(), &missing);
+    if(parent){
+      listing->files = disp.narrowIntersection(parent->files, missing);
+    }else{
+      listing->files = disp.tagsIntersectionIds(key);
+    }
+    listing->subtags = disp.childTags(key, listing->files);
+    cache.insert(key, listing, disp.generation());
+    cached = listing;
+  }
+  // a hot directory becomes a view, which changes update rather than drop
+  if(wants_view){
+    cache.materialize(key, cached, subtagCounts(disp, *cached), disp.generation());
+  }
+  return cached;
+}
+
+size_t directoryFileCount(const dispatcher& disp, directory_cache& cache,
+			  const std::vector<std::string>& tags, long *subdirs){
+  *subdirs = -1;
+  tag_query query;
+  query.parse(disp, tags);
+  if(!query.plain()) return query.files(disp).cardinality();
+  const directory_cache::key& key = query.included();
+  directory_cache::value cached = cache.peek(key, disp.generation());
+  if(cached){
+    *subdirs = cached->subtags.count();
+    return cached->files.cardinality();
+  }
+  *subdirs = disp.childTagCount(key);
+  if(key.empty()) return disp.allFiles().cardinality();
+  std::vector<const posting_list *> lists;
+  size_t smallest = disp.allFiles().cardinality();
+  for(size_t i = 0; i < key.size(); ++i){
+    lists.push_back(&disp.filesWith(key[i]));
+    smallest = std::min(smallest, lists.back()->cardinality());
+  }
+  // a cached parent only helps when it is smaller than every tag (it isn't for the
+  // root); findParent doesn't count as a lookup, so the hot keys stay those listed
+  dispatcher::tagid missing;
+  directory_cache::value parent;
+  if(key.size() > 1) parent = cache.findParent(key, disp.generation(), &missing);
+  if(parent && parent->files.cardinality() < smallest){
+    return parent->files.intersectionCardinality(disp.filesWith(missing));
+  }
+  return posting_list::intersectAllCardinality(lists);
+}
+
+directory_listing completeDirectory(const dispatcher& disp, directory_cache& cache,
+				    const std::vector<std::string>& dir, std::string_view prefix){
+  directory_listing result;
+  tag_query query;
+  if(!query.parse(disp, dir)) return result;
+
+  std::pair<const uint32_t *, const uint32_t *> files = disp.filesWithPrefix(prefix);
+  std::vector<uint32_t> found;
+  for(const uint32_t *f = files.first; f != files.second; ++f){
+    if(query.matches(disp, *f)) found.push_back(*f);
+  }
+  // the order of names isn't the order of ids
+  std::sort(found.begin(), found.end());
+  result.files.assign(found.data(), found.data() + found.size());
+
+  std::pair<const uint32_t *, const uint32_t *> tags = disp.tagsWithPrefix(prefix);
+  if(tags.first == tags.second) return result;
+  // the listing of the directory tells which of the tags are subdirectories; it is
+  // computed once (and cached, completion goes on while typing) rather than intersected
+  // for every tag
+  directory_cache::value listing = directoryStructure(disp, cache, dir);
+  result.subtags = bitmask(disp.tagIdCount(), false);
+  for(const uint32_t *t = tags.first; t != tags.second; ++t){
+    if(*t < listing->subtags.size() && listing->subtags.test(*t)) result.subtags.set(*t);
+  }
+  return result;
+}
+
+std::vector<size_t> subtagCounts(const dispatcher& disp, const directory_listing& listing){
+  std::vector<size_t> counts(listing.subtags.size(), 0);
+  for(posting_list::const_iterator it = listing.files.begin(); it != listing.files.end(); ++it){
+    const std::vector<dispatcher::tagid>& tags = disp.tagsOf(*it);
+    for(size_t i = 0; i < tags.size(); ++i){
+      if(tags[i] < counts.size() && listing.subtags.test(tags[i])) counts[tags[i]]++;
+    }
+  }
+  return counts;
+}
+
 // std::pair< std::set<std::string>, std::set<std::string> > directoryStructure(const dispatcher& disp, std::vector<std::string> tags){
 //   if(tags.empty()){
 //     // root directory: all files and all tags
@@ -77,26 +193,331 @@ std::pair< std::vector<bool>, std::vector<bool> > directoryStructure(const dispa
 //   return std::make_pair(subdirs, files);
 // }
 
+bool validDirectory(const dispatcher& disp, const std::vector<std::string>& path){
+  tag_query query;
+  return query.parse(disp, path);
+}
+
 bool doesFileExist(const dispatcher& disp, const std::vector<std::string>& tags, const std::string& filename){
-  if(!disp.isFileDefined(filename)) return false;
-  return disp.hasTags(filename, tags);
+  dispatcher::fileid f = disp.fileId(filename);
+  if(f == dispatcher::NONE) return false;
+  tag_query query;
+  return query.parse(disp, tags) && query.matches(disp, f);
+}
+
+// the hashed part of resolvePath and resolveEntry: elements(visit) calls visit for the
+// elements of the directory in turn while it returns true. A directory element which is
+// not a tag clears plain, and the caller falls back to queries
+template<class Elements>
+static path_kind resolvePlain(const dispatcher& disp, Elements elements, std::string_view last, bool& plain){
+  dispatcher::fileid f = disp.fileId(last);
+  bool outside = false;
+  plain = true;
+  elements([&](std::string_view element){
+      dispatcher::tagid t = disp.tagId(element);
+      if(t == dispatcher::NONE){
+	plain = false;
+      }else if(f != dispatcher::NONE){
+	const std::vector<dispatcher::tagid>& filetags = disp.tagsOf(f);
+	outside = !std::binary_search(filetags.begin(), filetags.end(), t);
+      }
+      return plain && !outside;
+    });
+  if(outside) return NO_ENTRY;
+  if(plain){
+    if(f != dispatcher::NONE) return FILE_ENTRY;
+    if(disp.isTagDefined(last)) return DIRECTORY_ENTRY;
+  }
+  plain = false;
+  return NO_ENTRY;
+}
+
+// the other paths
+static path_kind resolveQuery(const dispatcher& disp, const std::vector<std::string>& dir, const std::string& name){
+  if(disp.isFileDefined(name)) return doesFileExist(disp, dir, name) ? FILE_ENTRY : NO_ENTRY;
+  std::vector<std::string> tags(dir);
+  tags.push_back(name);
+  return validDirectory(disp, tags) ? DIRECTORY_ENTRY : NO_ENTRY;
+}
+
+path_kind resolvePath(const dispatcher& disp, std::string_view path, std::string_view *name){
+  size_t slash = path.rfind('/');
+  std::string_view last = path.substr(slash + 1);
+  if(name != NULL) *name = last;
+  if(path == "/") return DIRECTORY_ENTRY;
+
+  bool plain;
+  path_kind kind = resolvePlain(disp, [&](auto visit){
+      // the elements before the last one; every one starts after a '/'
+      for(size_t pos = 0; pos < slash; ){
+	size_t next = path.find('/', pos + 1);
+	if(!visit(path.substr(pos + 1, next - pos - 1))) break;
+	pos = next;
+      }
+    }, last, plain);
+  if(plain) return kind;
+
+  std::vector<std::string> tags = splitPath(std::string(path));
+  std::string filename = extractFilename(tags);
+  return resolveQuery(disp, tags, filename);
 }
 
-void loadTags(dispatcher& disp, const std::string& path){
+path_kind resolveEntry(const dispatcher& disp, const std::vector<std::string>& dir, std::string_view name){
+  bool plain;
+  path_kind kind = resolvePlain(disp, [&](auto visit){
+      for(size_t i = 0; i < dir.size() && visit(dir[i]); ++i);
+    }, name, plain);
+  if(plain) return kind;
+  return resolveQuery(disp, dir, std::string(name));
+}
+
+// LOADING
+// .tags is cut into chunks on section boundaries (see parser::split), which are parsed
+// by separate threads into local dictionaries: every chunk records names in order of
+// their first appearance in it ("events") and links between them. The dictionaries are
+// merged by shards of names (by hash), also in parallel; a shard decides for each of its
+// names whether it is a file or a tag. A name can't be both, and as in sequential
+// loading the first appearance wins, while sections naming the other kind are ignored.
+// Ids are given in order of first appearance in the file, so the result doesn't depend
+// on the number of threads.
+
+struct name_event
+{
+  std::string_view name;
+  bool is_tag;
+  size_t hash;
+};
+
+struct chunk_index
+{
+  std::vector<name_event> events;
+  // (file event, tag event)
+  std::vector< std::pair<uint32_t, uint32_t> > links;
+
+  // filled by the merge, for every event
+  enum { FIRST, DUPLICATE, REJECTED };
+  std::vector<uint8_t> status;
+  // for DUPLICATE: (chunk, event) of the first appearance
+  std::vector< std::pair<uint32_t, uint32_t> > origin;
+  // global ids (indices in files_by_id/tags_by_id below), NONE for rejected
+  std::vector<size_t> ids;
+  size_t new_files;
+  size_t new_tags;
+};
+
+static uint32_t localEvent(chunk_index& c, std::unordered_map<std::string_view, uint32_t>& seen,
+			   std::string_view name, bool is_tag){
+  std::pair<std::unordered_map<std::string_view, uint32_t>::iterator, bool> ins =
+    seen.emplace(name, (uint32_t) c.events.size());
+  if(ins.second){
+    name_event e = { name, is_tag, std::hash<std::string_view>()(name) };
+    c.events.push_back(e);
+  }
+  return ins.first->second;
+}
+
+static void indexChunk(std::string_view part, chunk_index& c){
+  std::unordered_map<std::string_view, uint32_t> files, tags;
+  parser::parse(part, [&](parser::name name, const parser::tags& t){
+      uint32_t f = localEvent(c, files, name, false);
+      for(size_t i = 0; i < t.size(); ++i){
+	c.links.push_back(std::make_pair(f, localEvent(c, tags, t[i], true)));
+      }
+    });
+  c.status.assign(c.events.size(), chunk_index::FIRST);
+  c.origin.assign(c.events.size(), std::make_pair(0u, 0u));
+  c.ids.assign(c.events.size(), dispatcher::NONE);
+}
+
+struct first_seen
+{
+  uint32_t chunk;
+  uint32_t event;
+  bool is_tag;
+};
+
+// every event belongs to exactly one shard, so shards write to disjoint places
+static void mergeShard(std::vector<chunk_index>& chunks, size_t shard, size_t shards){
+  std::unordered_map<std::string_view, first_seen> seen;
+  for(uint32_t c = 0; c < chunks.size(); ++c){
+    chunk_index& chunk = chunks[c];
+    for(uint32_t e = 0; e < chunk.events.size(); ++e){
+      const name_event& ev = chunk.events[e];
+      if(ev.hash % shards != shard) continue;
+      first_seen fs = { c, e, ev.is_tag };
+      std::pair<std::unordered_map<std::string_view, first_seen>::iterator, bool> ins =
+	seen.emplace(ev.name, fs);
+      if(ins.second){
+	chunk.status[e] = chunk_index::FIRST;
+      }else if(ins.first->second.is_tag != ev.is_tag){
+	chunk.status[e] = chunk_index::REJECTED;
+      }else{
+	chunk.status[e] = chunk_index::DUPLICATE;
+	chunk.origin[e] = std::make_pair(ins.first->second.chunk, ins.first->second.event);
+      }
+    }
+  }
+}
+
+void loadTags(dispatcher& disp, const std::string& path, unsigned threads, dispatcher::delta *changes,
+	      unsigned root){
+  if(threads == 0) threads = defaultThreads();
   parser par(path);
-  parser::config conf = par.parse();
-  parser::config::iterator it = conf.begin();
-  for(; it != conf.end(); ++it){
-    parser::name name = it->first;
-    parser::tags tags = it->second;
-    disp.defineFile(name);
-    parser::tags::iterator tag_iter = tags.begin();
-    for(; tag_iter != tags.end(); ++tag_iter){
-      std::string tag(*tag_iter);
-      disp.defineTag(tag);
-      disp.link(name, tag);
+
+  // several chunks per thread balance sections of different lengths; tiny chunks
+  // are not worth a thread
+  size_t min_chunk = 256 * 1024;
+  size_t parts = std::max((size_t) 1, std::min((size_t) threads * 4, par.text().size() / min_chunk));
+  std::vector<std::string_view> pieces = par.split(parts);
+  std::vector<chunk_index> chunks(pieces.size());
+
+  parallelFor(pieces.size(), threads, [&](size_t i){ indexChunk(pieces[i], chunks[i]); });
+
+  size_t shards = threads;
+  parallelFor(shards, threads, [&](size_t s){ mergeShard(chunks, s, shards); });
+
+  // numbering: first appearances chunk by chunk
+  parallelFor(chunks.size(), threads, [&](size_t i){
+      chunk_index& c = chunks[i];
+      c.new_files = c.new_tags = 0;
+      for(size_t e = 0; e < c.events.size(); ++e){
+	if(c.status[e] != chunk_index::FIRST) continue;
+	if(c.events[e].is_tag) c.new_tags++; else c.new_files++;
+      }
+    });
+  std::vector<size_t> file_base(chunks.size()), tag_base(chunks.size());
+  size_t files_total = 0, tags_total = 0;
+  for(size_t i = 0; i < chunks.size(); ++i){
+    file_base[i] = files_total;
+    tag_base[i] = tags_total;
+    files_total += chunks[i].new_files;
+    tags_total += chunks[i].new_tags;
+  }
+  std::vector<std::string_view> files_by_id(files_total), tags_by_id(tags_total);
+  parallelFor(chunks.size(), threads, [&](size_t i){
+      chunk_index& c = chunks[i];
+      size_t next_file = file_base[i], next_tag = tag_base[i];
+      for(size_t e = 0; e < c.events.size(); ++e){
+	if(c.status[e] != chunk_index::FIRST) continue;
+	if(c.events[e].is_tag){
+	  tags_by_id[next_tag] = c.events[e].name;
+	  c.ids[e] = next_tag++;
+	}else{
+	  files_by_id[next_file] = c.events[e].name;
+	  c.ids[e] = next_file++;
+	}
+      }
+    });
+  // duplicates take ids of their first appearances, which are all known now;
+  // then links are translated to the global ids
+  std::vector< std::vector< std::pair<size_t, size_t> > > links(chunks.size());
+  parallelFor(chunks.size(), threads, [&](size_t i){
+      chunk_index& c = chunks[i];
+      for(size_t e = 0; e < c.events.size(); ++e){
+	if(c.status[e] == chunk_index::DUPLICATE){
+	  c.ids[e] = chunks[c.origin[e].first].ids[c.origin[e].second];
+	}
+      }
+      links[i].reserve(c.links.size());
+      for(size_t l = 0; l < c.links.size(); ++l){
+	size_t f = c.ids[c.links[l].first], t = c.ids[c.links[l].second];
+	if(f != dispatcher::NONE && t != dispatcher::NONE) links[i].push_back(std::make_pair(f, t));
+      }
+    });
+
+  // everything is resolved, the dispatcher is built in one go
+  size_t links_total = 0;
+  for(size_t i = 0; i < links.size(); ++i) links_total += links[i].size();
+  dispatcher::builder b;
+  b.reserve(files_total, tags_total, links_total);
+  for(size_t i = 0; i < files_total; ++i) b.addFile(files_by_id[i]);
+  for(size_t i = 0; i < tags_total; ++i) b.addTag(tags_by_id[i]);
+  for(size_t i = 0; i < links.size(); ++i){
+    for(size_t l = 0; l < links[i].size(); ++l) b.addLink(links[i][l].first, links[i][l].second);
+    std::vector< std::pair<size_t, size_t> >().swap(links[i]);
+  }
+  b.build(disp, threads, changes, root);
+}
+
+bool loadStorage(dispatcher& disp, const std::string& storage, unsigned threads, dispatcher::delta *changes,
+		 unsigned root){
+  std::string tags_path = storage + "/.tags";
+  std::string index_path = storage + "/.tags.index";
+  struct stat source;
+  if(stat(tags_path.c_str(), &source) != 0){
+    if(root == 0 && disp.roots() == 1){
+      disp.reset();
+      if(changes != NULL) *changes = dispatcher::delta();
+    }else{
+      // only the files of this root go
+      dispatcher::builder().build(disp, threads, changes, root);
+    }
+    return false;
+  }
+  // a loaded dispatcher is updated in place, which keeps more than the index would
+  if(root == 0 && disp.empty() && tag_index::load(disp, index_path, source)){
+    if(changes != NULL) *changes = dispatcher::delta();
+    return true;
+  }
+  loadTags(disp, tags_path, threads, changes, root);
+  // the storage may be read-only, then the next start parses again
+  tag_index::save(disp, index_path, source);
+  return false;
+}
+
+unsigned loadRoots(dispatcher& disp, const std::vector<std::string>& storages, unsigned threads){
+  if(threads == 0) threads = defaultThreads();
+  // every root is loaded on its own, with its own index; the threads are shared out
+  std::vector<dispatcher> loaded(storages.size());
+  std::vector<char> from_index(storages.size(), 0);
+  unsigned per_root = std::max(1u, threads / (unsigned) std::max((size_t) 1, storages.size()));
+  parallelFor(storages.size(), threads, [&](size_t r){
+      from_index[r] = loadStorage(loaded[r], storages[r], per_root);
+    });
+  disp.reset();
+  if(storages.size() == 1){
+    std::swap(disp, loaded[0]);
+  }else{
+    // built once in bulk, which is cheaper than applying one storage to another
+    dispatcher::builder b;
+    for(size_t r = 0; r < storages.size(); ++r){
+      b.add(loaded[r], r);
+      loaded[r].reset();
+    }
+    b.build(disp, threads);
+  }
+  return std::count(from_index.begin(), from_index.end(), 1);
+}
+
+bool saveTags(const dispatcher& disp, const std::string& path, struct stat *written, unsigned root){
+  char tmp_suffix[32];
+  snprintf(tmp_suffix, sizeof(tmp_suffix), ".tmp%d", (int) getpid());
+  std::string tmp = path + tmp_suffix;
+  FILE *f = fopen(tmp.c_str(), "w");
+  if(f == NULL) return false;
+  std::string section;
+  const posting_list& files = disp.allFiles();
+  for(posting_list::const_iterator it = files.begin(); it != files.end(); ++it){
+    const std::vector<dispatcher::tagid>& tags = disp.tagsOf(*it);
+    // not visible through tags; applyRecord and batches forget a file losing its last
+    // tag, so the mount and .tags agree on which files exist
+    if(tags.empty() || disp.rootOf(*it) != root) continue;
+    section = disp.filename(*it);
+    section += " { ";
+    for(size_t i = 0; i < tags.size(); ++i){
+      if(i != 0) section += ", ";
+      section += disp.tagname(tags[i]);
     }
+    section += " }\n";
+    if(fwrite(section.data(), 1, section.size(), f) != section.size()) break;
   }
+  // the old file is replaced only by complete contents which reached the disk
+  bool ok = !ferror(f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  ok = (fclose(f) == 0) && ok;
+  if(ok && written != NULL) ok = stat(tmp.c_str(), written) == 0;
+  if(ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+  if(!ok) unlink(tmp.c_str());
+  return ok;
 }
 
 std::string extractFilename(std::vector<std::string>& v){
@@ -1,19 +1,77 @@
 #ifndef __UTIL_H
 #define __UTIL_H
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "bitmask.h"
+#include "cache.h"
 #include "dispatch.h"
+#include "posting.h"
 std::vector<std::string> splitPath(const std::string&);
 static inline std::vector<std::string> splitPath(const char *p){
   return splitPath(std::string(p));
 }
-std::pair< std::vector<bool>, std::vector<bool> > directoryStructure(const dispatcher& disp, const std::vector<std::string>& tags);
+std::pair<bitmask, posting_list> directoryStructure(const dispatcher& disp, const std::vector<std::string>& tags);
+// *computed, if given, tells whether the listing wasn't in the cache
+directory_cache::value directoryStructure(const dispatcher& disp, directory_cache& cache, const std::vector<std::string>& tags,
+					  bool *computed = NULL);
+// number of files of the directory, for getattr: from its cached listing if there is
+// one, otherwise only their count is computed and nothing is cached. *subdirs gets the
+// number of subdirectories when the listing was cached or the co-occurrence index has
+// it (see childTagCount), and -1 otherwise
+size_t directoryFileCount(const dispatcher& disp, directory_cache& cache,
+			  const std::vector<std::string>& tags, long *subdirs);
+// the part of the directory whose names start with prefix, found through the order
+// of names (see name_order): the files cost about the number of names with the prefix
+// rather than the size of the directory. Which of the tags are subdirectories is taken
+// from the listing of the directory (see directoryStructure)
+directory_listing completeDirectory(const dispatcher& disp, directory_cache& cache,
+				    const std::vector<std::string>& dir, std::string_view prefix);
+// how many files of the listing have each of its subdirectories, by tag id (0 for other
+// tags); one pass over the files and their tags
+std::vector<size_t> subtagCounts(const dispatcher& disp, const directory_listing& listing);
+// whether every element of the path is a tag or an operator over tags, see query.h
+bool validDirectory(const dispatcher& disp, const std::vector<std::string>& path);
+// whether the file lies in the directory given by the path
 bool doesFileExist(const dispatcher& disp, const std::vector<std::string>& tags, const std::string& filename);
 
+// what an absolute path names. Paths of tags and of files in them are resolved with
+// one hash lookup per element and without allocating; other paths (queries, see
+// query.h) fall back to validDirectory/doesFileExist. The last element goes to name,
+// if given (it points into path)
+enum path_kind { NO_ENTRY, DIRECTORY_ENTRY, FILE_ENTRY };
+path_kind resolvePath(const dispatcher& disp, std::string_view path, std::string_view *name = NULL);
+// the same for name in the directory given by its elements, which must be valid
+path_kind resolveEntry(const dispatcher& disp, const std::vector<std::string>& dir, std::string_view name);
+
 std::string extractFilename(std::vector<std::string>&);
 
-void loadTags(dispatcher& disp, const std::string& path);
+// makes the files of root in disp exactly what the file says; a dispatcher which is not
+// empty is updated by the difference (see dispatcher::builder::build), which is
+// described in changes, if given. threads == 0 means one per cpu
+void loadTags(dispatcher& disp, const std::string& path, unsigned threads = 0,
+	      dispatcher::delta *changes = NULL, unsigned root = 0);
+// loads storage/.tags: an empty dispatcher through the binary index (storage/.tags.index,
+// see tagindex.h) when the index is up to date, otherwise by parsing the text (and
+// updating disp by the difference) and writing a new index.
+// Returns true when the index was used. With a root other than 0, or in a dispatcher
+// holding several roots, only the files of root are replaced and the index is not used
+bool loadStorage(dispatcher& disp, const std::string& storage, unsigned threads = 0,
+		 dispatcher::delta *changes = NULL, unsigned root = 0);
+// makes disp contain the storages, storages[r] as root r: they are loaded in parallel,
+// each through its own index when it can, and merged in order, so a file name found in
+// several storages belongs to the first one. Returns how many were loaded from an index
+unsigned loadRoots(dispatcher& disp, const std::vector<std::string>& storages, unsigned threads = 0);
+// writes disp in the format of .tags (files in order of ids, tags in order of ids) under
+// a temporary name, syncs it and renames it over path, so readers and crashes see either
+// the old or the new contents. The stat of the new file goes to written, if given.
+// Only the files of root are written
+bool saveTags(const dispatcher& disp, const std::string& path, struct stat *written = NULL,
+	      unsigned root = 0);
 
 #endif /* __UTIL_H */
@@ -0,0 +1,89 @@
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "watcher.h"
+
+file_watcher::file_watcher(void) : inotify_fd(-1), wake_fd(-1), worker(), name(), delay_ms(0), changed() { }
+
+file_watcher::~file_watcher(void){
+  stop();
+}
+
+bool file_watcher::start(const std::string& dir, const std::string& file, unsigned delay,
+			 std::function<void(void)> f){
+  stop();
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if(inotify_fd < 0) return false;
+  // close-write covers writing in place, moved-to covers replacing by rename;
+  // deleting alone is ignored, the last contents are better than nothing
+  if(inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+    close(inotify_fd);
+    inotify_fd = -1;
+    return false;
+  }
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  if(wake_fd < 0){
+    close(inotify_fd);
+    inotify_fd = -1;
+    return false;
+  }
+  name = file;
+  delay_ms = delay;
+  changed = f;
+  worker = std::thread([this]{ run(); });
+  return true;
+}
+
+void file_watcher::stop(void){
+  if(!worker.joinable()) return;
+  uint64_t one = 1;
+  ssize_t written = write(wake_fd, &one, sizeof(one));
+  (void) written;
+  worker.join();
+  close(inotify_fd);
+  close(wake_fd);
+  inotify_fd = wake_fd = -1;
+}
+
+void file_watcher::run(void){
+  // events are variable-length records
+  alignas(struct inotify_event) char buf[4096];
+  bool pending = false;
+  while(true){
+    struct pollfd fds[2];
+    fds[0].fd = inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
+    // with a pending change, waiting ends when things get quiet
+    int ready = poll(fds, 2, pending ? (int) delay_ms : -1);
+    if(ready < 0){
+      if(errno == EINTR) continue;
+      return;
+    }
+    if(fds[1].revents != 0) return;
+    if(ready == 0){
+      pending = false;
+      changed();
+      continue;
+    }
+    ssize_t len = read(inotify_fd, buf, sizeof(buf));
+    if(len <= 0) continue;
+    for(char *p = buf; p < buf + len; ){
+      const struct inotify_event *ev = (const struct inotify_event *) p;
+      if(ev->len > 0 && name == ev->name) pending = true;
+      // the directory itself is gone, nothing will come anymore
+      if(ev->mask & IN_IGNORED) return;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef __WATCHER_H
+#define __WATCHER_H
+
+#include <functional>
+#include <string>
+#include <thread>
+
+// watches one file in a directory and calls a function in a background thread when
+// the file gets new contents: written and closed (as trivialtags does, truncating it
+// in place) or renamed over (as editors do). The directory is watched rather than the
+// file, so replacing the file doesn't lose the watch. Bursts of events are merged:
+// the function is called once nothing happened for `delay_ms` milliseconds.
+class file_watcher
+{
+private:
+  int inotify_fd;
+  // written by stop() to wake the thread up
+  int wake_fd;
+  std::thread worker;
+
+  std::string name;
+  unsigned delay_ms;
+  std::function<void(void)> changed;
+
+  file_watcher(const file_watcher&);
+  file_watcher& operator=(const file_watcher&);
+
+  void run(void);
+
+public:
+
+  file_watcher(void);
+  ~file_watcher(void);
+
+  // returns false if the directory can't be watched
+  bool start(const std::string& dir, const std::string& file, unsigned delay, std::function<void(void)> f);
+  // waits for the thread (and a running call of the function) to finish
+  void stop(void);
+};
+
+#endif /* __WATCHER_H */